@@ -0,0 +1,257 @@
+﻿#pragma once
+#include "Containers/ArrayView.h"
+#include "Containers/StringView.h"
+#include "Misc/FileHelper.h"
+
+/**
+ * Single-pass lexer for 3Dmigoto-style decompiled HLSL.
+ *
+ * The source file is read once as ANSI bytes and split into lines and tokens. Tokens and lines only store offsets into
+ * the source buffer, so a whole shader lives in three contiguous per-shader allocations and every field the converter
+ * needs is a FAnsiStringView into that buffer.
+ */
+
+enum class EHlslTokenType : uint8
+{
+    Identifier,
+    Number,
+    Symbol,
+};
+
+struct HlslToken
+{
+    EHlslTokenType Type;
+    int32 Offset;
+    int32 Length;
+};
+
+enum class EHlslLineKind : uint8
+{
+    Other,
+    Texture,
+    Sampler,
+    ConstantBuffer,
+    Input,
+    Output,
+    Instruction,
+    Return,
+};
+
+struct HlslLine
+{
+    EHlslLineKind Kind = EHlslLineKind::Other;
+    // Line text without the line ending
+    int32 Offset = 0;
+    int32 Length = 0;
+    int32 FirstToken = 0;
+    int32 NumTokens = 0;
+};
+
+/** Per-shader arena holding the raw source bytes and the token stream that references them. */
+struct HlslText
+{
+    TArray<uint8> Source;
+    TArray<HlslToken> Tokens;
+    TArray<HlslLine> Lines;
+
+    const ANSICHAR* GetData() const { return reinterpret_cast<const ANSICHAR*>(Source.GetData()); }
+
+    FAnsiStringView GetView(const HlslToken& Token) const { return FAnsiStringView(GetData() + Token.Offset, Token.Length); }
+
+    FAnsiStringView GetView(const HlslLine& Line) const { return FAnsiStringView(GetData() + Line.Offset, Line.Length); }
+
+    /** View spanning from the start of First to the end of Last, including anything in between. */
+    FAnsiStringView GetSpan(const HlslToken& First, const HlslToken& Last) const
+    {
+        return FAnsiStringView(GetData() + First.Offset, Last.Offset + Last.Length - First.Offset);
+    }
+
+    TArrayView<const HlslToken> GetTokens(const HlslLine& Line) const
+    {
+        return TArrayView<const HlslToken>(Tokens.GetData() + Line.FirstToken, Line.NumTokens);
+    }
+};
+
+struct CT_HlslLexer
+{
+public:
+    static bool LoadAndTokenize(const FString& HlslPath, HlslText& OutText)
+    {
+        if (!FFileHelper::LoadFileToArray(OutText.Source, *HlslPath))
+        {
+            return false;
+        }
+        Tokenize(OutText);
+        return true;
+    }
+
+    static void Tokenize(HlslText& Text)
+    {
+        const ANSICHAR* Data = Text.GetData();
+        const int32 Num = Text.Source.Num();
+
+        // Decompiled shaders average a token every few bytes and a line every few dozen, reserve once up front
+        Text.Tokens.Reset(Num / 3 + 16);
+        Text.Lines.Reset(Num / 24 + 4);
+
+        int32 i = 0;
+        // Skip UTF-8 BOM
+        if (Num >= 3 && (uint8) Data[0] == 0xEF && (uint8) Data[1] == 0xBB && (uint8) Data[2] == 0xBF)
+        {
+            i = 3;
+        }
+
+        HlslLine Line;
+        Line.Offset = i;
+        Line.FirstToken = 0;
+        while (i < Num)
+        {
+            const ANSICHAR C = Data[i];
+            if (C == '\n')
+            {
+                FinishLine(Text, Line, i);
+                Line.Offset = ++i;
+                continue;
+            }
+            if (C == ' ' || C == '\t' || C == '\r' || C == '\f' || C == '\v')
+            {
+                ++i;
+                continue;
+            }
+            if (C == '/' && i + 1 < Num && Data[i + 1] == '/')
+            {
+                while (i < Num && Data[i] != '\n')
+                {
+                    ++i;
+                }
+                continue;
+            }
+            if (C == '/' && i + 1 < Num && Data[i + 1] == '*')
+            {
+                i += 2;
+                while (i < Num && !(Data[i] == '*' && i + 1 < Num && Data[i + 1] == '/'))
+                {
+                    if (Data[i] == '\n')
+                    {
+                        FinishLine(Text, Line, i);
+                        Line.Offset = i + 1;
+                    }
+                    ++i;
+                }
+                i = FMath::Min(i + 2, Num);
+                continue;
+            }
+
+            const int32 Start = i;
+            EHlslTokenType Type;
+            if (IsIdentifierStart(C))
+            {
+                Type = EHlslTokenType::Identifier;
+                while (i < Num && IsIdentifierChar(Data[i]))
+                {
+                    ++i;
+                }
+            }
+            else if (IsDigit(C) || (C == '.' && i + 1 < Num && IsDigit(Data[i + 1])))
+            {
+                Type = EHlslTokenType::Number;
+                i = ScanNumber(Data, Num, i);
+            }
+            else
+            {
+                Type = EHlslTokenType::Symbol;
+                i += IsTwoCharSymbol(Data, Num, i) ? 2 : 1;
+            }
+            Text.Tokens.Add({Type, Start, i - Start});
+        }
+        FinishLine(Text, Line, Num);
+    }
+
+    static bool IsDigit(ANSICHAR C) { return C >= '0' && C <= '9'; }
+
+    /** Parse the unsigned integer suffix of an identifier such as t12, cb3 or s0_s, starting at the first digit. */
+    static int32 ParseIndex(FAnsiStringView View)
+    {
+        int32 i = 0;
+        while (i < View.Len() && !IsDigit(View[i]))
+        {
+            ++i;
+        }
+        int32 Value = 0;
+        while (i < View.Len() && IsDigit(View[i]))
+        {
+            Value = Value * 10 + (View[i++] - '0');
+        }
+        return Value;
+    }
+
+    static FString ToString(FAnsiStringView View) { return FString(View.Len(), View.GetData()); }
+
+private:
+    static void FinishLine(HlslText& Text, HlslLine& Line, int32 End)
+    {
+        const ANSICHAR* Data = Text.GetData();
+        while (End > Line.Offset && (Data[End - 1] == '\r'))
+        {
+            --End;
+        }
+        Line.Length = End - Line.Offset;
+        Line.NumTokens = Text.Tokens.Num() - Line.FirstToken;
+        Text.Lines.Add(Line);
+        Line.FirstToken = Text.Tokens.Num();
+    }
+
+    static bool IsIdentifierStart(ANSICHAR C) { return (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z') || C == '_'; }
+
+    static bool IsIdentifierChar(ANSICHAR C) { return IsIdentifierStart(C) || IsDigit(C); }
+
+    static int32 ScanNumber(const ANSICHAR* Data, int32 Num, int32 i)
+    {
+        if (Data[i] == '0' && i + 1 < Num && (Data[i + 1] == 'x' || Data[i + 1] == 'X'))
+        {
+            i += 2;
+            while (i < Num && FChar::IsHexDigit(Data[i]))
+            {
+                ++i;
+            }
+        }
+        else
+        {
+            while (i < Num && (IsDigit(Data[i]) || Data[i] == '.'))
+            {
+                ++i;
+            }
+            if (i < Num && (Data[i] == 'e' || Data[i] == 'E'))
+            {
+                const int32 Exponent = i + 1 < Num && (Data[i + 1] == '+' || Data[i + 1] == '-') ? i + 2 : i + 1;
+                if (Exponent < Num && IsDigit(Data[Exponent]))
+                {
+                    i = Exponent;
+                    while (i < Num && IsDigit(Data[i]))
+                    {
+                        ++i;
+                    }
+                }
+            }
+        }
+        // Literal suffixes, e.g. 1.0f or 0x10u
+        while (i < Num && (Data[i] == 'f' || Data[i] == 'F' || Data[i] == 'u' || Data[i] == 'U' || Data[i] == 'l' || Data[i] == 'L' ||
+                              Data[i] == 'h' || Data[i] == 'H'))
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    static bool IsTwoCharSymbol(const ANSICHAR* Data, int32 Num, int32 i)
+    {
+        if (i + 1 >= Num)
+        {
+            return false;
+        }
+        const ANSICHAR A = Data[i];
+        const ANSICHAR B = Data[i + 1];
+        return (B == '=' && (A == '=' || A == '!' || A == '<' || A == '>')) || (A == '&' && B == '&') || (A == '|' && B == '|') ||
+               (A == '<' && B == '<') || (A == '>' && B == '>');
+    }
+};
@@ -0,0 +1,319 @@
+﻿#include "CT_ImportCommandlet.h"
+
+#include "Algo/Count.h"
+#include "AssetRegistry/AssetRegistryModule.h"
+#include "CT_EditorLibrary.h"
+#include "EditorLoadingAndSavingUtils.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/OutputDevice.h"
+
+DEFINE_LOG_CATEGORY_STATIC(LogCTImportCommandlet, Log, All);
+
+namespace
+{
+/** Counts the errors and warnings logged while it is registered, so the exit code covers failures deep in the import. */
+class FImportLogCounter : public FOutputDevice
+{
+public:
+    FImportLogCounter() { GLog->AddOutputDevice(this); }
+    virtual ~FImportLogCounter() override { GLog->RemoveOutputDevice(this); }
+
+    virtual void Serialize(const TCHAR* Message, ELogVerbosity::Type Verbosity, const FName& Category) override
+    {
+        if (Verbosity == ELogVerbosity::Error || Verbosity == ELogVerbosity::Fatal)
+        {
+            NumErrors++;
+        }
+        else if (Verbosity == ELogVerbosity::Warning)
+        {
+            NumWarnings++;
+        }
+    }
+
+    virtual bool CanBeUsedOnAnyThread() const override { return true; }
+
+    std::atomic<int32> NumErrors = 0;
+    std::atomic<int32> NumWarnings = 0;
+};
+
+/** Wall time of each import step, in the order they ran. */
+struct FImportTimings
+{
+    TArray<TPair<FString, double>> Steps;
+    double StepStart = FPlatformTime::Seconds();
+
+    void Lap(const TCHAR* Step)
+    {
+        const double Now = FPlatformTime::Seconds();
+        Steps.Add({Step, Now - StepStart});
+        StepStart = Now;
+    }
+};
+
+bool ImportMap(const FCharmConfig& Config, const FString& TargetDirectory, const TArray<UStaticMesh*>& Meshes)
+{
+    const FString MapName = Config.MeshName.IsEmpty() ? FPaths::GetBaseFilename(Config.FilePath) : Config.MeshName;
+    const FString LevelPath = TargetDirectory / "Maps" / MapName;
+    UWorld* World = UEditorLoadingAndSavingUtils::NewBlankMap(false);
+    if (!World)
+    {
+        UE_LOG(LogCTImportCommandlet, Error, TEXT("Failed to create a level for map %s."), *MapName);
+        return false;
+    }
+    if (!FCharmEditorLibrary::PlaceMapInstances(Config, Meshes))
+    {
+        return false;
+    }
+    if (!UEditorLoadingAndSavingUtils::SaveMap(World, LevelPath))
+    {
+        UE_LOG(LogCTImportCommandlet, Error, TEXT("Failed to save level %s."), *LevelPath);
+        return false;
+    }
+    return true;
+}
+
+/** A worker process importing one shard of the statics. */
+struct FImportWorker
+{
+    FProcHandle Process;
+    FString ManifestPath;
+    FString SummaryPath;
+};
+
+/**
+ * Import the statics' meshes and textures with headless workers on the same project, NumWorkers shards at once. Each
+ * worker starts from its own copy of the manifest and its signatures are merged back into the main manifest afterwards,
+ * so the coordinator's ImportStatics only has the materials left to build. A full import forgets the materials' signatures
+ * too, the coordinator itself then runs incrementally.
+ *
+ * @param OutWorkerSummaries The summary each worker wrote.
+ * @return true if every worker succeeded.
+ */
+bool RunWorkers(const FCharmExport& Export, const FString& ExportDirectory, const FString& TargetDirectory, int32 NumWorkers,
+    bool bFull, TArray<TSharedPtr<FJsonValue>>& OutWorkerSummaries)
+{
+    const FString ManifestPath = FCharmImportManifest::GetDefaultPath();
+    const FString WorkerDirectory = FPaths::ProjectSavedDir() / TEXT("CharmTunnel/Workers");
+    const FString ProjectPath = FPaths::ConvertRelativePathToFull(FPaths::GetProjectFilePath());
+    TArray<FImportWorker> Workers;
+    for (int32 Shard = 0; Shard < NumWorkers; Shard++)
+    {
+        FImportWorker& Worker = Workers.AddDefaulted_GetRef();
+        Worker.ManifestPath = FPaths::ConvertRelativePathToFull(WorkerDirectory / FString::Printf(TEXT("ImportManifest.%d.json"), Shard));
+        Worker.SummaryPath = FPaths::ConvertRelativePathToFull(WorkerDirectory / FString::Printf(TEXT("ImportSummary.%d.json"), Shard));
+        const FString LogPath = FPaths::ConvertRelativePathToFull(WorkerDirectory / FString::Printf(TEXT("Import.%d.log"), Shard));
+        const FString ReportPath = FPaths::ConvertRelativePathToFull(WorkerDirectory / FString::Printf(TEXT("ImportReport.%d.csv"), Shard));
+        IFileManager::Get().Delete(*Worker.SummaryPath);
+        // A full import starts the workers from an empty manifest instead of passing -Full, so they still record what they built
+        if (bFull || IFileManager::Get().Copy(*Worker.ManifestPath, *ManifestPath) != COPY_OK)
+        {
+            IFileManager::Get().Delete(*Worker.ManifestPath);
+        }
+
+        const FString Args = FString::Printf(TEXT("\"%s\" -run=CharmTunnelImport -Export=\"%s\" -Target=%s -Shard=%d -ShardCount=%d ")
+                                                 TEXT("-CharmImportManifest=\"%s\" -CharmImportReport=\"%s\" -Summary=\"%s\" ")
+                                                 TEXT("-abslog=\"%s\" -MemoryBudget=%d -nullrhi -unattended -nopause -nosplash -nosound"),
+            *ProjectPath, *FPaths::ConvertRelativePathToFull(ExportDirectory), *TargetDirectory, Shard, NumWorkers, *Worker.ManifestPath,
+            *ReportPath, *Worker.SummaryPath, *LogPath, CVarCharmImportMemoryBudget.GetValueOnGameThread());
+        Worker.Process = FPlatformProcess::CreateProc(FPlatformProcess::ExecutablePath(), *Args, false, true, true, nullptr, 0, nullptr,
+            nullptr);
+        if (!Worker.Process.IsValid())
+        {
+            UE_LOG(LogCTImportCommandlet, Error, TEXT("Failed to start import worker %d."), Shard);
+        }
+    }
+
+    bool bSuccess = true;
+    FCharmImportManifest Manifest;
+    Manifest.Load(ManifestPath);
+    for (int32 Shard = 0; Shard < NumWorkers; Shard++)
+    {
+        FImportWorker& Worker = Workers[Shard];
+        int32 ReturnCode = 1;
+        if (Worker.Process.IsValid())
+        {
+            FPlatformProcess::WaitForProc(Worker.Process);
+            FPlatformProcess::GetProcReturnCode(Worker.Process, &ReturnCode);
+            FPlatformProcess::CloseProc(Worker.Process);
+        }
+        if (ReturnCode != 0)
+        {
+            UE_LOG(LogCTImportCommandlet, Error, TEXT("Import worker %d failed with code %d, see %s."), Shard, ReturnCode,
+                *Worker.SummaryPath);
+            bSuccess = false;
+        }
+
+        // Whatever a failed worker did record is still valid
+        FCharmImportManifest WorkerManifest;
+        if (WorkerManifest.Load(Worker.ManifestPath))
+        {
+            Manifest.Merge(WorkerManifest);
+        }
+        FString SummaryContents;
+        TSharedPtr<FJsonObject> WorkerSummary;
+        if (FFileHelper::LoadFileToString(SummaryContents, *Worker.SummaryPath) &&
+            FJsonSerializer::Deserialize(TJsonReaderFactory<>::Create(SummaryContents), WorkerSummary) && WorkerSummary.IsValid())
+        {
+            OutWorkerSummaries.Add(MakeShared<FJsonValueObject>(WorkerSummary));
+        }
+    }
+    if (bFull)
+    {
+        for (const auto& Pair : Export.Materials)
+        {
+            Manifest.Forget(TargetDirectory / "Materials" / Pair.Key);
+        }
+    }
+    Manifest.Save();
+
+    // The workers' packages were written behind this process' back
+    IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+    AssetRegistry.ScanPathsSynchronous({TargetDirectory}, true);
+    return bSuccess;
+}
+
+bool WriteSummary(const FString& SummaryPath, const TSharedRef<FJsonObject>& Summary)
+{
+    FString FileContents;
+    const TSharedRef<TJsonWriter<>> JsonWriter = TJsonWriterFactory<>::Create(&FileContents);
+    return FJsonSerializer::Serialize(Summary, JsonWriter) && FFileHelper::SaveStringToFile(FileContents, *SummaryPath);
+}
+}    // namespace
+
+int32 UCharmTunnelImportCommandlet::Main(const FString& Params)
+{
+    FString ExportDirectory;
+    FString TargetDirectory;
+    FString SummaryPath = FPaths::ProjectSavedDir() / TEXT("CharmTunnel/ImportSummary.json");
+    FParse::Value(*Params, TEXT("Export="), ExportDirectory);
+    FParse::Value(*Params, TEXT("Target="), TargetDirectory);
+    FParse::Value(*Params, TEXT("Summary="), SummaryPath);
+    int32 NumWorkers = 0;
+    int32 Shard = 0;
+    int32 NumShards = 0;
+    FParse::Value(*Params, TEXT("Workers="), NumWorkers);
+    FParse::Value(*Params, TEXT("Shard="), Shard);
+    FParse::Value(*Params, TEXT("ShardCount="), NumShards);
+    int32 MemoryBudget = 0;
+    if (FParse::Value(*Params, TEXT("MemoryBudget="), MemoryBudget))
+    {
+        CVarCharmImportMemoryBudget->Set(MemoryBudget, ECVF_SetByCode);
+    }
+    const bool bWorker = NumShards > 0;
+    if (ExportDirectory.IsEmpty() || TargetDirectory.IsEmpty() || (bWorker && (Shard < 0 || Shard >= NumShards)))
+    {
+        UE_LOG(LogCTImportCommandlet, Error,
+            TEXT("Usage: -run=CharmTunnelImport -Export=<ExportDirectory> -Target=<ContentPath> [-Full] [-Workers=<Count>] ")
+                TEXT("[-MemoryBudget=<MiB>] [-Summary=<File>]"));
+        return 1;
+    }
+    const bool bFull = FParse::Param(*Params, TEXT("Full"));
+    if (bFull && NumWorkers <= 1)
+    {
+        CVarCharmIncrementalImport->Set(false, ECVF_SetByCode);
+    }
+
+    const FString MeshDirectory = FCharmEditorLibrary::GetStaticMeshDirectory(TargetDirectory);
+    FImportLogCounter LogCounter;
+    const FCharmImportReport::FImport ImportReport;
+    FImportTimings Timings;
+    const double Start = FPlatformTime::Seconds();
+
+    // Maps add the statics they place, so workers shard those too and the maps only have placements left
+    const FCharmExport Export =
+        FCharmExport::Merge(FCharmExport::LoadConfigs(FCharmEditorLibrary::GetFilesInDirectory(ExportDirectory, TEXT("*_info.cfg"))));
+    const int32 NumConfigs = Export.Configs.Num();
+    const FCharmMeshBuildProfile Profile = FCharmMeshBuildProfile::Load(ExportDirectory);
+    Timings.Lap(TEXT("Configs"));
+
+    bool bSuccess = NumConfigs > 0;
+    int32 NumMeshes = 0;
+    TArray<UStaticMesh*> Meshes;
+    TArray<TSharedPtr<FJsonValue>> WorkerSummaries;
+    if (Export.MeshPaths.Num() > 0)
+    {
+        if (bWorker)
+        {
+            const int32 NumShardMeshes = (Export.MeshPaths.Num() - Shard + NumShards - 1) / NumShards;
+            NumMeshes = FCharmEditorLibrary::ImportStaticsShard(Export, TargetDirectory, MeshDirectory, Profile, Shard, NumShards).Num();
+            bSuccess &= NumMeshes == NumShardMeshes;
+        }
+        else
+        {
+            if (NumWorkers > 1)
+            {
+                bSuccess &= RunWorkers(Export, ExportDirectory, TargetDirectory, NumWorkers, bFull, WorkerSummaries);
+                Timings.Lap(TEXT("Workers"));
+            }
+            Meshes = FCharmEditorLibrary::ImportStatics(Export, TargetDirectory, MeshDirectory, Profile);
+            NumMeshes = Meshes.Num();
+            bSuccess &= NumMeshes == Export.MeshPaths.Num();
+        }
+    }
+    Timings.Lap(TEXT("Statics"));
+
+    // Levels place meshes of every shard, workers leave them to the coordinator
+    int32 NumMaps = 0;
+    const int32 NumMapConfigs =
+        Algo::CountIf(Export.Configs, [](const FCharmConfig& Config) { return Config.Instances.Num() > 0; });
+    if (!bWorker)
+    {
+        for (const FCharmConfig& Config : Export.Configs)
+        {
+            if (Config.Instances.Num() == 0)
+            {
+                continue;
+            }
+            NumMaps += ImportMap(Config, TargetDirectory, Meshes) ? 1 : 0;
+            // Levels saved before this one were replaced by a blank map, collecting frees their actors and instance data
+            if (FCharmImportMemoryBudget::IsExceeded())
+            {
+                CollectGarbage(GARBAGE_COLLECTION_KEEPFLAGS);
+            }
+        }
+        bSuccess &= NumMaps == NumMapConfigs;
+        Timings.Lap(TEXT("Maps"));
+    }
+
+    bSuccess &= UEditorLoadingAndSavingUtils::SaveDirtyPackages(false, true);
+    Timings.Lap(TEXT("Save"));
+
+    const double TotalSeconds = FPlatformTime::Seconds() - Start;
+    bSuccess &= LogCounter.NumErrors.load() == 0;
+
+    const TSharedRef<FJsonObject> Summary = MakeShared<FJsonObject>();
+    Summary->SetBoolField(TEXT("Success"), bSuccess);
+    Summary->SetStringField(TEXT("Export"), ExportDirectory);
+    Summary->SetStringField(TEXT("Target"), TargetDirectory);
+    Summary->SetNumberField(TEXT("Configs"), NumConfigs);
+    Summary->SetNumberField(TEXT("Meshes"), NumMeshes);
+    Summary->SetNumberField(TEXT("Maps"), NumMaps);
+    Summary->SetNumberField(TEXT("Errors"), LogCounter.NumErrors.load());
+    Summary->SetNumberField(TEXT("Warnings"), LogCounter.NumWarnings.load());
+    const TSharedRef<FJsonObject> Seconds = MakeShared<FJsonObject>();
+    for (const TPair<FString, double>& Step : Timings.Steps)
+    {
+        Seconds->SetNumberField(Step.Key, Step.Value);
+    }
+    Seconds->SetNumberField(TEXT("Total"), TotalSeconds);
+    Summary->SetObjectField(TEXT("Seconds"), Seconds);
+    if (bWorker)
+    {
+        Summary->SetNumberField(TEXT("Shard"), Shard);
+    }
+    if (WorkerSummaries.Num() > 0)
+    {
+        Summary->SetArrayField(TEXT("Workers"), WorkerSummaries);
+    }
+    if (!WriteSummary(SummaryPath, Summary))
+    {
+        UE_LOG(LogCTImportCommandlet, Error, TEXT("Failed to write the import summary %s."), *SummaryPath);
+        bSuccess = false;
+    }
+
+    UE_LOG(LogCTImportCommandlet, Display, TEXT("Imported %d configs, %d meshes and %d of %d maps in %.1fs with %d errors, summary in %s"),
+        NumConfigs, NumMeshes, NumMaps, NumMapConfigs, TotalSeconds, LogCounter.NumErrors.load(), *SummaryPath);
+    return bSuccess ? 0 : 1;
+}
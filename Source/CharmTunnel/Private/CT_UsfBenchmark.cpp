@@ -0,0 +1,382 @@
+﻿#include "CT_UsfBenchmarkCommandlet.h"
+
+#include "CT_EditorLibrary.h"
+#include "CT_UsfConverter.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMemory.h"
+#include "HAL/PlatformTime.h"
+
+/**
+ * Console microbenchmark for USF emission.
+ *
+ * CharmTunnel.BenchUsfEmission <ExportDirectory> [Iterations] converts the pixel shader of every material in the export with
+ * the USF cache off and reports the emit stage's time and the writer's buffer growths and copied bytes per shader, next to
+ * the same numbers for the per-line emission the writer replaced, run over the lines of each converted shader.
+ *
+ * UCharmUsfBenchmarkCommandlet runs the whole converter headless over an export and checks it against golden outputs.
+ */
+
+DEFINE_LOG_CATEGORY_STATIC(LogCTUsfBenchmark, Log, All);
+
+namespace
+{
+/** Count a string or array whose capacity may have changed, the way UsfWriter counts its buffer growths. */
+void CountGrowth(int32 OldMax, int32 NewMax, int64 OldBytes, UsfEmitStats& Stats)
+{
+    if (NewMax != OldMax)
+    {
+        Stats.Allocations++;
+        Stats.BytesCopied += OldBytes;
+    }
+}
+
+/**
+ * The emission UsfWriter replaced: every line was formatted into its own FString and added to Shader->UsfLines, which were then
+ * joined with UsfString += Line + "\r\n" and copied into UsfContents. Runs it over the lines of Usf, measuring every string
+ * and array it allocates.
+ */
+FString EmitByLineJoin(const FString& Usf, UsfEmitStats& Stats)
+{
+    TArray<FString> UsfLines;
+    const TCHAR* Text = *Usf;
+    const int32 Len = Usf.Len();
+    for (int32 LineStart = 0; LineStart < Len;)
+    {
+        int32 LineEnd = LineStart;
+        while (LineEnd < Len && !(Text[LineEnd] == '\r' && LineEnd + 1 < Len && Text[LineEnd + 1] == '\n'))
+        {
+            LineEnd++;
+        }
+        const int32 OldLinesMax = UsfLines.Max();
+        const int32 OldLinesNum = UsfLines.Num();
+        const FString& Line = UsfLines.Emplace_GetRef(LineEnd - LineStart, Text + LineStart);
+        CountGrowth(OldLinesMax, UsfLines.Max(), OldLinesNum * sizeof(FString), Stats);
+        CountGrowth(0, Line.GetCharArray().Max(), 0, Stats);
+        Stats.BytesCopied += Line.Len() * sizeof(TCHAR);
+        LineStart = LineEnd + 2;
+    }
+
+    FString UsfString;
+    for (FString Line : UsfLines)
+    {
+        CountGrowth(0, Line.GetCharArray().Max(), 0, Stats);
+        Stats.BytesCopied += Line.Len() * sizeof(TCHAR);
+
+        // The Line + "\r\n" temporary, then appending it
+        const FString Joined = Line + "\r\n";
+        CountGrowth(0, Joined.GetCharArray().Max(), 0, Stats);
+        Stats.BytesCopied += Joined.Len() * sizeof(TCHAR);
+        const int32 OldMax = UsfString.GetCharArray().Max();
+        const int32 OldLen = UsfString.Len();
+        UsfString += Joined;
+        CountGrowth(OldMax, UsfString.GetCharArray().Max(), OldLen * sizeof(TCHAR), Stats);
+        Stats.BytesCopied += Joined.Len() * sizeof(TCHAR);
+    }
+    FString UsfContents = UsfString;
+    CountGrowth(0, UsfContents.GetCharArray().Max(), 0, Stats);
+    Stats.BytesCopied += UsfContents.Len() * sizeof(TCHAR);
+    return UsfContents;
+}
+
+TArray<UsfConversionRequest> GatherRequests(const FString& ExportDirectory)
+{
+    const FCharmExport Export =
+        FCharmExport::Merge(FCharmExport::LoadConfigs(FCharmEditorLibrary::GetFilesInDirectory(ExportDirectory, "*_info.cfg")));
+    TArray<UsfConversionRequest> Requests;
+    for (const auto& Pair : Export.Materials)
+    {
+        Requests.Add({Pair.Key, Pair.Value.Material, Pair.Value.SourceDirectory / "Shaders" / "PS_" + Pair.Key + ".hlsl", PixelShader});
+    }
+    return Requests;
+}
+
+void BenchUsfEmission(const TArray<FString>& Args)
+{
+    if (Args.Num() < 1)
+    {
+        UE_LOG(LogCTUsfBenchmark, Warning, TEXT("Usage: CharmTunnel.BenchUsfEmission <ExportDirectory> [Iterations]"));
+        return;
+    }
+    const int32 Iterations = Args.Num() > 1 ? FMath::Max(1, FCString::Atoi(*Args[1])) : 1;
+    const TArray<UsfConversionRequest> Requests = GatherRequests(Args[0]);
+    if (Requests.Num() == 0)
+    {
+        UE_LOG(LogCTUsfBenchmark, Warning, TEXT("No materials found in %s"), *Args[0]);
+        return;
+    }
+
+    // Every iteration has to run the emitters, not read the cache
+    const bool bCacheWasEnabled = CT_UsfCache::IsEnabled();
+    CVarCharmUsfCache->Set(false, ECVF_SetByCode);
+
+    int32 NumShaders = 0;
+    int32 NumMismatched = 0;
+    UsfEmitStats WriterStats;
+    UsfEmitStats LineJoinStats;
+    double EmitSeconds = 0;
+    double LineJoinSeconds = 0;
+    double ConvertSeconds = 0;
+    for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
+    {
+        const double ConvertStart = FPlatformTime::Seconds();
+        const TArray<UsfConversionResult> Results = CT_UsfConverter::ConvertBatch(Requests);
+        ConvertSeconds += FPlatformTime::Seconds() - ConvertStart;
+
+        for (const UsfConversionResult& Result : Results)
+        {
+            if (!Result.bSuccess)
+            {
+                continue;
+            }
+            NumShaders++;
+            WriterStats.Allocations += Result.Shader->EmitStats.Allocations;
+            WriterStats.BytesCopied += Result.Shader->EmitStats.BytesCopied;
+            EmitSeconds += Result.Shader->StageTimes.Emit;
+
+            const double LineJoinStart = FPlatformTime::Seconds();
+            const FString LineJoin = EmitByLineJoin(Result.Shader->UsfContents, LineJoinStats);
+            LineJoinSeconds += FPlatformTime::Seconds() - LineJoinStart;
+            if (!LineJoin.Equals(Result.Shader->UsfContents, ESearchCase::CaseSensitive))
+            {
+                NumMismatched++;
+            }
+        }
+    }
+    CVarCharmUsfCache->Set(bCacheWasEnabled, ECVF_SetByCode);
+
+    if (NumShaders == 0)
+    {
+        UE_LOG(LogCTUsfBenchmark, Warning, TEXT("No shaders converted"));
+        return;
+    }
+    UE_LOG(LogCTUsfBenchmark, Log, TEXT("%d shaders x %d iterations, full conversion %.2f ms/shader, emit %.3f ms/shader"),
+        NumShaders / Iterations, Iterations, ConvertSeconds * 1000.0 / NumShaders, EmitSeconds * 1000.0 / NumShaders);
+    UE_LOG(LogCTUsfBenchmark, Log, TEXT("Writer: %.2f buffer allocations/shader, %.1f KiB copied/shader"),
+        (double) WriterStats.Allocations / NumShaders, WriterStats.BytesCopied / 1024.0 / NumShaders);
+    UE_LOG(LogCTUsfBenchmark, Log, TEXT("Line join: %.2f allocations/shader, %.1f KiB copied/shader, %.3f ms/shader"),
+        (double) LineJoinStats.Allocations / NumShaders, LineJoinStats.BytesCopied / 1024.0 / NumShaders,
+        LineJoinSeconds * 1000.0 / NumShaders);
+    if (NumMismatched > 0)
+    {
+        UE_LOG(LogCTUsfBenchmark, Error, TEXT("%d shaders differ between the writer and the line join"), NumMismatched);
+    }
+}
+
+/** Bytes a converted shader holds on to after each stage, summed or maxed over shaders. */
+struct StageMemory
+{
+    int64 Hlsl = 0;
+    int64 Instructions = 0;
+    int64 Usf = 0;
+
+    static StageMemory Of(const UsfShader& Shader)
+    {
+        StageMemory Memory;
+        Memory.Hlsl = Shader.Hlsl.Source.GetAllocatedSize() + Shader.Hlsl.Tokens.GetAllocatedSize() + Shader.Hlsl.Lines.GetAllocatedSize();
+        Memory.Instructions = Shader.Instructions.GetAllocatedSize() + Shader.Reads.GetAllocatedSize() +
+                              Shader.Substitutions.GetAllocatedSize() + Shader.SubstitutionText.GetAllocatedSize();
+        Memory.Usf = Shader.UsfContents.GetAllocatedSize();
+        return Memory;
+    }
+};
+
+bool CompareWithGolden(const UsfConversionResult& Result, const FString& GoldenDirectory, bool bWriteGolden)
+{
+    const FString GoldenPath = GoldenDirectory / "PS_" + Result.Name + ".usf";
+    if (bWriteGolden)
+    {
+        return FFileHelper::SaveStringToFile(Result.Shader->UsfContents, *GoldenPath, FFileHelper::EEncodingOptions::ForceUTF8);
+    }
+    FString Golden;
+    if (!FFileHelper::LoadFileToString(Golden, *GoldenPath))
+    {
+        UE_LOG(LogCTUsfBenchmark, Error, TEXT("Missing golden output %s"), *GoldenPath);
+        return false;
+    }
+    if (!Golden.Equals(Result.Shader->UsfContents, ESearchCase::CaseSensitive))
+    {
+        UE_LOG(LogCTUsfBenchmark, Error, TEXT("%s differs from %s"), *Result.Name, *GoldenPath);
+        return false;
+    }
+    return true;
+}
+
+bool IsSameAfterCache(const UsfShader& Stored, const UsfShader& Loaded)
+{
+    if (!Loaded.UsfContents.Equals(Stored.UsfContents, ESearchCase::CaseSensitive) || Loaded.Samplers != Stored.Samplers ||
+        Loaded.bHasOpacityMasked != Stored.bHasOpacityMasked || Loaded.Textures.Num() != Stored.Textures.Num() ||
+        Loaded.ConstantBuffers.Num() != Stored.ConstantBuffers.Num() || Loaded.Inputs.Num() != Stored.Inputs.Num() ||
+        Loaded.Outputs.Num() != Stored.Outputs.Num())
+    {
+        return false;
+    }
+    for (int32 Index = 0; Index < Stored.ConstantBuffers.Num(); Index++)
+    {
+        const UsfConstantBuffer& A = Stored.ConstantBuffers[Index];
+        const UsfConstantBuffer& B = Loaded.ConstantBuffers[Index];
+        if (!A.Variable.Equals(B.Variable) || !A.Type.Equals(B.Type) || A.Count != B.Count || A.Index != B.Index ||
+            A.bTrimmed != B.bTrimmed || A.Elements != B.Elements)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Store a converted shader in the USF cache under a key of its own and load it back, then do the same with the element list
+ * of its last constant buffer emptied. That is what every buffer looks like with CharmTunnel.UsfOptimize off.
+ */
+bool CheckCacheRoundTrip(const UsfConversionResult& Result)
+{
+    UsfShader Probe(Result.Shader->HlslPath, Result.Shader->Type);
+    Probe.Textures = Result.Shader->Textures;
+    Probe.ConstantBuffers = Result.Shader->ConstantBuffers;
+    Probe.Inputs = Result.Shader->Inputs;
+    Probe.Outputs = Result.Shader->Outputs;
+    Probe.Samplers = Result.Shader->Samplers;
+    Probe.bHasOpacityMasked = Result.Shader->bHasOpacityMasked;
+    Probe.UsfContents = Result.Shader->UsfContents;
+
+    // A converter version no conversion uses keeps these entries apart from the real ones
+    const FTCHARToUTF8 Name(*Result.Name);
+    const TArray<uint8> NameBytes(reinterpret_cast<const uint8*>(Name.Get()), Name.Length());
+    const FSHAHash Key = CT_UsfCache::MakeKey(-1, 0, Probe.Type, NameBytes, {}, {});
+    for (int32 Pass = 0; Pass < (Probe.ConstantBuffers.Num() > 0 ? 2 : 1); Pass++)
+    {
+        if (Pass == 1)
+        {
+            Probe.ConstantBuffers.Last().Elements.Reset();
+        }
+        CT_UsfCache::Store(Key, Probe);
+        UsfShader Loaded(Probe.HlslPath, Probe.Type);
+        const bool bSame = CT_UsfCache::Load(Key, Loaded) && IsSameAfterCache(Probe, Loaded);
+        CT_UsfCache::Remove(Key);
+        if (!bSame)
+        {
+            UE_LOG(LogCTUsfBenchmark, Error, TEXT("%s does not survive the usf cache%s"), *Result.Name,
+                Pass == 1 ? TEXT(" with an empty last constant buffer") : TEXT(""));
+            return false;
+        }
+    }
+    return true;
+}
+}    // namespace
+
+int32 UCharmUsfBenchmarkCommandlet::Main(const FString& Params)
+{
+    FString ExportDirectory;
+    FString GoldenDirectory;
+    int32 Iterations = 1;
+    FParse::Value(*Params, TEXT("Export="), ExportDirectory);
+    FParse::Value(*Params, TEXT("Golden="), GoldenDirectory);
+    FParse::Value(*Params, TEXT("Iterations="), Iterations);
+    const bool bWriteGolden = FParse::Param(*Params, TEXT("WriteGolden"));
+    const bool bCheckCache = FParse::Param(*Params, TEXT("CheckCache"));
+    Iterations = FMath::Max(1, Iterations);
+    if (ExportDirectory.IsEmpty() || (bWriteGolden && GoldenDirectory.IsEmpty()))
+    {
+        UE_LOG(LogCTUsfBenchmark, Error,
+            TEXT("Usage: -run=CharmUsfBenchmark -Export=<ExportDirectory> [-Golden=<Directory>] [-WriteGolden] [-CheckCache] ")
+                TEXT("[-Iterations=N]"));
+        return 1;
+    }
+
+    const TArray<UsfConversionRequest> Requests = GatherRequests(ExportDirectory);
+    if (Requests.Num() == 0)
+    {
+        UE_LOG(LogCTUsfBenchmark, Error, TEXT("No materials found in %s"), *ExportDirectory);
+        return 1;
+    }
+
+    // Measure the converter itself, not the cache
+    CVarCharmUsfCache->Set(false, ECVF_SetByCode);
+
+    int32 NumConverted = 0;
+    int32 NumFailed = 0;
+    int32 NumMismatched = 0;
+    int32 NumCacheMismatched = 0;
+    int64 HlslBytes = 0;
+    int64 UsfBytes = 0;
+    double WallSeconds = 0;
+    UsfStageTimes Times;
+    UsfEmitStats WriterStats;
+    StageMemory TotalMemory;
+    StageMemory PeakMemory;
+    for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
+    {
+        const double Start = FPlatformTime::Seconds();
+        const TArray<UsfConversionResult> Results = CT_UsfConverter::ConvertBatch(Requests);
+        WallSeconds += FPlatformTime::Seconds() - Start;
+
+        for (const UsfConversionResult& Result : Results)
+        {
+            if (!Result.bSuccess)
+            {
+                NumFailed += Iteration == 0 ? 1 : 0;
+                continue;
+            }
+            const UsfShader& Shader = *Result.Shader;
+            NumConverted++;
+            HlslBytes += Shader.Hlsl.Source.Num();
+            UsfBytes += Shader.UsfContents.Len() * sizeof(TCHAR);
+            Times += Shader.StageTimes;
+            WriterStats.Allocations += Shader.EmitStats.Allocations;
+            WriterStats.BytesCopied += Shader.EmitStats.BytesCopied;
+            const StageMemory Memory = StageMemory::Of(Shader);
+            TotalMemory.Hlsl += Memory.Hlsl;
+            TotalMemory.Instructions += Memory.Instructions;
+            TotalMemory.Usf += Memory.Usf;
+            PeakMemory.Hlsl = FMath::Max(PeakMemory.Hlsl, Memory.Hlsl);
+            PeakMemory.Instructions = FMath::Max(PeakMemory.Instructions, Memory.Instructions);
+            PeakMemory.Usf = FMath::Max(PeakMemory.Usf, Memory.Usf);
+
+            if (Iteration == 0 && !GoldenDirectory.IsEmpty() && !CompareWithGolden(Result, GoldenDirectory, bWriteGolden))
+            {
+                NumMismatched++;
+            }
+            if (Iteration == 0 && bCheckCache && !CheckCacheRoundTrip(Result))
+            {
+                NumCacheMismatched++;
+            }
+        }
+    }
+
+    if (NumConverted == 0)
+    {
+        UE_LOG(LogCTUsfBenchmark, Error, TEXT("No shaders converted"));
+        return 1;
+    }
+    const double PerShader = 1000.0 / NumConverted;
+    UE_LOG(LogCTUsfBenchmark, Display, TEXT("%d shaders x %d iterations, %d failed"), Requests.Num(), Iterations, NumFailed);
+    UE_LOG(LogCTUsfBenchmark, Display, TEXT("Throughput: %.1f shaders/s, hlsl %.2f MiB/s in, usf %.2f MiB/s out"),
+        NumConverted / WallSeconds, HlslBytes / 1048576.0 / WallSeconds, UsfBytes / 1048576.0 / WallSeconds);
+    UE_LOG(LogCTUsfBenchmark, Display,
+        TEXT("Stages (ms/shader): load %.3f, parse %.3f, instructions %.3f, fold %.3f, optimize %.3f, emit %.3f"),
+        Times.Load * PerShader, Times.Parse * PerShader, Times.Instructions * PerShader, Times.Fold * PerShader,
+        Times.Optimize * PerShader, Times.Emit * PerShader);
+    UE_LOG(LogCTUsfBenchmark, Display, TEXT("Writer: %.2f allocations/shader, %.1f KiB copied/shader"),
+        (double) WriterStats.Allocations / NumConverted, WriterStats.BytesCopied / 1024.0 / NumConverted);
+    UE_LOG(LogCTUsfBenchmark, Display, TEXT("Memory (KiB/shader avg/max): hlsl %.1f/%.1f, instructions %.1f/%.1f, usf %.1f/%.1f"),
+        TotalMemory.Hlsl / 1024.0 / NumConverted, PeakMemory.Hlsl / 1024.0, TotalMemory.Instructions / 1024.0 / NumConverted,
+        PeakMemory.Instructions / 1024.0, TotalMemory.Usf / 1024.0 / NumConverted, PeakMemory.Usf / 1024.0);
+    UE_LOG(LogCTUsfBenchmark, Display, TEXT("Process peak memory: %.1f MiB"),
+        FPlatformMemory::GetStats().PeakUsedPhysical / 1048576.0);
+    if (bWriteGolden)
+    {
+        UE_LOG(LogCTUsfBenchmark, Display, TEXT("Wrote golden outputs to %s"), *GoldenDirectory);
+    }
+    else if (!GoldenDirectory.IsEmpty())
+    {
+        UE_LOG(LogCTUsfBenchmark, Display, TEXT("Golden comparison: %d of %d differ"), NumMismatched, Requests.Num() - NumFailed);
+    }
+    if (bCheckCache)
+    {
+        UE_LOG(LogCTUsfBenchmark, Display, TEXT("Cache round trip: %d of %d differ"), NumCacheMismatched, Requests.Num() - NumFailed);
+    }
+    return NumFailed > 0 || NumMismatched > 0 || NumCacheMismatched > 0 ? 1 : 0;
+}
+
+static FAutoConsoleCommand BenchUsfEmissionCommand(TEXT("CharmTunnel.BenchUsfEmission"),
+    TEXT("CharmTunnel.BenchUsfEmission <ExportDirectory> [Iterations]. Measure USF emission allocations against the old line join."),
+    FConsoleCommandWithArgsDelegate::CreateStatic(&BenchUsfEmission));
@@ -0,0 +1,278 @@
+﻿#pragma once
+#include "CT_UsfShader.h"
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformTLS.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/SecureHash.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+/**
+ * Content-addressed on-disk cache for converted USF.
+ *
+ * Entries are keyed by a SHA1 of everything the conversion reads (HLSL bytes, constant buffer values, the output conversion
+ * snippet) plus the converter version and options, and live under Intermediate/CharmTunnel/UsfCache. A hit restores UsfContents and the
+ * parsed declarations without running the converter.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTUsfCache, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTUsfCache);
+
+inline TAutoConsoleVariable<bool> CVarCharmUsfCache(TEXT("CharmTunnel.UsfCache"), true,
+    TEXT("Reuse converted USF from Intermediate/CharmTunnel/UsfCache when the converter inputs are unchanged."));
+
+struct UsfCacheStats
+{
+    int32 Hits;
+    int32 Misses;
+    int32 Writes;
+};
+
+struct CT_UsfCache
+{
+public:
+    static bool IsEnabled() { return CVarCharmUsfCache.GetValueOnAnyThread(); }
+
+    static FSHAHash MakeKey(int32 ConverterVersion, uint32 ConverterOptions, EShaderType ShaderType, const TArray<uint8>& HlslSource,
+        const TArray<uint8>& ConstantBuffers, const TArray<uint8>& OutputConversion)
+    {
+        FSHA1 Sha;
+        int32 Header[3] = {ConverterVersion, (int32) ConverterOptions, (int32) ShaderType};
+        Sha.Update(reinterpret_cast<const uint8*>(Header), sizeof(Header));
+        UpdateWithArray(Sha, HlslSource.GetData(), HlslSource.Num());
+        UpdateWithArray(Sha, ConstantBuffers.GetData(), ConstantBuffers.Num());
+        UpdateWithArray(Sha, OutputConversion.GetData(), OutputConversion.Num());
+        Sha.Final();
+
+        FSHAHash Key;
+        Sha.GetHash(Key.Hash);
+        return Key;
+    }
+
+    /**
+     * Restore a converted shader from the cache.
+     *
+     * @param Key Key built with MakeKey.
+     * @param Shader Shader to fill. Its Hlsl.Source is replaced by the cached declaration strings.
+     * @return true on a cache hit.
+     */
+    static bool Load(const FSHAHash& Key, UsfShader& Shader)
+    {
+        TArray<uint8> Bytes;
+        if (!FFileHelper::LoadFileToArray(Bytes, *GetEntryPath(Key), FILEREAD_Silent))
+        {
+            GetCounters().Misses.Increment();
+            return false;
+        }
+
+        FMemoryReader Ar(Bytes);
+        uint32 Magic = 0;
+        int32 FormatVersion = 0;
+        Ar << Magic << FormatVersion;
+        if (Magic != EntryMagic || FormatVersion != EntryFormatVersion)
+        {
+            GetCounters().Misses.Increment();
+            return false;
+        }
+
+        TArray<int32> Views;
+        FString UsfContents;
+        TArray<int32> Indices;
+        TArray<int32> Samplers;
+        TArray<int32> ElementLists;
+        bool bHasOpacityMasked = false;
+        int32 NumTextures = 0, NumConstantBuffers = 0, NumInputs = 0, NumOutputs = 0;
+        Ar << UsfContents << Shader.Hlsl.Source << Views << Indices << Samplers << ElementLists << bHasOpacityMasked;
+        Ar << NumTextures << NumConstantBuffers << NumInputs << NumOutputs;
+        const int32 ExpectedViews = 2 * (3 * NumTextures + 2 * NumConstantBuffers + 3 * NumInputs + 3 * NumOutputs);
+        const int32 ExpectedIndices = NumTextures + 2 * NumConstantBuffers + NumInputs + NumOutputs;
+        if (Ar.IsError() || Views.Num() != ExpectedViews || Indices.Num() != ExpectedIndices)
+        {
+            UE_LOG(LogCTUsfCache, Warning, TEXT("Corrupt usf cache entry %s, ignoring."), *Key.ToString());
+            Shader.Hlsl.Source.Reset();
+            GetCounters().Misses.Increment();
+            return false;
+        }
+
+        int32 NextView = 0;
+        int32 NextIndex = 0;
+        auto ReadView = [&]() -> FAnsiStringView
+        {
+            const int32 Offset = Views[NextView++];
+            const int32 Length = Views[NextView++];
+            return FAnsiStringView(Shader.Hlsl.GetData() + Offset, Length);
+        };
+
+        Shader.Textures.SetNum(NumTextures);
+        for (UsfTexture& Texture : Shader.Textures)
+        {
+            Texture.Dimension = ReadView();
+            Texture.Type = ReadView();
+            Texture.Variable = ReadView();
+            Texture.Index = Indices[NextIndex++];
+        }
+        Shader.ConstantBuffers.SetNum(NumConstantBuffers);
+        int32 NextElement = 0;
+        for (UsfConstantBuffer& ConstantBuffer : Shader.ConstantBuffers)
+        {
+            ConstantBuffer.Variable = ReadView();
+            ConstantBuffer.Type = ReadView();
+            ConstantBuffer.Count = Indices[NextIndex++];
+            ConstantBuffer.Index = Indices[NextIndex++];
+            // [bTrimmed, NumElements, Elements...] per buffer
+            if (NextElement + 2 > ElementLists.Num() || NextElement + 2 + ElementLists[NextElement + 1] > ElementLists.Num())
+            {
+                UE_LOG(LogCTUsfCache, Warning, TEXT("Corrupt usf cache entry %s, ignoring."), *Key.ToString());
+                Shader.Hlsl.Source.Reset();
+                GetCounters().Misses.Increment();
+                return false;
+            }
+            ConstantBuffer.bTrimmed = ElementLists[NextElement] != 0;
+            // Through GetData, the list of an empty last buffer starts one past the end of ElementLists
+            ConstantBuffer.Elements.Append(ElementLists.GetData() + NextElement + 2, ElementLists[NextElement + 1]);
+            NextElement += 2 + ElementLists[NextElement + 1];
+        }
+        Shader.Inputs.SetNum(NumInputs);
+        for (UsfInput& Input : Shader.Inputs)
+        {
+            Input.Variable = ReadView();
+            Input.Type = ReadView();
+            Input.Semantic = ReadView();
+            Input.Index = Indices[NextIndex++];
+        }
+        Shader.Outputs.SetNum(NumOutputs);
+        for (UsfOutput& Output : Shader.Outputs)
+        {
+            Output.Variable = ReadView();
+            Output.Type = ReadView();
+            Output.Semantic = ReadView();
+            Output.Index = Indices[NextIndex++];
+        }
+
+        Shader.UsfContents = MoveTemp(UsfContents);
+        Shader.Samplers = MoveTemp(Samplers);
+        Shader.bHasOpacityMasked = bHasOpacityMasked;
+        GetCounters().Hits.Increment();
+        return true;
+    }
+
+    /** Write a successfully converted shader to the cache. Safe to call from multiple threads. */
+    static void Store(const FSHAHash& Key, const UsfShader& Shader)
+    {
+        // Pack every declaration string into one blob so the entry does not carry the whole HLSL source
+        TArray<uint8> Blob;
+        TArray<int32> Views;
+        TArray<int32> Indices;
+        TArray<int32> ElementLists;
+        auto WriteView = [&](FAnsiStringView View)
+        {
+            Views.Add(Blob.Num());
+            Views.Add(View.Len());
+            Blob.Append(reinterpret_cast<const uint8*>(View.GetData()), View.Len());
+        };
+
+        for (const UsfTexture& Texture : Shader.Textures)
+        {
+            WriteView(Texture.Dimension);
+            WriteView(Texture.Type);
+            WriteView(Texture.Variable);
+            Indices.Add(Texture.Index);
+        }
+        for (const UsfConstantBuffer& ConstantBuffer : Shader.ConstantBuffers)
+        {
+            WriteView(ConstantBuffer.Variable);
+            WriteView(ConstantBuffer.Type);
+            Indices.Add(ConstantBuffer.Count);
+            Indices.Add(ConstantBuffer.Index);
+            ElementLists.Add(ConstantBuffer.bTrimmed ? 1 : 0);
+            ElementLists.Add(ConstantBuffer.Elements.Num());
+            ElementLists.Append(ConstantBuffer.Elements);
+        }
+        for (const UsfInput& Input : Shader.Inputs)
+        {
+            WriteView(Input.Variable);
+            WriteView(Input.Type);
+            WriteView(Input.Semantic);
+            Indices.Add(Input.Index);
+        }
+        for (const UsfOutput& Output : Shader.Outputs)
+        {
+            WriteView(Output.Variable);
+            WriteView(Output.Type);
+            WriteView(Output.Semantic);
+            Indices.Add(Output.Index);
+        }
+
+        TArray<uint8> Bytes;
+        FMemoryWriter Ar(Bytes);
+        uint32 Magic = EntryMagic;
+        int32 FormatVersion = EntryFormatVersion;
+        FString UsfContents = Shader.UsfContents;
+        TArray<int32> Samplers = Shader.Samplers;
+        bool bHasOpacityMasked = Shader.bHasOpacityMasked;
+        int32 NumTextures = Shader.Textures.Num();
+        int32 NumConstantBuffers = Shader.ConstantBuffers.Num();
+        int32 NumInputs = Shader.Inputs.Num();
+        int32 NumOutputs = Shader.Outputs.Num();
+        Ar << Magic << FormatVersion;
+        Ar << UsfContents << Blob << Views << Indices << Samplers << ElementLists << bHasOpacityMasked;
+        Ar << NumTextures << NumConstantBuffers << NumInputs << NumOutputs;
+
+        // Write to a per-thread temp file and move it into place so concurrent writers of the same key never interleave
+        const FString EntryPath = GetEntryPath(Key);
+        const FString TempPath = FString::Printf(TEXT("%s.%u.tmp"), *EntryPath, FPlatformTLS::GetCurrentThreadId());
+        if (!FFileHelper::SaveArrayToFile(Bytes, *TempPath) || !IFileManager::Get().Move(*EntryPath, *TempPath, true, true))
+        {
+            UE_LOG(LogCTUsfCache, Warning, TEXT("Failed to write usf cache entry %s."), *EntryPath);
+            IFileManager::Get().Delete(*TempPath, false, false, true);
+            return;
+        }
+        GetCounters().Writes.Increment();
+    }
+
+    /** Delete an entry, if there is one. */
+    static void Remove(const FSHAHash& Key) { IFileManager::Get().Delete(*GetEntryPath(Key), false, false, true); }
+
+    static FString GetCacheDirectory() { return FPaths::ProjectIntermediateDir() / TEXT("CharmTunnel/UsfCache"); }
+
+    static UsfCacheStats GetStats()
+    {
+        return {GetCounters().Hits.GetValue(), GetCounters().Misses.GetValue(), GetCounters().Writes.GetValue()};
+    }
+
+    static void ResetStats()
+    {
+        GetCounters().Hits.Reset();
+        GetCounters().Misses.Reset();
+        GetCounters().Writes.Reset();
+    }
+
+private:
+    static constexpr uint32 EntryMagic = 0x43545553;    // "CTUS"
+    static constexpr int32 EntryFormatVersion = 2;
+
+    struct Counters
+    {
+        FThreadSafeCounter Hits;
+        FThreadSafeCounter Misses;
+        FThreadSafeCounter Writes;
+    };
+
+    static Counters& GetCounters()
+    {
+        static Counters Instance;
+        return Instance;
+    }
+
+    static FString GetEntryPath(const FSHAHash& Key) { return GetCacheDirectory() / Key.ToString() + TEXT(".usfc"); }
+
+    static void UpdateWithArray(FSHA1& Sha, const uint8* Data, int32 Num)
+    {
+        // Length prefix so adjacent inputs cannot alias each other
+        Sha.Update(reinterpret_cast<const uint8*>(&Num), sizeof(Num));
+        Sha.Update(Data, Num);
+    }
+};
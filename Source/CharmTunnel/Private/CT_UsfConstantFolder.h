@@ -0,0 +1,742 @@
+﻿#pragma once
+#include "CT_ConfigModel.h"
+#include "CT_UsfOptimizer.h"
+#include "HAL/IConsoleManager.h"
+
+/**
+ * Folds known constant buffer values into a converted shader.
+ *
+ * Every constant buffer value is known at import time, so literal reads such as cb0[3].xy can become immediates. Assignments
+ * are evaluated as small expression trees in float32; the largest constant subtrees are replaced by their value, and registers
+ * written with a constant outside of any block carry that value forward to later reads. Buffers that are indexed dynamically
+ * anywhere are left alone, as is anything the evaluator does not understand and any result that is not finite.
+ *
+ * Runs between ConvertInstructions and the optimizer, which then drops the definitions whose reads were all folded away.
+ */
+
+inline TAutoConsoleVariable<bool> CVarCharmUsfFoldConstants(TEXT("CharmTunnel.UsfFoldConstants"), false,
+    TEXT("Replace constant buffer reads in converted USF with their values and fold the arithmetic that becomes constant."));
+
+/** An evaluated expression over the tokens FirstToken..LastToken of the current line. */
+struct UsfFoldValue
+{
+    bool bConstant = false;
+    // Written as an integer literal, HLSL evaluates arithmetic between two of these as int
+    bool bInteger = false;
+    // A number already spelled out in the source, replacing it gains nothing
+    bool bLiteral = false;
+    int32 Size = 0;
+    float V[4] = {0, 0, 0, 0};
+    int32 FirstToken = 0;
+    int32 LastToken = 0;
+
+    float Get(int32 Component) const { return Size == 1 ? V[0] : V[Component]; }
+};
+
+struct CT_UsfConstantFolder
+{
+public:
+    static bool IsEnabled() { return CVarCharmUsfFoldConstants.GetValueOnAnyThread(); }
+
+    /**
+     * Queue substitutions that fold constants into the shader's instructions.
+     *
+     * @param Shader Shader after ConvertInstructions.
+     * @param Stage The material's PS or VS info holding the constant buffer values.
+     * @return Number of substitutions made.
+     */
+    static int32 Fold(UsfShader& Shader, const FCharmShaderStage& Stage)
+    {
+        CT_UsfConstantFolder Folder(Shader);
+        Folder.LoadConstantBuffers(Stage);
+        Folder.Run();
+        return Folder.NumFolded;
+    }
+
+private:
+    explicit CT_UsfConstantFolder(UsfShader& InShader) : Shader(InShader), Hlsl(InShader.Hlsl) {}
+
+    UsfShader& Shader;
+    const HlslText& Hlsl;
+    // Values per constant buffer, empty when unknown or when the buffer is indexed dynamically
+    TArray<TArrayView<const FVector4f>> BufferValues;
+    // Known temp register values, four per register, and which of them are valid
+    TArray<float> TempValues;
+    TArray<uint8> TempKnown;
+    bool bPropagate = true;
+    int32 NumFolded = 0;
+
+    // State of the line being evaluated
+    UsfInstruction* Current = nullptr;
+    TArrayView<const HlslToken> Tokens;
+    int32 Pos = 0;
+    int32 End = 0;
+    bool bUnknown = false;
+    TArray<UsfFoldValue, TInlineAllocator<8>> Pending;
+
+    void LoadConstantBuffers(const FCharmShaderStage& Stage)
+    {
+        BufferValues.SetNum(Shader.ConstantBuffers.Num());
+        for (int32 b = 0; b < Shader.ConstantBuffers.Num(); b++)
+        {
+            Stage.FindConstantBuffer(Shader.ConstantBuffers[b].Count, BufferValues[b]);
+        }
+
+        // Leave dynamically indexed buffers intact, a literal read might alias an element written through the dynamic index
+        for (const UsfInstruction& Instruction : Shader.Instructions)
+        {
+            const TArrayView<const HlslToken> LineTokens = Hlsl.GetTokens(Hlsl.Lines[Instruction.Line]);
+            for (int32 i = 0; i < LineTokens.Num(); i++)
+            {
+                const int32 Buffer = CT_UsfOptimizer::FindConstantBuffer(Shader, Hlsl.GetView(LineTokens[i]));
+                if (Buffer != INDEX_NONE && !IsLiteralIndex(LineTokens, i))
+                {
+                    BufferValues[Buffer] = TArrayView<const FVector4f>();
+                }
+            }
+        }
+    }
+
+    void Run()
+    {
+        // Without loops, text order is execution order and a depth 0 write always happens before the lines that follow it
+        bPropagate = !CT_UsfOptimizer::HasLoop(Shader);
+        for (UsfInstruction& Instruction : Shader.Instructions)
+        {
+            Current = &Instruction;
+            Tokens = Hlsl.GetTokens(Hlsl.Lines[Instruction.Line]);
+            if (Instruction.bHasDestination)
+            {
+                FoldAssignment(Instruction);
+            }
+            else
+            {
+                // Registers may be written here, e.g. as out arguments, so only constant buffer reads are safe to replace
+                FoldLeaves(0, Tokens.Num(), false);
+                for (const HlslToken& Token : Tokens)
+                {
+                    EUsfRegisterFile File;
+                    int32 Register;
+                    if (CT_UsfOptimizer::ParseRegister(Hlsl.GetView(Token), File, Register) && File == EUsfRegisterFile::Temp)
+                    {
+                        Forget({File, Register, 0xF});
+                    }
+                }
+            }
+        }
+    }
+
+    void FoldAssignment(const UsfInstruction& Instruction)
+    {
+        const bool bHasMask = Hlsl.GetView(Tokens[1]).Equals(".");
+        const int32 Assign = bHasMask ? 3 : 1;
+        const FAnsiStringView Letters = bHasMask ? Hlsl.GetView(Tokens[2]) : FAnsiStringView("xyzw");
+        const int32 Begin = Assign + 1;
+
+        // Everything up to the trailing semicolon
+        Pos = Begin;
+        End = Tokens.Num() - 1;
+        bUnknown = false;
+        Pending.Reset();
+        const UsfFoldValue Value = ParseExpression();
+        const int32 FoldLast = End;
+        const UsfRegisterRef& Destination = Instruction.Destination;
+        if (bUnknown || Pos != End || Begin == End)
+        {
+            FoldLeaves(Begin, FoldLast, true);
+            Forget(Destination);
+            return;
+        }
+
+        if (!Value.bConstant || (Value.Size != 1 && Value.Size < Letters.Len()))
+        {
+            for (const UsfFoldValue& Subtree : Pending)
+            {
+                Substitute(Subtree, Subtree.Size);
+            }
+            Forget(Destination);
+            return;
+        }
+
+        if (!Value.bLiteral)
+        {
+            Substitute(Value, Value.Size == 1 ? 1 : Letters.Len());
+        }
+        if (Instruction.Depth != 0 || !bPropagate || Destination.File != EUsfRegisterFile::Temp)
+        {
+            Forget(Destination);
+            return;
+        }
+        const int32 Register = Destination.Register;
+        Reserve(Register);
+        for (int32 i = 0; i < Letters.Len(); i++)
+        {
+            const int32 Component = CT_UsfOptimizer::GetComponent(Letters[i]);
+            TempValues[Register * 4 + Component] = Value.Get(i);
+            TempKnown[Register] |= 1 << Component;
+        }
+    }
+
+    /** Replace constant buffer reads, and known registers if allowed, between tokens First and Last (exclusive). */
+    void FoldLeaves(int32 First, int32 Last, bool bRegisters)
+    {
+        for (int32 i = First; i < Last; i++)
+        {
+            Pos = i;
+            End = Last;
+            bUnknown = false;
+            UsfFoldValue Value;
+            EUsfRegisterFile File;
+            int32 Register;
+            const FAnsiStringView Name = Hlsl.GetView(Tokens[i]);
+            if (CT_UsfOptimizer::FindConstantBuffer(Shader, Name) != INDEX_NONE && IsLiteralIndex(Tokens, i))
+            {
+                Value = ParseConstantBufferRead();
+            }
+            else if (bRegisters && CT_UsfOptimizer::ParseRegister(Name, File, Register))
+            {
+                Value = ParseRegisterRead();
+            }
+            else
+            {
+                continue;
+            }
+            if (!bUnknown && Value.bConstant)
+            {
+                Substitute(Value, Value.Size);
+            }
+            i = FMath::Max(i, Pos - 1);
+        }
+    }
+
+    UsfFoldValue ParseExpression()
+    {
+        UsfFoldValue Left = ParseTerm();
+        while (!bUnknown && Pos < End && (IsSymbol(Pos, "+") || IsSymbol(Pos, "-")))
+        {
+            const ANSICHAR Op = Hlsl.GetView(Tokens[Pos++])[0];
+            const UsfFoldValue Right = ParseTerm();
+            Left = Combine(Op, Left, Right);
+        }
+        return Left;
+    }
+
+    UsfFoldValue ParseTerm()
+    {
+        UsfFoldValue Left = ParseUnary();
+        while (!bUnknown && Pos < End && (IsSymbol(Pos, "*") || IsSymbol(Pos, "/")))
+        {
+            const ANSICHAR Op = Hlsl.GetView(Tokens[Pos++])[0];
+            const UsfFoldValue Right = ParseUnary();
+            Left = Combine(Op, Left, Right);
+        }
+        return Left;
+    }
+
+    UsfFoldValue ParseUnary()
+    {
+        if (Pos < End && (IsSymbol(Pos, "-") || IsSymbol(Pos, "+")))
+        {
+            const int32 First = Pos;
+            const bool bNegate = IsSymbol(Pos++, "-");
+            UsfFoldValue Value = ParseUnary();
+            Value.FirstToken = First;
+            for (int32 i = 0; i < Value.Size && bNegate; i++)
+            {
+                Value.V[i] = -Value.V[i];
+            }
+            return Value;
+        }
+        return ParsePostfix();
+    }
+
+    UsfFoldValue ParsePostfix()
+    {
+        UsfFoldValue Value = ParsePrimary();
+        if (!bUnknown && Pos + 1 < End && IsSymbol(Pos, "."))
+        {
+            const FAnsiStringView Swizzle = Hlsl.GetView(Tokens[Pos + 1]);
+            if (CT_UsfOptimizer::ParseMask(Swizzle) == 0)
+            {
+                bUnknown = true;
+                return Value;
+            }
+            Pos += 2;
+            Value.LastToken = Pos - 1;
+            Value.bLiteral = false;
+            if (Value.bConstant && !ApplySwizzle(Value, Swizzle))
+            {
+                Value.bConstant = false;
+            }
+        }
+        return Value;
+    }
+
+    UsfFoldValue ParsePrimary()
+    {
+        UsfFoldValue Value;
+        if (Pos >= End)
+        {
+            bUnknown = true;
+            return Value;
+        }
+        Value.FirstToken = Value.LastToken = Pos;
+        const HlslToken& Token = Tokens[Pos];
+        const FAnsiStringView Text = Hlsl.GetView(Token);
+        EUsfRegisterFile File;
+        int32 Register;
+
+        if (Token.Type == EHlslTokenType::Number)
+        {
+            Pos++;
+            return ParseNumber(Text, Value);
+        }
+        if (IsSymbol(Pos, "("))
+        {
+            const int32 Open = Pos++;
+            Value = ParseExpression();
+            if (bUnknown || Pos >= End || !IsSymbol(Pos, ")"))
+            {
+                bUnknown = true;
+                return Value;
+            }
+            Value.FirstToken = Open;
+            Value.LastToken = Pos++;
+            Value.bLiteral = false;
+            return Value;
+        }
+        if (Token.Type != EHlslTokenType::Identifier)
+        {
+            bUnknown = true;
+            return Value;
+        }
+        if (CT_UsfOptimizer::ParseRegister(Text, File, Register))
+        {
+            return ParseRegisterRead();
+        }
+        if (CT_UsfOptimizer::FindConstantBuffer(Shader, Text) != INDEX_NONE)
+        {
+            if (!IsLiteralIndex(Tokens, Pos))
+            {
+                bUnknown = true;
+                return Value;
+            }
+            return ParseConstantBufferRead();
+        }
+        if (Pos + 1 < End && IsSymbol(Pos + 1, "("))
+        {
+            return ParseCall();
+        }
+        if (Pos + 1 < End && IsSymbol(Pos + 1, ".") && Pos + 3 < End && IsSymbol(Pos + 3, "("))
+        {
+            // Method call such as t0.Sample(...)
+            bUnknown = true;
+            return Value;
+        }
+
+        // Inputs and anything else that is not known until the shader runs
+        Pos++;
+        if (Pos + 1 < End && IsSymbol(Pos, ".") && CT_UsfOptimizer::ParseMask(Hlsl.GetView(Tokens[Pos + 1])) != 0)
+        {
+            Pos += 2;
+        }
+        Value.LastToken = Pos - 1;
+        return Value;
+    }
+
+    UsfFoldValue ParseNumber(FAnsiStringView Text, UsfFoldValue& Value)
+    {
+        Value.bLiteral = true;
+        // Hex and unsigned literals are bit patterns, not values
+        if (HasAnyChar(Text, "xXuU"))
+        {
+            return Value;
+        }
+        ANSICHAR Buffer[64];
+        const int32 Len = FMath::Min(Text.Len(), (int32) UE_ARRAY_COUNT(Buffer) - 1);
+        FMemory::Memcpy(Buffer, Text.GetData(), Len);
+        Buffer[Len] = 0;
+        Value.bConstant = true;
+        Value.bInteger = !HasAnyChar(Text, ".eE");
+        Value.Size = 1;
+        Value.V[0] = (float) FCStringAnsi::Atod(Buffer);
+        return Value;
+    }
+
+    /** rN or rN.swizzle at Pos. */
+    UsfFoldValue ParseRegisterRead()
+    {
+        UsfFoldValue Value;
+        Value.FirstToken = Value.LastToken = Pos;
+        EUsfRegisterFile File;
+        int32 Register;
+        CT_UsfOptimizer::ParseRegister(Hlsl.GetView(Tokens[Pos++]), File, Register);
+        FAnsiStringView Swizzle("xyzw");
+        if (Pos + 1 < End && IsSymbol(Pos, ".") && CT_UsfOptimizer::ParseMask(Hlsl.GetView(Tokens[Pos + 1])) != 0)
+        {
+            Swizzle = Hlsl.GetView(Tokens[Pos + 1]);
+            Pos += 2;
+            Value.LastToken = Pos - 1;
+        }
+        if (File != EUsfRegisterFile::Temp || !bPropagate || Register >= TempKnown.Num())
+        {
+            return Value;
+        }
+        for (int32 i = 0; i < Swizzle.Len(); i++)
+        {
+            const int32 Component = CT_UsfOptimizer::GetComponent(Swizzle[i]);
+            if ((TempKnown[Register] & (1 << Component)) == 0)
+            {
+                return Value;
+            }
+            Value.V[i] = TempValues[Register * 4 + Component];
+        }
+        Value.bConstant = true;
+        Value.Size = Swizzle.Len();
+        return Value;
+    }
+
+    /** cbN[literal] or cbN[literal].swizzle at Pos. */
+    UsfFoldValue ParseConstantBufferRead()
+    {
+        UsfFoldValue Value;
+        Value.FirstToken = Pos;
+        const int32 Buffer = CT_UsfOptimizer::FindConstantBuffer(Shader, Hlsl.GetView(Tokens[Pos]));
+        const int32 Element = CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[Pos + 2]));
+        Pos += 4;
+        Value.LastToken = Pos - 1;
+        if (!BufferValues[Buffer].IsValidIndex(Element))
+        {
+            return Value;
+        }
+        const FVector4f& Element4 = BufferValues[Buffer][Element];
+        Value.bConstant = true;
+        Value.Size = 4;
+        Value.V[0] = Element4.X;
+        Value.V[1] = Element4.Y;
+        Value.V[2] = Element4.Z;
+        Value.V[3] = Element4.W;
+        if (Pos + 1 < End && IsSymbol(Pos, ".") && CT_UsfOptimizer::ParseMask(Hlsl.GetView(Tokens[Pos + 1])) != 0)
+        {
+            ApplySwizzle(Value, Hlsl.GetView(Tokens[Pos + 1]));
+            Pos += 2;
+            Value.LastToken = Pos - 1;
+        }
+        // Checked after the swizzle, a NaN or infinity in a component that is not read does not matter
+        Value.bConstant = IsFinite(Value);
+        return Value;
+    }
+
+    UsfFoldValue ParseCall()
+    {
+        UsfFoldValue Value;
+        Value.FirstToken = Pos;
+        const FAnsiStringView Name = Hlsl.GetView(Tokens[Pos]);
+        Pos += 2;
+        TArray<UsfFoldValue, TInlineAllocator<4>> Args;
+        while (!bUnknown && Pos < End && !IsSymbol(Pos, ")"))
+        {
+            Args.Add(ParseExpression());
+            if (!bUnknown && Pos < End && IsSymbol(Pos, ","))
+            {
+                Pos++;
+            }
+            else if (bUnknown || Pos >= End || !IsSymbol(Pos, ")"))
+            {
+                bUnknown = true;
+            }
+        }
+        if (bUnknown || Pos >= End)
+        {
+            bUnknown = true;
+            return Value;
+        }
+        Value.LastToken = Pos++;
+
+        bool bAllConstant = Args.Num() > 0;
+        bool bAllInteger = true;
+        for (const UsfFoldValue& Arg : Args)
+        {
+            bAllConstant &= Arg.bConstant;
+            bAllInteger &= Arg.bInteger;
+        }
+        // Integer-only arguments keep int semantics, except in a float constructor, which converts them
+        if (bAllConstant && (!bAllInteger || Name.StartsWith("float")) && Evaluate(Name, Args, Value))
+        {
+            return Value;
+        }
+        Value.bConstant = false;
+        for (const UsfFoldValue& Arg : Args)
+        {
+            Defer(Arg);
+        }
+        return Value;
+    }
+
+    UsfFoldValue Combine(ANSICHAR Op, const UsfFoldValue& A, const UsfFoldValue& B)
+    {
+        UsfFoldValue Result;
+        Result.FirstToken = A.FirstToken;
+        Result.LastToken = B.LastToken;
+        if (A.bConstant && B.bConstant && !(A.bInteger && B.bInteger))
+        {
+            Result.bConstant = true;
+            Result.Size = GetResultSize(A.Size, B.Size);
+            for (int32 i = 0; i < Result.Size; i++)
+            {
+                const float X = A.Get(i);
+                const float Y = B.Get(i);
+                Result.V[i] = Op == '+' ? X + Y : Op == '-' ? X - Y : Op == '*' ? X * Y : X / Y;
+            }
+            if (IsFinite(Result))
+            {
+                return Result;
+            }
+            Result.bConstant = false;
+        }
+        Defer(A);
+        Defer(B);
+        return Result;
+    }
+
+    static bool Evaluate(FAnsiStringView Name, TArrayView<const UsfFoldValue> Args, UsfFoldValue& Result)
+    {
+        Result.bConstant = true;
+        if (Name.StartsWith("float"))
+        {
+            // float, float2(x, y), float4(v.xyz, w)
+            const int32 Size = Name.Len() == 5 ? 1 : Name[5] - '0';
+            if (Name.Len() > 6 || Size < 1 || Size > 4)
+            {
+                return false;
+            }
+            int32 Count = 0;
+            for (const UsfFoldValue& Arg : Args)
+            {
+                for (int32 i = 0; i < Arg.Size && Count < 4; i++)
+                {
+                    Result.V[Count++] = Arg.V[i];
+                }
+            }
+            if (Args.Num() == 1 && Args[0].Size == 1)
+            {
+                Count = Size;
+                for (int32 i = 1; i < Size; i++)
+                {
+                    Result.V[i] = Result.V[0];
+                }
+            }
+            Result.Size = Size;
+            return Count == Size;
+        }
+
+        if (Args.Num() == 1)
+        {
+            Result.Size = Args[0].Size;
+            for (int32 i = 0; i < Result.Size; i++)
+            {
+                const float X = Args[0].V[i];
+                if (Name.Equals("saturate"))
+                {
+                    Result.V[i] = FMath::Clamp(X, 0.f, 1.f);
+                }
+                else if (Name.Equals("abs"))
+                {
+                    Result.V[i] = FMath::Abs(X);
+                }
+                else if (Name.Equals("sqrt"))
+                {
+                    Result.V[i] = FMath::Sqrt(X);
+                }
+                else if (Name.Equals("rsqrt"))
+                {
+                    Result.V[i] = 1.f / FMath::Sqrt(X);
+                }
+                else if (Name.Equals("frac"))
+                {
+                    Result.V[i] = X - FMath::FloorToFloat(X);
+                }
+                else if (Name.Equals("floor"))
+                {
+                    Result.V[i] = FMath::FloorToFloat(X);
+                }
+                else if (Name.Equals("ceil"))
+                {
+                    Result.V[i] = FMath::CeilToFloat(X);
+                }
+                else if (Name.Equals("exp2"))
+                {
+                    Result.V[i] = FMath::Exp2(X);
+                }
+                else if (Name.Equals("log2"))
+                {
+                    Result.V[i] = FMath::Log2(X);
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            return IsFinite(Result);
+        }
+
+        if (Args.Num() == 2 && Name.Equals("dot"))
+        {
+            const int32 Size = GetResultSize(Args[0].Size, Args[1].Size);
+            Result.Size = 1;
+            Result.V[0] = 0;
+            for (int32 i = 0; i < Size; i++)
+            {
+                Result.V[0] += Args[0].Get(i) * Args[1].Get(i);
+            }
+            return IsFinite(Result);
+        }
+
+        if (Args.Num() == 2 && (Name.Equals("min") || Name.Equals("max")))
+        {
+            Result.Size = GetResultSize(Args[0].Size, Args[1].Size);
+            for (int32 i = 0; i < Result.Size; i++)
+            {
+                const float X = Args[0].Get(i);
+                const float Y = Args[1].Get(i);
+                Result.V[i] = Name.Equals("min") ? FMath::Min(X, Y) : FMath::Max(X, Y);
+            }
+            return IsFinite(Result);
+        }
+
+        if (Args.Num() == 3 && (Name.Equals("mad") || Name.Equals("lerp") || Name.Equals("clamp")))
+        {
+            Result.Size = GetResultSize(GetResultSize(Args[0].Size, Args[1].Size), Args[2].Size);
+            for (int32 i = 0; i < Result.Size; i++)
+            {
+                const float X = Args[0].Get(i);
+                const float Y = Args[1].Get(i);
+                const float Z = Args[2].Get(i);
+                Result.V[i] = Name.Equals("mad") ? X * Y + Z : Name.Equals("lerp") ? X + (Y - X) * Z : FMath::Clamp(X, Y, Z);
+            }
+            return IsFinite(Result);
+        }
+
+        return false;
+    }
+
+    /** Vector operands of different sizes broadcast scalars and otherwise truncate to the smaller one, as HLSL does. */
+    static int32 GetResultSize(int32 A, int32 B) { return A == 1 ? B : B == 1 ? A : FMath::Min(A, B); }
+
+    static bool ApplySwizzle(UsfFoldValue& Value, FAnsiStringView Swizzle)
+    {
+        float Swizzled[4];
+        for (int32 i = 0; i < Swizzle.Len(); i++)
+        {
+            const int32 Component = CT_UsfOptimizer::GetComponent(Swizzle[i]);
+            if (Component >= Value.Size)
+            {
+                return false;
+            }
+            Swizzled[i] = Value.V[Component];
+        }
+        FMemory::Memcpy(Value.V, Swizzled, Swizzle.Len() * sizeof(float));
+        Value.Size = Swizzle.Len();
+        return true;
+    }
+
+    static bool IsFinite(const UsfFoldValue& Value)
+    {
+        for (int32 i = 0; i < Value.Size; i++)
+        {
+            if (!FMath::IsFinite(Value.V[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** Remember a constant operand of a non-constant expression, replaced only if the whole line parses. */
+    void Defer(const UsfFoldValue& Value)
+    {
+        if (Value.bConstant && !Value.bLiteral)
+        {
+            Pending.Add(Value);
+        }
+    }
+
+    void Substitute(const UsfFoldValue& Value, int32 Size)
+    {
+        TCHAR Text[256];
+        int32 Len = 0;
+        if (Size > 1)
+        {
+            Len += FCString::Snprintf(Text, UE_ARRAY_COUNT(Text), TEXT("float%d("), Size);
+        }
+        for (int32 i = 0; i < Size; i++)
+        {
+            TCHAR Number[64];
+            int32 NumberLen = FCString::Snprintf(Number, UE_ARRAY_COUNT(Number), TEXT("%.9g"), Value.Get(i));
+            // Keep it a float literal so integer arithmetic rules never apply
+            const bool bNeedsPoint = FCString::Strpbrk(Number, TEXT(".e")) == nullptr;
+            const bool bParenthesize = Size == 1 && Number[0] == '-';
+            Len += FCString::Snprintf(Text + Len, UE_ARRAY_COUNT(Text) - Len, TEXT("%s%s%s%s%s"), bParenthesize ? TEXT("(") : TEXT(""),
+                Number, bNeedsPoint ? TEXT(".0") : TEXT(""), bParenthesize ? TEXT(")") : TEXT(""), i + 1 < Size ? TEXT(", ") : TEXT(""));
+        }
+        if (Size > 1)
+        {
+            Len += FCString::Snprintf(Text + Len, UE_ARRAY_COUNT(Text) - Len, TEXT(")"));
+        }
+
+        const int32 LineFirstToken = Hlsl.Lines[Current->Line].FirstToken;
+        const int32 First = LineFirstToken + Value.FirstToken;
+        const int32 Last = LineFirstToken + Value.LastToken;
+        Shader.AddSubstitution(First, Last, FStringView(Text, Len));
+        for (int32 r = Current->FirstRead; r < Current->FirstRead + Current->NumReads; r++)
+        {
+            UsfRegisterRef& Read = Shader.Reads[r];
+            if (Read.Token >= First && Read.Token <= Last)
+            {
+                Read.Mask = 0;
+            }
+        }
+        NumFolded++;
+    }
+
+    void Reserve(int32 Register)
+    {
+        if (TempKnown.Num() <= Register)
+        {
+            TempKnown.SetNumZeroed(Register + 1);
+            TempValues.SetNumZeroed((Register + 1) * 4);
+        }
+    }
+
+    void Forget(const UsfRegisterRef& Ref)
+    {
+        if (Ref.File == EUsfRegisterFile::Temp && Ref.Register < TempKnown.Num())
+        {
+            TempKnown[Ref.Register] &= ~Ref.Mask;
+        }
+    }
+
+    static bool HasAnyChar(FAnsiStringView Text, const ANSICHAR* Chars)
+    {
+        for (const ANSICHAR C : Text)
+        {
+            if (FCStringAnsi::Strchr(Chars, C) != nullptr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool IsSymbol(int32 Index, const ANSICHAR* Symbol) const
+    {
+        return Tokens[Index].Type == EHlslTokenType::Symbol && Hlsl.GetView(Tokens[Index]).Equals(Symbol);
+    }
+
+    /** cbN [ literal ] starting at Index. */
+    bool IsLiteralIndex(TArrayView<const HlslToken> LineTokens, int32 Index) const
+    {
+        return Index + 3 < LineTokens.Num() && Hlsl.GetView(LineTokens[Index + 1]).Equals("[") &&
+               LineTokens[Index + 2].Type == EHlslTokenType::Number && Hlsl.GetView(LineTokens[Index + 3]).Equals("]");
+    }
+};
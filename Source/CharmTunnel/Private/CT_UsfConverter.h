@@ -1,5 +1,13 @@
 ﻿#pragma once
-#include "Dom/JsonObject.h"
+#include "Async/ParallelFor.h"
+#include "CT_ConfigModel.h"
+#include "CT_Stats.h"
+#include "CT_UsfCache.h"
+#include "CT_UsfConstantFolder.h"
+#include "CT_UsfOptimizer.h"
+#include "CT_UsfShader.h"
+#include "CT_UsfWriter.h"
+#include "HAL/PlatformTime.h"
 #include "Misc/FileHelper.h"
 
 /**
@@ -16,133 +24,274 @@ inline DEFINE_LOG_CATEGORY(LogCTUsfConverter);
 
 #define T(x) TEXT(x)
 
-struct UsfTexture
+struct UsfConversionRequest
 {
-    FString Dimension;
-    FString Type;
-    FString Variable;
-    int Index;
+    FString Name;
+    // Shared so requests can outlive the config they were read from, ShaderType picks the stage
+    TSharedPtr<const FCharmMaterial> Material;
+    FString HlslPath;
+    EShaderType ShaderType;
+    bool bParametric = false;
 };
 
-struct UsfConstantBuffer
+struct UsfConversionResult
 {
-    FString Variable;
-    FString Type;
-    int Count;
-    int Index;
+    FString Name;
+    TSharedPtr<UsfShader> Shader;
+    bool bSuccess = false;
 };
 
-struct UsfInput
+struct CT_UsfConverter
 {
-    FString Variable;
-    FString Type;
-    int Index;
-    FString Semantic;
-};
+public:
+    /** Bump whenever a converter change alters the USF produced for the same inputs, this invalidates the USF cache. */
+    static constexpr int32 Version = 7;
 
-struct UsfOutput
-{
-    FString Variable;
-    FString Type;
-    int Index;
-    FString Semantic;
-};
+    /** Converter settings that change the output, part of the cache key. */
+    static constexpr uint32 OptionOptimize = 1 << 0;
+    static constexpr uint32 OptionFoldConstants = 1 << 1;
+    static constexpr uint32 OptionParametric = 1 << 2;
 
-enum EShaderType
-{
-    PixelShader,
-    VertexShader,
-};
+    /** Options a conversion with the current settings runs with. */
+    static uint32 GetOptions(bool bParametric)
+    {
+        // Parametric shaders get their constant buffer values from the material, there is nothing to fold
+        const bool bFoldConstants = CT_UsfConstantFolder::IsEnabled() && !bParametric;
+        return (CT_UsfOptimizer::IsEnabled() ? OptionOptimize : 0) | (bFoldConstants ? OptionFoldConstants : 0) |
+               (bParametric ? OptionParametric : 0);
+    }
 
-struct UsfShader
-{
-    EShaderType Type;
-    TArray<UsfTexture> Textures;
-    TArray<UsfConstantBuffer> ConstantBuffers;
-    TArray<UsfInput> Inputs;
-    TArray<UsfOutput> Outputs;
-    TArray<int> Samplers;
-    bool bHasOpacityMasked;
+    static TSharedRef<UsfShader> ConvertFromHlsl(
+        const FCharmShaderStage& Stage, FString HlslPath, EShaderType ShaderType, bool& bOutSuccess, bool bParametric = false)
+    {
+        TSharedRef<UsfShader> Shader = MakeShareable(new UsfShader(HlslPath, ShaderType));
+        Shader->bParametric = bParametric;
+        TArray<uint8> OutputConversion;
+        bOutSuccess = LoadOutputConversion(OutputConversion, Shader->Error) &&
+                      Convert(Stage, Shader, OutputConversion, CT_UsfOptimizer::GetOutputUsage(OutputConversion));
+        if (!bOutSuccess)
+        {
+            LOG_ERROR("%s", *Shader->Error);
+        }
+        return Shader;
+    }
 
-    FString HlslPath;
-    TArray<FString> HlslLines;
-    TArray<FString> UsfLines;
-    FString UsfContents;
+    /**
+     * Convert many shaders in parallel on the task graph. Conversion is pure text processing so it never touches UObjects;
+     * failures are not logged per shader but merged into a single report once every conversion has finished.
+     *
+     * @param Requests The shaders to convert.
+     * @return One result per request, in request order.
+     */
+    static TArray<UsfConversionResult> ConvertBatch(const TArray<UsfConversionRequest>& Requests)
+    {
+        CHARM_IMPORT_STAGE(UsfConversion);
+        TArray<UsfConversionResult> Results;
+        Results.SetNum(Requests.Num());
 
-    UsfShader(FString InHlslPath, EShaderType InType) : Type(InType), bHasOpacityMasked(false), HlslPath(InHlslPath) {}
-};
+        TArray<uint8> OutputConversion;
+        FString OutputConversionError;
+        if (!LoadOutputConversion(OutputConversion, OutputConversionError))
+        {
+            LOG_ERROR("%s", *OutputConversionError);
+            return Results;
+        }
+        const UsfOutputUsage OutputUsage = CT_UsfOptimizer::GetOutputUsage(OutputConversion);
 
-struct CT_UsfConverter
-{
-public:
-    static TSharedRef<UsfShader> ConvertFromHlsl(
-        TSharedPtr<FJsonObject> MaterialInfo, FString HlslPath, EShaderType ShaderType, bool& bOutSuccess)
+        ParallelFor(Requests.Num(),
+            [&Requests, &Results, &OutputConversion, &OutputUsage](int32 Index)
+            {
+                const UsfConversionRequest& Request = Requests[Index];
+                TSharedRef<UsfShader> Shader = MakeShareable(new UsfShader(Request.HlslPath, Request.ShaderType));
+                Shader->bParametric = Request.bParametric;
+                Results[Index].Name = Request.Name;
+                const FCharmShaderStage& Stage = Request.ShaderType == VertexShader ? Request.Material->VS : Request.Material->PS;
+                Results[Index].bSuccess = Convert(Stage, Shader, OutputConversion, OutputUsage);
+                Results[Index].Shader = Shader;
+            });
+
+        TStringBuilder<1024> Report;
+        int32 NumFailed = 0;
+        for (const UsfConversionResult& Result : Results)
+        {
+            if (!Result.bSuccess)
+            {
+                NumFailed++;
+                Report.Appendf(T("\n  %s: %s"), *Result.Name, *Result.Shader->Error);
+            }
+        }
+        if (NumFailed > 0)
+        {
+            LOG_ERROR("Failed to convert %d of %d shaders:%s", NumFailed, Results.Num(), Report.ToString());
+        }
+        return Results;
+    }
+
+private:
+    static bool LoadOutputConversion(TArray<uint8>& OutputConversion, FString& OutError)
     {
-        bOutSuccess = false;
-        TSharedRef<UsfShader> Shader = MakeShareable(new UsfShader(HlslPath, ShaderType));
-        if (!ProcessHlslText(Shader))
+        const FString OutputConversionPath = FPaths::ProjectPluginsDir() / T("CharmTunnel/Resources/UsfRTOutputConversion.usf");
+        if (!FFileHelper::LoadFileToArray(OutputConversion, *OutputConversionPath))
         {
-            LOG_ERROR("Failed to process hlsl text");
-            return Shader;
+            OutError = T("Failed to load output conversion file");
+            return false;
         }
-        if (!WriteConstantBuffers(MaterialInfo, Shader))
+        return true;
+    }
+
+    /** Run the whole conversion for one shader. Thread-safe; on failure the reason is left in Shader->Error. */
+    static bool Convert(const FCharmShaderStage& Stage, const TSharedRef<UsfShader>& Shader,
+        const TArray<uint8>& OutputConversion, const UsfOutputUsage& OutputUsage)
+    {
+        CHARM_SCOPE(STAT_CharmUsfConversion, "UsfShader");
+        // Each call books the time since the previous one to a stage
+        uint64 LapStart = FPlatformTime::Cycles64();
+        auto Lap = [&LapStart](double& StageSeconds)
+        {
+            const uint64 Now = FPlatformTime::Cycles64();
+            StageSeconds += FPlatformTime::ToSeconds64(Now - LapStart);
+            LapStart = Now;
+        };
+        UsfStageTimes& Times = Shader->StageTimes;
+
+        const bool bLoaded = FFileHelper::LoadFileToArray(Shader->Hlsl.Source, *Shader->HlslPath);
+        Lap(Times.Load);
+        if (!bLoaded)
         {
-            LOG_ERROR("Failed to write constant buffers");
-            return Shader;
+            Shader->Error = FString::Printf(T("Failed to load hlsl file %s."), *Shader->HlslPath);
+            return false;
         }
-        WriteFunctionDefinition(Shader);
-        if (!ConvertInstructions(Shader))
+
+        const bool bUseCache = CT_UsfCache::IsEnabled();
+        const uint32 Options = GetOptions(Shader->bParametric);
+        const bool bOptimize = (Options & OptionOptimize) != 0;
+        const bool bFoldConstants = (Options & OptionFoldConstants) != 0;
+        FSHAHash CacheKey;
+        if (bUseCache)
         {
-            LOG_ERROR("Failed to convert HLSL instructions to USF");
-            return Shader;
+            CacheKey = CT_UsfCache::MakeKey(
+                Version, Options, Shader->Type, Shader->Hlsl.Source, SerializeConstantBuffers(Stage), OutputConversion);
+            const bool bHit = CT_UsfCache::Load(CacheKey, *Shader);
+            Lap(Times.CacheLookup);
+            if (bHit)
+            {
+                return true;
+            }
+        }
+
+        const bool bProcessed = ProcessHlslText(Shader);
+        Lap(Times.Parse);
+        if (!bProcessed)
+        {
+            Shader->Error = T("Failed to process hlsl text");
+            return false;
+        }
+        const bool bConverted = ConvertInstructions(Shader);
+        Lap(Times.Instructions);
+        if (!bConverted)
+        {
+            Shader->Error = T("Failed to convert HLSL instructions to USF");
+            return false;
+        }
+        if (bFoldConstants)
+        {
+            CT_UsfConstantFolder::Fold(*Shader, Stage);
+            Lap(Times.Fold);
         }
-        if (!WriteOutputs(Shader))
+        if (bOptimize)
         {
-            LOG_ERROR("Failed to write outputs");
-            return Shader;
+            CT_UsfOptimizer::Optimize(*Shader, OutputUsage);
+            Lap(Times.Optimize);
         }
-        WriteFooter(Shader);
 
-        FString UsfString;
-        for (FString Line : Shader->UsfLines)
+        UsfWriter Writer(EstimateUsfLength(*Shader, OutputConversion));
+        if (!WriteConstantBuffers(Stage, Shader, Writer))
         {
-            UsfString += Line + "\r\n";
+            Shader->Error = T("Failed to write constant buffers");
+            return false;
         }
+        WriteFunctionDefinition(Shader, Writer);
+        WriteInstructions(Shader, Writer);
+        if (!WriteOutputs(Shader, OutputConversion, Writer))
+        {
+            Shader->Error = T("Failed to write outputs");
+            return false;
+        }
+        WriteFooter(Shader, Writer);
+
         // FString UsfPath = "C:/T/export/test.usf";
         // FFileHelper::SaveStringToFile(UsfString, *UsfPath);
-        Shader->UsfContents = UsfString;
-        bOutSuccess = true;
-        return Shader;
+        Shader->EmitStats = Writer.GetStats();
+        Shader->UsfContents = Writer.Finish();
+        Lap(Times.Emit);
+        if (bUseCache)
+        {
+            CT_UsfCache::Store(CacheKey, *Shader);
+            Lap(Times.CacheStore);
+        }
+        return true;
     }
 
-private:
-    static bool WriteConstantBuffers(const TSharedPtr<FJsonObject> MaterialInfo, const TSharedRef<UsfShader>& Shader)
+    /**
+     * Upper bound of the generated USF length, so the writer allocates once. The instructions are copied roughly verbatim,
+     * so the HLSL size covers them and the declarations; constant buffer literals and the output conversion are added on top.
+     */
+    static int32 EstimateUsfLength(const UsfShader& Shader, const TArray<uint8>& OutputConversion)
+    {
+        constexpr int32 CharsPerConstant = 64;
+        constexpr int32 CharsPerDeclaration = 64;
+        int32 NumConstants = 0;
+        for (const UsfConstantBuffer& ConstantBuffer : Shader.ConstantBuffers)
+        {
+            NumConstants += ConstantBuffer.Count;
+        }
+        const int32 NumDeclarations = Shader.Textures.Num() + Shader.Inputs.Num() * 2 + Shader.Outputs.Num();
+        return Shader.Hlsl.Source.Num() + Shader.SubstitutionText.Len() + OutputConversion.Num() * 3 / 2 +
+               NumConstants * CharsPerConstant + NumDeclarations * CharsPerDeclaration + 512;
+    }
+
+    static bool WriteConstantBuffers(const FCharmShaderStage& Stage, const TSharedRef<UsfShader>& Shader, UsfWriter& Writer)
     {
+        if (Shader->bParametric)
+        {
+            // Declared as shader members by WriteFunctionDefinition and filled from the custom node inputs by WriteFooter
+            return true;
+        }
         for (auto& ConstantBuffer : Shader->ConstantBuffers)
         {
-            Shader->UsfLines.Add(
-                FString::Printf(T("static %ls %ls[%d] = \r\n{"), *ConstantBuffer.Type, *ConstantBuffer.Variable, ConstantBuffer.Count));
-            if (MaterialInfo->GetObjectField("ConstantBuffers")->HasField(FString::FromInt(ConstantBuffer.Count)))
+            // A trimmed buffer holds only the referenced elements, and nothing at all if none are left
+            const int32 NumElements = ConstantBuffer.bTrimmed ? ConstantBuffer.Elements.Num() : ConstantBuffer.Count;
+            if (NumElements == 0)
+            {
+                continue;
+            }
+            Writer.Append(T("static ")).Append(ConstantBuffer.Type).Append(T(' ')).Append(ConstantBuffer.Variable).Append(T('['));
+            Writer.AppendInt(NumElements).Append(T("] = \r\n{")).NewLine();
+            TArrayView<const FVector4f> Data;
+            if (Stage.FindConstantBuffer(ConstantBuffer.Count, Data))
             {
-                const TArray<TSharedPtr<FJsonValue>>& Data =
-                    MaterialInfo->GetObjectField("ConstantBuffers")->GetArrayField(FString::FromInt(ConstantBuffer.Count));
-                for (auto JsonValue : Data)
+                for (int32 i = 0; i < NumElements; i++)
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("float4(%f, %f, %f, %f),"), JsonValue->AsObject()->GetNumberField("X"),
-                        JsonValue->AsObject()->GetNumberField("Y"), JsonValue->AsObject()->GetNumberField("Z"),
-                        JsonValue->AsObject()->GetNumberField("W")));
+                    const int32 Element = ConstantBuffer.bTrimmed ? ConstantBuffer.Elements[i] : i;
+                    if (!Data.IsValidIndex(Element))
+                    {
+                        Writer.Append(T("float4(1, 1, 1, 1),")).NewLine();
+                        continue;
+                    }
+                    const FVector4f& Value = Data[Element];
+                    Writer.AppendFloat4Literal(Value.X, Value.Y, Value.Z, Value.W).NewLine();
                 }
             }
             else
             {
                 // Doesn't exist, fill in with garbage for now
-                for (int i = 0; i < ConstantBuffer.Count; i++)
+                for (int i = 0; i < NumElements; i++)
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("float4(1, 1, 1, 1),")));
+                    Writer.Append(T("float4(1, 1, 1, 1),")).NewLine();
                 }
             }
 
-            Shader->UsfLines.Add("};\r\n");
+            Writer.Append(T("};\r\n")).NewLine();
         }
 
         return true;
@@ -150,196 +299,248 @@ private:
 
     static bool ProcessHlslText(const TSharedRef<UsfShader>& Shader)
     {
-        FString HlslText;
-        if (!FFileHelper::LoadFileToString(HlslText, *Shader->HlslPath))
-        {
-            LOG_ERROR("Failed to load hlsl file %s.", *Shader->HlslPath);
-            return false;
-        }
+        CT_HlslLexer::Tokenize(Shader->Hlsl);
 
-        int32 LineCount = HlslText.ParseIntoArray(Shader->HlslLines, TEXT("\n"), true);
-        bool bFindOpacity = false;
-        int i = 0;
-        while (++i < LineCount)
+        // Walk the token stream once, classifying each line by where it sits: global declarations, the main signature or
+        // the function body
+        enum class EParseState
         {
-            FString Line = Shader->HlslLines[i];
-
-            if (Line.Contains("r0,r1"))    // at end of function definition
+            Globals,
+            ConstantBuffer,
+            Signature,
+            Body,
+            Done,
+        };
+        EParseState State = EParseState::Globals;
+        HlslText& Hlsl = Shader->Hlsl;
+        for (HlslLine& Line : Hlsl.Lines)
+        {
+            const TArrayView<const HlslToken> Tokens = Hlsl.GetTokens(Line);
+            if (Tokens.Num() == 0 || State == EParseState::Done)
             {
-                bFindOpacity = true;
+                continue;
             }
+            const FAnsiStringView First = Hlsl.GetView(Tokens[0]);
 
-            if (bFindOpacity)
+            switch (State)
             {
-                if (Line.Contains("discard"))
-                {
-                    Shader->bHasOpacityMasked = true;
+                case EParseState::Globals:
+                    if (First.StartsWith("Texture") && Tokens.Num() >= 5)
+                    {
+                        // Texture2D<float4> t0 : register(t0);
+                        UsfTexture Texture;
+                        Texture.Dimension = First;
+                        Texture.Type = Hlsl.GetView(Tokens[2]);
+                        Texture.Variable = Hlsl.GetView(Tokens[4]);
+                        Texture.Index = CT_HlslLexer::ParseIndex(Texture.Variable);
+                        Shader->Textures.Add(Texture);
+                        Line.Kind = EHlslLineKind::Texture;
+                    }
+                    else if (First.Equals("SamplerState"))
+                    {
+                        // SamplerState s0_s : register(s0);
+                        const int32 Register = FindToken(Hlsl, Tokens, "register");
+                        if (Register != INDEX_NONE && Register + 2 < Tokens.Num())
+                        {
+                            Shader->Samplers.Add(CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[Register + 2])));
+                            Line.Kind = EHlslLineKind::Sampler;
+                        }
+                    }
+                    else if (First.Equals("cbuffer"))
+                    {
+                        State = EParseState::ConstantBuffer;
+                    }
+                    else if (First.Equals("void") && Tokens.Num() >= 3 && Hlsl.GetView(Tokens[1]).Equals("main"))
+                    {
+                        // void main(  - parameters normally start on the next line
+                        State = EParseState::Signature;
+                        ParseSignatureLine(Shader, Line, Tokens.Slice(3, Tokens.Num() - 3));
+                    }
                     break;
-                }
-                continue;
-            }
-            if (Line.Contains("Texture"))
-            {
-                UsfTexture Texture;
-                Line.Split(T("<"), &Texture.Dimension, nullptr);
 
-                Line.Split(T("<"), nullptr, &Texture.Type);
-                Texture.Type.Split(T(">"), &Texture.Type, nullptr);
+                case EParseState::ConstantBuffer:
+                    // float4 cb0[16];
+                    if (Tokens.Num() >= 5 && Hlsl.GetView(Tokens[2]).Equals("["))
+                    {
+                        UsfConstantBuffer ConstantBuffer;
+                        ConstantBuffer.Type = First;
+                        ConstantBuffer.Variable = Hlsl.GetView(Tokens[1]);
+                        ConstantBuffer.Index = CT_HlslLexer::ParseIndex(ConstantBuffer.Variable);
+                        ConstantBuffer.Count = CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[3]));
+                        Shader->ConstantBuffers.Add(ConstantBuffer);
+                        Line.Kind = EHlslLineKind::ConstantBuffer;
+                    }
+                    else if (First.Equals("}"))
+                    {
+                        State = EParseState::Globals;
+                    }
+                    break;
 
-                Line.Split(T("> "), nullptr, &Texture.Variable);
-                Texture.Variable.Split(T(" : "), &Texture.Variable, nullptr);
+                case EParseState::Signature:
+                    if (First.Equals("{"))
+                    {
+                        State = EParseState::Body;
+                    }
+                    else
+                    {
+                        ParseSignatureLine(Shader, Line, Tokens);
+                    }
+                    break;
 
-                Texture.Index = FCString::Atoi(*Texture.Variable.RightChop(1));
+                case EParseState::Body:
+                    if (First.Equals("return"))
+                    {
+                        Line.Kind = EHlslLineKind::Return;
+                        State = EParseState::Done;
+                        break;
+                    }
+                    Line.Kind = EHlslLineKind::Instruction;
+                    if (FindToken(Hlsl, Tokens, "discard") != INDEX_NONE)
+                    {
+                        Shader->bHasOpacityMasked = true;
+                    }
+                    break;
 
-                Shader->Textures.Add(Texture);
-            }
-            else if (Line.Contains("SamplerState"))
-            {
-                FString TempState;
-                Line.Split(T("("), nullptr, &TempState);
-                TempState.Split(T(")"), &TempState, nullptr);
-                Shader->Samplers.Add(FCString::Atoi(*TempState.Right(1)));
+                default:
+                    break;
             }
-            else if (Line.Contains("cbuffer"))
-            {
-                ++i;
-                Line = Shader->HlslLines[++i];
-                UsfConstantBuffer ConstantBuffer;
-
-                Line.Split(T("["), &ConstantBuffer.Variable, nullptr);
-                ConstantBuffer.Variable.Split(T(" cb"), nullptr, &ConstantBuffer.Variable);
-                ConstantBuffer.Variable = "cb" + ConstantBuffer.Variable;
-
-                ConstantBuffer.Index = FCString::Atoi(*ConstantBuffer.Variable.RightChop(2));
-
-                FString TempCount;
-                Line.Split(T("["), nullptr, &TempCount);
-                TempCount.Split(T("]"), &TempCount, nullptr);
-                ConstantBuffer.Count = FCString::Atoi(*TempCount);
-
-                Line.Split("cb", &ConstantBuffer.Type, nullptr);
-                ConstantBuffer.Type = ConstantBuffer.Type.TrimStartAndEnd();
+        }
+        return true;
+    }
 
-                Shader->ConstantBuffers.Add(ConstantBuffer);
-            }
-            else if (Line.Contains(" v") && Line.Contains(" : ") && !Line.Contains("?"))
+    /** Parse one parameter of the main signature, e.g. "nointerpolation float4 v0 : TEXCOORD0," or "out float4 o0 : SV_TARGET0)". */
+    static void ParseSignatureLine(const TSharedRef<UsfShader>& Shader, HlslLine& Line, TArrayView<const HlslToken> Tokens)
+    {
+        const HlslText& Hlsl = Shader->Hlsl;
+        const int32 Colon = FindToken(Hlsl, Tokens, ":");
+        if (Colon < 2 || Colon + 1 >= Tokens.Num())
+        {
+            return;
+        }
+        const FAnsiStringView Variable = Hlsl.GetView(Tokens[Colon - 1]);
+        const FAnsiStringView Semantic = Hlsl.GetView(Tokens[Colon + 1]);
+        if (Hlsl.GetView(Tokens[0]).Equals("out"))
+        {
+            if (Colon < 3)
             {
-                UsfInput Input;
-
-                Line.Split("v", nullptr, &Input.Variable);
-                Input.Variable.Split(" : ", &Input.Variable, nullptr);
-                Input.Variable = "v" + Input.Variable;
-
-                Input.Index = FCString::Atoi(*Input.Variable.RightChop(1));
-
-                Line.Split(" : ", nullptr, &Input.Semantic);
-                Input.Semantic.Split(",", &Input.Semantic, nullptr);
-
-                Line.Split(" v", &Input.Type, nullptr);
-                Input.Type = Input.Type.TrimStartAndEnd();
-
-                Shader->Inputs.Add(Input);
+                return;
             }
-            else if (Line.Contains("out") && Line.Contains(" : "))
-            {
-                UsfOutput Output;
-
-                FString TempOutput;
-                Line.Split("out ", nullptr, &TempOutput);
-
-                TempOutput.Split(" o", nullptr, &Output.Variable);
-                Output.Variable.Split(" : ", &Output.Variable, nullptr);
-                Output.Variable = "o" + Output.Variable;
-
-                Output.Index = FCString::Atoi(*Output.Variable.RightChop(1));
-
-                Line.Split(" : ", nullptr, &Output.Semantic);
-                Output.Semantic = Output.Semantic.LeftChop(1);
-
-                TempOutput.Split(" o", &Output.Type, nullptr);
+            UsfOutput Output;
+            Output.Variable = Variable;
+            Output.Type = Hlsl.GetSpan(Tokens[1], Tokens[Colon - 2]);
+            Output.Index = CT_HlslLexer::ParseIndex(Variable);
+            Output.Semantic = Semantic;
+            Shader->Outputs.Add(Output);
+            Line.Kind = EHlslLineKind::Output;
+        }
+        else
+        {
+            UsfInput Input;
+            Input.Variable = Variable;
+            Input.Type = Hlsl.GetSpan(Tokens[0], Tokens[Colon - 2]);
+            Input.Index = CT_HlslLexer::ParseIndex(Variable);
+            Input.Semantic = Semantic;
+            Shader->Inputs.Add(Input);
+            Line.Kind = EHlslLineKind::Input;
+        }
+    }
 
-                Shader->Outputs.Add(Output);
+    static int32 FindToken(const HlslText& Hlsl, TArrayView<const HlslToken> Tokens, const ANSICHAR* Text, int32 StartIndex = 0)
+    {
+        for (int32 i = StartIndex; i < Tokens.Num(); i++)
+        {
+            if (Hlsl.GetView(Tokens[i]).Equals(Text))
+            {
+                return i;
             }
         }
-        return true;
+        return INDEX_NONE;
     }
 
-    static bool WriteFunctionDefinition(const TSharedRef<UsfShader>& Shader)
+    static bool WriteFunctionDefinition(const TSharedRef<UsfShader>& Shader, UsfWriter& Writer)
     {
         if (Shader->Type == PixelShader)
         {
             for (auto& Input : Shader->Inputs)
             {
-                if (Input.Type == "float4")
+                if (Input.Type.Equals("float4"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("static %ls %ls = {1, 1, 1, 1};"), *Input.Type, *Input.Variable));
+                    Writer.Append(T("static ")).Append(Input.Type).Append(T(' ')).Append(Input.Variable);
+                    Writer.Append(T(" = {1, 1, 1, 1};")).NewLine();
                 }
-                else if (Input.Type == "float3")
+                else if (Input.Type.Equals("float3"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("static %ls %ls = {1, 1, 1};"), *Input.Type, *Input.Variable));
+                    Writer.Append(T("static ")).Append(Input.Type).Append(T(' ')).Append(Input.Variable);
+                    Writer.Append(T(" = {1, 1, 1};")).NewLine();
                 }
-                else if (Input.Type == "uint")
+                else if (Input.Type.Equals("uint"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("static %ls %ls = 1;"), *Input.Type, *Input.Variable));
+                    Writer.Append(T("static ")).Append(Input.Type).Append(T(' ')).Append(Input.Variable).Append(T(" = 1;")).NewLine();
                 }
             }
         }
-        Shader->UsfLines.Add("#define cmp -");
-        Shader->UsfLines.Add("struct shader {");
+        Writer.Append(T("#define cmp -")).NewLine();
+        Writer.Append(T("struct shader {")).NewLine();
+        for (const UsfConstantBuffer& ConstantBuffer : Shader->ConstantBuffers)
+        {
+            const int32 NumElements = ConstantBuffer.bTrimmed ? ConstantBuffer.Elements.Num() : ConstantBuffer.Count;
+            if (Shader->bParametric && NumElements > 0)
+            {
+                Writer.Append(ConstantBuffer.Type).Append(T(' ')).Append(ConstantBuffer.Variable).Append(T('['));
+                Writer.AppendInt(NumElements).Append(T("];")).NewLine();
+            }
+        }
         if (Shader->Type == VertexShader)
         {
             for (auto& Output : Shader->Outputs)
             {
-                Shader->UsfLines.Add(FString::Printf(T("%ls %ls;"), *Output.Type, *Output.Variable));
+                Writer.Append(Output.Type).Append(T(' ')).Append(Output.Variable).Append(T(';')).NewLine();
             }
-            Shader->UsfLines.Add("");
-            Shader->UsfLines.Add("void main(");
+            Writer.NewLine();
+            Writer.Append(T("void main(")).NewLine();
             for (auto& Texture : Shader->Textures)
             {
-                Shader->UsfLines.Add(FString::Printf(T("   %ls %ls;"), *Texture.Type, *Texture.Variable));
+                Writer.Append(T("   ")).Append(Texture.Type).Append(T(' ')).Append(Texture.Variable).Append(T(';')).NewLine();
             }
 
             for (int i = 0; i < Shader->Inputs.Num(); i++)
             {
                 auto& Input = Shader->Inputs[i];
-                if (i != Shader->Inputs.Num() - 1)
-                {
-                    Shader->UsfLines.Add(FString::Printf(T("   %ls %ls, // %ls"), *Input.Type, *Input.Variable, *Input.Semantic));
-                }
-                else
-                {
-                    Shader->UsfLines.Add(FString::Printf(T("   %ls %ls) // %ls"), *Input.Type, *Input.Variable, *Input.Semantic));
-                }
+                Writer.Append(T("   ")).Append(Input.Type).Append(T(' ')).Append(Input.Variable);
+                Writer.Append(i != Shader->Inputs.Num() - 1 ? T(", // ") : T(") // ")).Append(Input.Semantic).NewLine();
             }
         }
         else
         {
-            Shader->UsfLines.Add("FMaterialAttributes main(");
+            Writer.Append(T("FMaterialAttributes main(")).NewLine();
 
             for (auto& Texture : Shader->Textures)
             {
-                Shader->UsfLines.Add(FString::Printf(T("   %ls %ls,"), *Texture.Type, *Texture.Variable));
+                Writer.Append(T("   ")).Append(Texture.Type).Append(T(' ')).Append(Texture.Variable).Append(T(',')).NewLine();
             }
 
-            Shader->UsfLines.Add("   float2 tx)");
+            Writer.Append(T("   float2 tx)")).NewLine();
 
-            Shader->UsfLines.Add("{");
-            Shader->UsfLines.Add("  FMaterialAttributes output;");
+            Writer.Append(T("{")).NewLine();
+            Writer.Append(T("  FMaterialAttributes output;")).NewLine();
             // Output render targets, todo support vertex shader, todo account for non-3 component outputs (error)
-            Shader->UsfLines.Add("  float4 o0,o1,o2;");
+            Writer.Append(T("  float4 o0,o1,o2;")).NewLine();
             for (auto& Input : Shader->Inputs)
             {
-                if (Input.Type == "float4")
+                if (Input.Type.Equals("float4"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("  %ls.xyzw = %ls.xyzw * tx.xyxy;"), *Input.Variable, *Input.Variable));
+                    Writer.Append(T("  ")).Append(Input.Variable).Append(T(".xyzw = ")).Append(Input.Variable);
+                    Writer.Append(T(".xyzw * tx.xyxy;")).NewLine();
                 }
-                else if (Input.Type == "float3")
+                else if (Input.Type.Equals("float3"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("  %ls.xyz = %ls.xyz * tx.xyx;"), *Input.Variable, *Input.Variable));
+                    Writer.Append(T("  ")).Append(Input.Variable).Append(T(".xyz = ")).Append(Input.Variable);
+                    Writer.Append(T(".xyz * tx.xyx;")).NewLine();
                 }
-                else if (Input.Type == "uint")
+                else if (Input.Type.Equals("uint"))
                 {
-                    Shader->UsfLines.Add(FString::Printf(T("  %ls.x = %ls.x * tx.x;"), *Input.Variable, *Input.Variable));
+                    Writer.Append(T("  ")).Append(Input.Variable).Append(T(".x = ")).Append(Input.Variable);
+                    Writer.Append(T(".x * tx.x;")).NewLine();
                 }
                 // usf.Replace("v0.xyzw = v0.xyzw * tx.xyxy;", "v0.xyzw = v0.xyzw;");
             }
@@ -347,113 +548,214 @@ private:
         return true;
     }
 
+    /**
+     * Build an instruction record for every line of the main body. Texture samples and discards are rewritten through
+     * substitutions so the optimizer can still drop or renumber anything on the same line.
+     */
     static bool ConvertInstructions(const TSharedRef<UsfShader>& Shader)
     {
-        TMap<int, UsfTexture> TextureMap;
+        TArray<int, TInlineAllocator<32>> SortedIndices;
         for (auto& Texture : Shader->Textures)
         {
-            TextureMap.Add(Texture.Index, Texture);
+            SortedIndices.AddUnique(Texture.Index);
         }
-        TArray<int> SortedIndices;
-        TextureMap.GetKeys(SortedIndices);
         SortedIndices.Sort();
 
-        int i = 0;
-        bool bPastHeader = false;
-        while (++i < Shader->HlslLines.Num())
+        const HlslText& Hlsl = Shader->Hlsl;
+        int32 Depth = 0;
+        for (int32 LineIndex = 0; LineIndex < Hlsl.Lines.Num(); LineIndex++)
         {
-            FString Line = Shader->HlslLines[i];
-            if (!bPastHeader)
+            const HlslLine& Line = Hlsl.Lines[LineIndex];
+            if (Line.Kind != EHlslLineKind::Instruction)
             {
-                if (Line.Contains("float4 r0,r1"))
+                continue;
+            }
+            const TArrayView<const HlslToken> Tokens = Hlsl.GetTokens(Line);
+            Shader->Instructions.Add(CT_UsfOptimizer::ParseInstruction(*Shader, LineIndex, Depth));
+            for (const HlslToken& Token : Tokens)
+            {
+                if (Token.Type == EHlslTokenType::Symbol && Hlsl.GetView(Token).Equals("{"))
                 {
-                    bPastHeader = true;
+                    Depth++;
                 }
-                else
+                else if (Token.Type == EHlslTokenType::Symbol && Hlsl.GetView(Token).Equals("}"))
                 {
-                    continue;
+                    Depth = FMath::Max(Depth - 1, 0);
                 }
             }
 
-            if (Line.Contains("return;"))
+            // Replace texture samples todo add dimension
+            // t0.Sample(s0_s, v0.xy).xyzw -> Material_Texture2D_0.SampleLevel(Material_Texture2D_-1Sampler, v0.xy,0).xyzw
+            int32 SampleToken = INDEX_NONE;
+            for (int32 t = 2; t + 4 < Tokens.Num(); t++)
             {
-                break;
+                if (Hlsl.GetView(Tokens[t]).StartsWith("Sample") && Hlsl.GetView(Tokens[t - 1]).Equals(".") &&
+                    Hlsl.GetView(Tokens[t + 1]).Equals("("))
+                {
+                    SampleToken = t;
+                    break;
+                }
             }
-
-            // Replace texture samples todo add dimension
-            if (Line.Contains("Sample"))
+            if (SampleToken != INDEX_NONE)
             {
-                FString TempString;
-
-                FString EqualLeft;
-                Line.Split("=", &EqualLeft, nullptr);
+                const int32 TextureIndex = CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[SampleToken - 2]));
+                const int32 SampleIndex = CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[SampleToken + 2]));
+
+                // The coordinate is the second argument, ending at the next top-level comma or the closing bracket
+                const int32 CoordStart = SampleToken + 4;
+                int32 CoordEnd = CoordStart;
+                int32 BracketDepth = 0;
+                for (; CoordEnd < Tokens.Num(); CoordEnd++)
+                {
+                    const FAnsiStringView Token = Hlsl.GetView(Tokens[CoordEnd]);
+                    if (Token.Equals("("))
+                    {
+                        BracketDepth++;
+                    }
+                    else if (Token.Equals(")") || Token.Equals(","))
+                    {
+                        if (BracketDepth == 0)
+                        {
+                            break;
+                        }
+                        if (Token.Equals(")"))
+                        {
+                            BracketDepth--;
+                        }
+                    }
+                }
+                int32 CloseBracket = CoordEnd;
+                for (BracketDepth = 0; CloseBracket < Tokens.Num(); CloseBracket++)
+                {
+                    const FAnsiStringView Token = Hlsl.GetView(Tokens[CloseBracket]);
+                    if (Token.Equals("("))
+                    {
+                        BracketDepth++;
+                    }
+                    else if (Token.Equals(")") && BracketDepth-- == 0)
+                    {
+                        break;
+                    }
+                }
+                if (CoordEnd > CoordStart && CloseBracket < Tokens.Num())
+                {
+                    TCHAR Sample[128];
+                    const int32 Len = FCString::Snprintf(Sample, UE_ARRAY_COUNT(Sample),
+                        T("Material_Texture2D_%d.SampleLevel(Material_Texture2D_%dSampler,"), SortedIndices.IndexOfByKey(TextureIndex),
+                        SampleIndex - 1);
+                    Shader->AddSubstitution(Line.FirstToken + SampleToken - 2, Line.FirstToken + CoordStart - 1, FStringView(Sample, Len));
+                    Shader->AddSubstitution(Line.FirstToken + CoordEnd, Line.FirstToken + CloseBracket, T(",0)"));
+                    continue;
+                }
+            }
 
-                Line.Split(".Sample", &TempString, nullptr);
-                TempString.Split("t", nullptr, &TempString);
-                int TextureIndex = FCString::Atoi(*TempString);
+            // Replace discard
+            const int32 DiscardToken = FindToken(Hlsl, Tokens, "discard");
+            if (DiscardToken != INDEX_NONE)
+            {
+                Shader->AddSubstitution(Line.FirstToken + DiscardToken, Line.FirstToken + DiscardToken,
+                    T("{ output.OpacityMask = 0; return output; }"));
+            }
 
-                Line.Split("(s", nullptr, &TempString);
-                TempString.Split("_s", &TempString, nullptr);
-                int SampleIndex = FCString::Atoi(*TempString);
+            // todo add load, levelofdetail
+        }
 
-                Line.Split(", ", nullptr, &TempString);
-                FString SampleTx;
-                TempString.Split(")", &SampleTx, nullptr);
+        return true;
+    }
 
-                FString DotAfter;
-                Line.Split(").", nullptr, &DotAfter);
+    /** Copy every live instruction line, applying the queued substitutions. */
+    static void WriteInstructions(const TSharedRef<UsfShader>& Shader, UsfWriter& Writer)
+    {
+        const HlslText& Hlsl = Shader->Hlsl;
+        TArray<UsfSubstitution>& Substitutions = Shader->Substitutions;
+        Substitutions.StableSort([](const UsfSubstitution& A, const UsfSubstitution& B) { return A.FirstToken < B.FirstToken; });
 
-                Shader->UsfLines.Add(FString::Printf(T("%ls= Material_Texture2D_%d.SampleLevel(Material_Texture2D_%dSampler, %ls,0).%ls"),
-                    *EqualLeft, SortedIndices.IndexOfByKey(TextureIndex), SampleIndex - 1, *SampleTx, *DotAfter));
-            }
-            // Replace discard
-            else if (Line.Contains("discard"))
+        int32 NextSubstitution = 0;
+        for (const UsfInstruction& Instruction : Shader->Instructions)
+        {
+            if (!Instruction.bLive)
             {
-                Shader->UsfLines.Add(Line.Replace(T("discard"), T("{ output.OpacityMask = 0; return output; }")));
+                continue;
             }
-            else
+            const HlslLine& Line = Hlsl.Lines[Instruction.Line];
+            int32 Position = Line.Offset;
+            while (NextSubstitution < Substitutions.Num() && Substitutions[NextSubstitution].FirstToken < Line.FirstToken + Line.NumTokens)
             {
-                Shader->UsfLines.Add(Line);
+                const UsfSubstitution& Substitution = Substitutions[NextSubstitution++];
+                const HlslToken& First = Hlsl.Tokens[Substitution.FirstToken];
+                // Skip substitutions on removed lines and ones overlapping the previous substitution
+                if (Substitution.FirstToken < Line.FirstToken || First.Offset < Position)
+                {
+                    continue;
+                }
+                const HlslToken& Last = Hlsl.Tokens[Substitution.LastToken];
+                Writer.Append(FAnsiStringView(Hlsl.GetData() + Position, First.Offset - Position));
+                Writer.Append(Shader->GetSubstitutionText(Substitution));
+                Position = Last.Offset + Last.Length;
             }
-
-            // todo add load, levelofdetail
+            Writer.Append(FAnsiStringView(Hlsl.GetData() + Position, Line.Offset + Line.Length - Position)).NewLine();
         }
-
-        return true;
     }
 
-    static bool WriteOutputs(const TSharedRef<UsfShader>& Shader)
+    static bool WriteOutputs(const TSharedRef<UsfShader>& Shader, const TArray<uint8>& OutputConversion, UsfWriter& Writer)
     {
-        FString OutputString;
-        FString UsfRTOutputConversion = FPaths::ProjectPluginsDir() / T("CharmTunnel/Resources/UsfRTOutputConversion.usf");
-        if (!FFileHelper::LoadFileToString(OutputString, *UsfRTOutputConversion))
+        // The snippet is plain ASCII HLSL, copy it line by line with an indent and without blank lines
+        FAnsiStringView Remaining(reinterpret_cast<const ANSICHAR*>(OutputConversion.GetData()), OutputConversion.Num());
+        if (Remaining.StartsWith("\xEF\xBB\xBF"))
         {
-            LOG_ERROR("Failed to load output conversion file");
-            return false;
+            Remaining.RightChopInline(3);
         }
-        TArray<FString> OutputLines;
-        OutputString.ParseIntoArray(OutputLines, TEXT("\r\n"), true);
-        for (auto& OutputLine : OutputLines)
+        while (!Remaining.IsEmpty())
         {
-            Shader->UsfLines.Add("  " + OutputLine);
+            int32 LineEnd;
+            if (!Remaining.FindChar('\n', LineEnd))
+            {
+                LineEnd = Remaining.Len();
+            }
+            const FAnsiStringView OutputLine = Remaining.Left(LineEnd).TrimEnd();
+            if (!OutputLine.IsEmpty())
+            {
+                Writer.Append(T("  ")).Append(OutputLine).NewLine();
+            }
+            Remaining.RightChopInline(LineEnd + 1);
         }
         return true;
     }
 
-    static void WriteFooter(const TSharedRef<UsfShader>& Shader)
+    /** The constant buffer values are the only part of the material info that affects the generated USF. */
+    static TArray<uint8> SerializeConstantBuffers(const FCharmShaderStage& Stage)
     {
-        Shader->UsfLines.Add("}");
-        Shader->UsfLines.Add("};");
+        TArray<uint8> Serialized;
+        const int32 RangesSize = Stage.ConstantBuffers.Num() * sizeof(FCharmConstantBufferRange);
+        const int32 ValuesSize = Stage.ConstantBufferValues.Num() * sizeof(FVector4f);
+        Serialized.SetNumUninitialized(RangesSize + ValuesSize);
+        FMemory::Memcpy(Serialized.GetData(), Stage.ConstantBuffers.GetData(), RangesSize);
+        FMemory::Memcpy(Serialized.GetData() + RangesSize, Stage.ConstantBufferValues.GetData(), ValuesSize);
+        return Serialized;
+    }
+
+    static void WriteFooter(const TSharedRef<UsfShader>& Shader, UsfWriter& Writer)
+    {
+        Writer.Append(T("}")).NewLine();
+        Writer.Append(T("};")).NewLine();
         if (Shader->Type == PixelShader)
         {
-            Shader->UsfLines.Add("shader s;");
-            FString OutputString = "return s.main(";
+            Writer.Append(T("shader s;")).NewLine();
+            for (const UsfConstantBuffer& ConstantBuffer : Shader->ConstantBuffers)
+            {
+                const TArray<int32> Elements = Shader->bParametric ? ConstantBuffer.GetEmittedElements() : TArray<int32>();
+                for (int32 i = 0; i < Elements.Num(); i++)
+                {
+                    Writer.Append(T("s.")).Append(ConstantBuffer.Variable).Append(T('[')).AppendInt(i).Append(T("] = "));
+                    Writer.Append(ConstantBuffer.GetParameterName(Elements[i])).Append(T(';')).NewLine();
+                }
+            }
+            Writer.Append(T("return s.main("));
             for (auto& Texture : Shader->Textures)
             {
-                OutputString += Texture.Variable + ",";
+                Writer.Append(Texture.Variable).Append(T(','));
             }
-            OutputString += "tx);";
-            Shader->UsfLines.Add(OutputString);
+            Writer.Append(T("tx);")).NewLine();
         }
     }
 };
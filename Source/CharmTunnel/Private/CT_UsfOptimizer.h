@@ -0,0 +1,355 @@
+﻿#pragma once
+#include "Algo/BinarySearch.h"
+#include "Algo/Unique.h"
+#include "CT_UsfShader.h"
+#include "HAL/IConsoleManager.h"
+
+/**
+ * Dead code elimination and constant buffer trimming for converted shaders.
+ *
+ * Runs after ConvertInstructions has turned the main body into UsfInstruction records. Liveness is tracked per register
+ * component, backwards from the output channels the output conversion reads; plain register assignments that write only dead
+ * components are dropped. Control flow, discards and writes to anything but r/o registers are always kept. A write inside a
+ * block does not end a live range, and bodies containing loops are left untouched because one backward pass cannot see reads
+ * that wrap around to the top of the loop.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTUsfOptimizer, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTUsfOptimizer);
+
+inline TAutoConsoleVariable<bool> CVarCharmUsfOptimize(TEXT("CharmTunnel.UsfOptimize"), true,
+    TEXT("Drop dead instructions and unreferenced constant buffer elements from converted USF."));
+
+/** Components of each oN the output conversion reads, as xyzw bit masks indexed by N. */
+struct UsfOutputUsage
+{
+    TArray<uint8, TInlineAllocator<8>> Masks;
+};
+
+struct CT_UsfOptimizer
+{
+public:
+    static bool IsEnabled() { return CVarCharmUsfOptimize.GetValueOnAnyThread(); }
+
+    static UsfOutputUsage GetOutputUsage(const TArray<uint8>& OutputConversion)
+    {
+        HlslText Text;
+        Text.Source = OutputConversion;
+        CT_HlslLexer::Tokenize(Text);
+
+        UsfOutputUsage Usage;
+        const TArrayView<const HlslToken> Tokens(Text.Tokens);
+        for (int32 i = 0; i < Tokens.Num(); i++)
+        {
+            EUsfRegisterFile File;
+            int32 Register;
+            if (ParseRegister(Text.GetView(Tokens[i]), File, Register) && File == EUsfRegisterFile::Output)
+            {
+                if (Usage.Masks.Num() <= Register)
+                {
+                    Usage.Masks.SetNumZeroed(Register + 1);
+                }
+                Usage.Masks[Register] |= ParseSwizzleAfter(Text, Tokens, i);
+            }
+        }
+        return Usage;
+    }
+
+    /**
+     * Build the record for one line of the main body, appending the registers it reads to Shader.Reads.
+     *
+     * @param Shader The shader being converted.
+     * @param LineIndex Index into Shader.Hlsl.Lines.
+     * @param Depth Block nesting depth at the start of the line.
+     * @return The instruction record.
+     */
+    static UsfInstruction ParseInstruction(UsfShader& Shader, int32 LineIndex, int32 Depth)
+    {
+        const HlslText& Hlsl = Shader.Hlsl;
+        const TArrayView<const HlslToken> Tokens = Hlsl.GetTokens(Hlsl.Lines[LineIndex]);
+        UsfInstruction Instruction;
+        Instruction.Line = LineIndex;
+        Instruction.Depth = Depth;
+
+        // r0.xy = ...; with a single statement on the line
+        int32 FirstReadToken = 0;
+        EUsfRegisterFile File;
+        int32 Register;
+        if (Tokens.Num() >= 4 && ParseRegister(Hlsl.GetView(Tokens[0]), File, Register) && CountSymbol(Hlsl, Tokens, ";") == 1 &&
+            Hlsl.GetView(Tokens.Last()).Equals(";"))
+        {
+            int32 Assign = 1;
+            uint8 Mask = 0xF;
+            if (Hlsl.GetView(Tokens[1]).Equals("."))
+            {
+                Mask = ParseMask(Hlsl.GetView(Tokens[2]));
+                Assign = 3;
+            }
+            if (Mask != 0 && Assign < Tokens.Num() && Hlsl.GetView(Tokens[Assign]).Equals("="))
+            {
+                Instruction.bHasDestination = true;
+                Instruction.Destination = {File, Register, Mask};
+                FirstReadToken = Assign + 1;
+            }
+        }
+
+        Instruction.FirstRead = Shader.Reads.Num();
+        for (int32 i = FirstReadToken; i < Tokens.Num(); i++)
+        {
+            if (ParseRegister(Hlsl.GetView(Tokens[i]), File, Register))
+            {
+                Shader.Reads.Add({File, Register, ParseSwizzleAfter(Hlsl, Tokens, i), Hlsl.Lines[LineIndex].FirstToken + i});
+            }
+        }
+        Instruction.NumReads = Shader.Reads.Num() - Instruction.FirstRead;
+        return Instruction;
+    }
+
+    static void Optimize(UsfShader& Shader, const UsfOutputUsage& OutputUsage)
+    {
+        const int32 NumRemoved = RemoveDeadInstructions(Shader, OutputUsage);
+        TrimConstantBuffers(Shader);
+        UE_LOG(LogCTUsfOptimizer, Verbose, TEXT("%s: removed %d of %d instructions"), *Shader.HlslPath, NumRemoved,
+            Shader.Instructions.Num());
+    }
+
+    /** Parse a register name such as r12 or o0. */
+    static bool ParseRegister(FAnsiStringView Name, EUsfRegisterFile& OutFile, int32& OutRegister)
+    {
+        if (Name.Len() < 2 || (Name[0] != 'r' && Name[0] != 'o'))
+        {
+            return false;
+        }
+        for (int32 i = 1; i < Name.Len(); i++)
+        {
+            if (!CT_HlslLexer::IsDigit(Name[i]))
+            {
+                return false;
+            }
+        }
+        OutFile = Name[0] == 'r' ? EUsfRegisterFile::Temp : EUsfRegisterFile::Output;
+        OutRegister = CT_HlslLexer::ParseIndex(Name);
+        return true;
+    }
+
+    /** Bit mask of a swizzle or write mask such as xyz or wzyx, 0 if it is not one. */
+    static uint8 ParseMask(FAnsiStringView Swizzle)
+    {
+        if (Swizzle.Len() == 0 || Swizzle.Len() > 4)
+        {
+            return 0;
+        }
+        uint8 Mask = 0;
+        for (const ANSICHAR C : Swizzle)
+        {
+            const int32 Component = GetComponent(C);
+            if (Component == INDEX_NONE)
+            {
+                return 0;
+            }
+            Mask |= 1 << Component;
+        }
+        return Mask;
+    }
+
+    /** xyzw and rgba to 0..3. */
+    static int32 GetComponent(ANSICHAR C)
+    {
+        switch (C)
+        {
+            case 'x':
+            case 'r':
+                return 0;
+            case 'y':
+            case 'g':
+                return 1;
+            case 'z':
+            case 'b':
+                return 2;
+            case 'w':
+            case 'a':
+                return 3;
+            default:
+                return INDEX_NONE;
+        }
+    }
+
+    /** Whether the main body contains a loop, which the single-pass analyses here and in the constant folder do not model. */
+    static bool HasLoop(const UsfShader& Shader)
+    {
+        const HlslText& Hlsl = Shader.Hlsl;
+        for (const UsfInstruction& Instruction : Shader.Instructions)
+        {
+            for (const HlslToken& Token : Hlsl.GetTokens(Hlsl.Lines[Instruction.Line]))
+            {
+                const FAnsiStringView View = Hlsl.GetView(Token);
+                if (Token.Type == EHlslTokenType::Identifier && (View.Equals("while") || View.Equals("for") || View.Equals("do")))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static int32 FindConstantBuffer(const UsfShader& Shader, FAnsiStringView Name)
+    {
+        return Shader.ConstantBuffers.IndexOfByPredicate(
+            [&Name](const UsfConstantBuffer& ConstantBuffer) { return ConstantBuffer.Variable.Equals(Name); });
+    }
+
+private:
+    /** Components read by the register at Tokens[Index], all four if it is used without a swizzle. */
+    static uint8 ParseSwizzleAfter(const HlslText& Hlsl, TArrayView<const HlslToken> Tokens, int32 Index)
+    {
+        if (Index + 2 < Tokens.Num() && Hlsl.GetView(Tokens[Index + 1]).Equals("."))
+        {
+            const uint8 Mask = ParseMask(Hlsl.GetView(Tokens[Index + 2]));
+            if (Mask != 0)
+            {
+                return Mask;
+            }
+        }
+        return 0xF;
+    }
+
+    static int32 CountSymbol(const HlslText& Hlsl, TArrayView<const HlslToken> Tokens, const ANSICHAR* Symbol)
+    {
+        int32 Count = 0;
+        for (const HlslToken& Token : Tokens)
+        {
+            Count += Token.Type == EHlslTokenType::Symbol && Hlsl.GetView(Token).Equals(Symbol) ? 1 : 0;
+        }
+        return Count;
+    }
+
+    /** Mark instructions that only write dead components. Returns how many were removed. */
+    static int32 RemoveDeadInstructions(UsfShader& Shader, const UsfOutputUsage& OutputUsage)
+    {
+        if (HasLoop(Shader))
+        {
+            return 0;
+        }
+
+        using FLiveMasks = TArray<uint8, TInlineAllocator<64>>;
+        FLiveMasks LiveTemp;
+        FLiveMasks LiveOutput(OutputUsage.Masks);
+        if (Shader.Type == VertexShader)
+        {
+            // Every vertex shader output is passed on
+            for (const UsfOutput& Output : Shader.Outputs)
+            {
+                LiveOutput.SetNumZeroed(FMath::Max(LiveOutput.Num(), Output.Index + 1));
+                LiveOutput[Output.Index] = 0xF;
+            }
+        }
+        auto GetLive = [&LiveTemp, &LiveOutput](const UsfRegisterRef& Ref) -> uint8&
+        {
+            FLiveMasks& Live = Ref.File == EUsfRegisterFile::Temp ? LiveTemp : LiveOutput;
+            if (Live.Num() <= Ref.Register)
+            {
+                Live.SetNumZeroed(Ref.Register + 1);
+            }
+            return Live[Ref.Register];
+        };
+
+        int32 NumRemoved = 0;
+        for (int32 i = Shader.Instructions.Num() - 1; i >= 0; i--)
+        {
+            UsfInstruction& Instruction = Shader.Instructions[i];
+            if (Instruction.bHasDestination)
+            {
+                uint8& Live = GetLive(Instruction.Destination);
+                if ((Live & Instruction.Destination.Mask) == 0)
+                {
+                    Instruction.bLive = false;
+                    NumRemoved++;
+                    continue;
+                }
+                if (Instruction.Depth == 0)
+                {
+                    Live &= ~Instruction.Destination.Mask;
+                }
+            }
+            for (int32 r = Instruction.FirstRead; r < Instruction.FirstRead + Instruction.NumReads; r++)
+            {
+                GetLive(Shader.Reads[r]) |= Shader.Reads[r].Mask;
+            }
+        }
+        return NumRemoved;
+    }
+
+    /**
+     * Restrict every constant buffer that is only indexed with literals to the elements the live instructions read, and queue
+     * substitutions that renumber those reads into the compacted array.
+     */
+    static void TrimConstantBuffers(UsfShader& Shader)
+    {
+        const HlslText& Hlsl = Shader.Hlsl;
+        // Reads already replaced by the constant folder do not reference the buffer any more
+        TBitArray<> Substituted(false, Shader.Substitutions.Num() > 0 ? Hlsl.Tokens.Num() : 0);
+        for (const UsfSubstitution& Substitution : Shader.Substitutions)
+        {
+            Substituted.SetRange(Substitution.FirstToken, Substitution.LastToken - Substitution.FirstToken + 1, true);
+        }
+
+        // Pairs of (constant buffer, index token) for every literal read
+        TArray<TPair<int32, int32>> LiteralReads;
+        for (const UsfInstruction& Instruction : Shader.Instructions)
+        {
+            if (!Instruction.bLive)
+            {
+                continue;
+            }
+            const HlslLine& Line = Hlsl.Lines[Instruction.Line];
+            const TArrayView<const HlslToken> Tokens = Hlsl.GetTokens(Line);
+            for (int32 i = 0; i < Tokens.Num(); i++)
+            {
+                if (Tokens[i].Type != EHlslTokenType::Identifier || (Substituted.Num() > 0 && Substituted[Line.FirstToken + i]))
+                {
+                    continue;
+                }
+                const int32 Buffer = FindConstantBuffer(Shader, Hlsl.GetView(Tokens[i]));
+                if (Buffer == INDEX_NONE)
+                {
+                    continue;
+                }
+                UsfConstantBuffer& ConstantBuffer = Shader.ConstantBuffers[Buffer];
+                if (i + 3 < Tokens.Num() && Hlsl.GetView(Tokens[i + 1]).Equals("[") && Tokens[i + 2].Type == EHlslTokenType::Number &&
+                    Hlsl.GetView(Tokens[i + 3]).Equals("]"))
+                {
+                    ConstantBuffer.Elements.Add(CT_HlslLexer::ParseIndex(Hlsl.GetView(Tokens[i + 2])));
+                    LiteralReads.Add({Buffer, Line.FirstToken + i + 2});
+                }
+                else
+                {
+                    ConstantBuffer.bDynamicallyIndexed = true;
+                }
+            }
+        }
+
+        for (UsfConstantBuffer& ConstantBuffer : Shader.ConstantBuffers)
+        {
+            ConstantBuffer.Elements.Sort();
+            ConstantBuffer.Elements.SetNum(Algo::Unique(ConstantBuffer.Elements));
+            ConstantBuffer.bTrimmed = !ConstantBuffer.bDynamicallyIndexed;
+        }
+
+        for (const TPair<int32, int32>& Read : LiteralReads)
+        {
+            const UsfConstantBuffer& ConstantBuffer = Shader.ConstantBuffers[Read.Key];
+            if (!ConstantBuffer.bTrimmed)
+            {
+                continue;
+            }
+            const int32 Element = CT_HlslLexer::ParseIndex(Hlsl.GetView(Hlsl.Tokens[Read.Value]));
+            const int32 Compacted = Algo::BinarySearch(ConstantBuffer.Elements, Element);
+            if (Compacted != Element)
+            {
+                TCHAR Digits[16];
+                const int32 Len = FCString::Snprintf(Digits, UE_ARRAY_COUNT(Digits), TEXT("%d"), Compacted);
+                Shader.AddSubstitution(Read.Value, Read.Value, FStringView(Digits, Len));
+            }
+        }
+    }
+};
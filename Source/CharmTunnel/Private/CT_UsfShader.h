@@ -0,0 +1,175 @@
+﻿#pragma once
+#include "CT_HlslLexer.h"
+#include "CT_UsfWriter.h"
+
+/**
+ * Declarations parsed from a decompiled shader. String fields are views into UsfShader::Hlsl.Source.
+ */
+
+struct UsfTexture
+{
+    FAnsiStringView Dimension;
+    FAnsiStringView Type;
+    FAnsiStringView Variable;
+    int Index;
+};
+
+struct UsfConstantBuffer
+{
+    FAnsiStringView Variable;
+    FAnsiStringView Type;
+    int Count;
+    int Index;
+    // Elements the live instructions read with a literal index, sorted
+    TArray<int32> Elements;
+    bool bDynamicallyIndexed = false;
+    // Set by the optimizer when only Elements are emitted, in order, and reads are renumbered to match
+    bool bTrimmed = false;
+
+    /** Original indices of the elements present in the generated USF, in declaration order. */
+    TArray<int32> GetEmittedElements() const
+    {
+        if (bTrimmed)
+        {
+            return Elements;
+        }
+        TArray<int32> All;
+        All.Reserve(Count);
+        for (int32 i = 0; i < Count; i++)
+        {
+            All.Add(i);
+        }
+        return All;
+    }
+
+    /** Custom node input carrying an element of this buffer in a parametric shader, e.g. cb0_12. */
+    FString GetParameterName(int32 Element) const
+    {
+        return FString::Printf(TEXT("%s_%d"), *CT_HlslLexer::ToString(Variable), Element);
+    }
+};
+
+struct UsfInput
+{
+    FAnsiStringView Variable;
+    FAnsiStringView Type;
+    int Index;
+    FAnsiStringView Semantic;
+};
+
+struct UsfOutput
+{
+    FAnsiStringView Variable;
+    FAnsiStringView Type;
+    int Index;
+    FAnsiStringView Semantic;
+};
+
+enum class EUsfRegisterFile : uint8
+{
+    Temp,      // rN
+    Output,    // oN
+};
+
+/** Register components read or written by an instruction, e.g. r0.xy is {Temp, 0, 0b0011}. */
+struct UsfRegisterRef
+{
+    EUsfRegisterFile File;
+    int32 Register;
+    uint8 Mask;
+    // Token of the register name for reads, a read whose mask is cleared has been folded away
+    int32 Token = INDEX_NONE;
+};
+
+/** One line of the decompiled main body. */
+struct UsfInstruction
+{
+    int32 Line;
+    // Block nesting depth at the start of the line, writes below depth 0 are conditional
+    int32 Depth;
+    // Set for plain "rN.mask = ...;" and "oN.mask = ...;" lines, anything else is kept unconditionally
+    bool bHasDestination = false;
+    UsfRegisterRef Destination;
+    // Range in UsfShader::Reads
+    int32 FirstRead = 0;
+    int32 NumReads = 0;
+    bool bLive = true;
+};
+
+/** Replaces the tokens FirstToken..LastToken (inclusive) with a range of UsfShader::SubstitutionText when emitting. */
+struct UsfSubstitution
+{
+    int32 FirstToken;
+    int32 LastToken;
+    int32 TextOffset;
+    int32 TextLength;
+};
+
+/** Seconds spent in each stage of CT_UsfConverter::Convert. Stages that did not run stay at zero. */
+struct UsfStageTimes
+{
+    double Load = 0;
+    double CacheLookup = 0;
+    double Parse = 0;
+    double Instructions = 0;
+    double Fold = 0;
+    double Optimize = 0;
+    double Emit = 0;
+    double CacheStore = 0;
+
+    UsfStageTimes& operator+=(const UsfStageTimes& Other)
+    {
+        Load += Other.Load;
+        CacheLookup += Other.CacheLookup;
+        Parse += Other.Parse;
+        Instructions += Other.Instructions;
+        Fold += Other.Fold;
+        Optimize += Other.Optimize;
+        Emit += Other.Emit;
+        CacheStore += Other.CacheStore;
+        return *this;
+    }
+};
+
+enum EShaderType
+{
+    PixelShader,
+    VertexShader,
+};
+
+struct UsfShader
+{
+    EShaderType Type;
+    TArray<UsfTexture> Textures;
+    TArray<UsfConstantBuffer> ConstantBuffers;
+    TArray<UsfInput> Inputs;
+    TArray<UsfOutput> Outputs;
+    TArray<int> Samplers;
+    bool bHasOpacityMasked;
+    // Constant buffers are custom node inputs instead of literals, so materials sharing the body can share a parent
+    bool bParametric = false;
+
+    FString HlslPath;
+    HlslText Hlsl;
+    TArray<UsfInstruction> Instructions;
+    TArray<UsfRegisterRef> Reads;
+    TArray<UsfSubstitution> Substitutions;
+    FString SubstitutionText;
+    UsfEmitStats EmitStats;
+    UsfStageTimes StageTimes;
+    FString UsfContents;
+    FString Error;
+
+    UsfShader(FString InHlslPath, EShaderType InType) : Type(InType), bHasOpacityMasked(false), HlslPath(InHlslPath) {}
+
+    void AddSubstitution(int32 FirstToken, int32 LastToken, FStringView Text)
+    {
+        Substitutions.Add({FirstToken, LastToken, SubstitutionText.Len(), Text.Len()});
+        SubstitutionText.Append(Text);
+    }
+
+    FStringView GetSubstitutionText(const UsfSubstitution& Substitution) const
+    {
+        return FStringView(*SubstitutionText + Substitution.TextOffset, Substitution.TextLength);
+    }
+};
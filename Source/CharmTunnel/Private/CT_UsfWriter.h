@@ -0,0 +1,112 @@
+﻿#pragma once
+#include "Containers/StringView.h"
+#include "Containers/UnrealString.h"
+
+/**
+ * Append-only writer that emits USF into one buffer sized up front.
+ *
+ * Everything the converter writes goes through here, so a conversion costs a single allocation when the estimate holds.
+ * Growths and copied bytes are counted so the emission cost can be measured per shader.
+ */
+
+struct UsfEmitStats
+{
+    int32 Allocations = 0;
+    int64 BytesCopied = 0;
+};
+
+struct UsfWriter
+{
+public:
+    explicit UsfWriter(int32 EstimatedLength)
+    {
+        Buffer.GetCharArray().Reserve(EstimatedLength + 1);
+        Stats.Allocations = 1;
+    }
+
+    UsfWriter& Append(const TCHAR* Text) { return Append(FStringView(Text)); }
+
+    UsfWriter& Append(FStringView Text)
+    {
+        TCHAR* Dest = Grow(Text.Len());
+        FMemory::Memcpy(Dest, Text.GetData(), Text.Len() * sizeof(TCHAR));
+        return *this;
+    }
+
+    UsfWriter& Append(FAnsiStringView Text)
+    {
+        TCHAR* Dest = Grow(Text.Len());
+        for (int32 i = 0; i < Text.Len(); i++)
+        {
+            Dest[i] = (TCHAR) (uint8) Text[i];
+        }
+        return *this;
+    }
+
+    UsfWriter& Append(TCHAR Char)
+    {
+        *Grow(1) = Char;
+        return *this;
+    }
+
+    UsfWriter& AppendInt(int32 Value)
+    {
+        TCHAR Digits[16];
+        const int32 Len = FCString::Snprintf(Digits, UE_ARRAY_COUNT(Digits), TEXT("%d"), Value);
+        return Append(FStringView(Digits, Len));
+    }
+
+    /** Same text as printf "%f". */
+    UsfWriter& AppendFloat(double Value)
+    {
+        TCHAR Digits[384];
+        const int32 Len = FCString::Snprintf(Digits, UE_ARRAY_COUNT(Digits), TEXT("%f"), Value);
+        return Append(FStringView(Digits, FMath::Clamp(Len, 0, (int32) UE_ARRAY_COUNT(Digits) - 1)));
+    }
+
+    /** float4(x, y, z, w), */
+    UsfWriter& AppendFloat4Literal(double X, double Y, double Z, double W)
+    {
+        Append(TEXT("float4("));
+        AppendFloat(X).Append(TEXT(", "));
+        AppendFloat(Y).Append(TEXT(", "));
+        AppendFloat(Z).Append(TEXT(", "));
+        return AppendFloat(W).Append(TEXT("),"));
+    }
+
+    UsfWriter& NewLine() { return Append(TEXT("\r\n")); }
+
+    /** Move the emitted text out. The writer is empty afterwards. */
+    FString Finish()
+    {
+        TArray<TCHAR>& Chars = Buffer.GetCharArray();
+        if (Chars.Num() > 0)
+        {
+            Chars.Add(TCHAR(0));
+        }
+        return MoveTemp(Buffer);
+    }
+
+    const UsfEmitStats& GetStats() const { return Stats; }
+
+private:
+    /** Make room for Count more characters and return where to write them. The buffer is not null-terminated until Finish. */
+    TCHAR* Grow(int32 Count)
+    {
+        TArray<TCHAR>& Chars = Buffer.GetCharArray();
+        const int32 OldMax = Chars.Max();
+        const int32 OldNum = Chars.Num();
+        Chars.AddUninitialized(Count);
+        if (Chars.Max() != OldMax)
+        {
+            // The estimate was too small, the existing text was copied into a new allocation
+            Stats.Allocations++;
+            Stats.BytesCopied += OldNum * sizeof(TCHAR);
+        }
+        Stats.BytesCopied += Count * sizeof(TCHAR);
+        return Chars.GetData() + OldNum;
+    }
+
+    FString Buffer;
+    UsfEmitStats Stats;
+};
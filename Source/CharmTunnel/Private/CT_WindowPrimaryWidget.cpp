@@ -2,6 +2,7 @@
 
 #include "CT_EditorLibrary.h"
 #include "CT_Log.h"
+#include "CT_Stats.h"
 #include "CT_UsfConverter.h"
 #include "CharmSceneViewExtension.h"
 #include "Components/SkyAtmosphereComponent.h"
@@ -111,7 +112,22 @@ FReply SCharmTunnelWindowPrimaryWidget::OnSelectOutputDirectoryClicked()
 
 FReply SCharmTunnelWindowPrimaryWidget::OnLoadDevMapFullyClicked()
 {
+    const FCharmImportReport::FImport ImportReport;
     FString DevMapName = "/CharmTunnel/Dev/Dev_P";
+
+    // The dev map only references assets by path, so while it places the same meshes only the changed assets need rebuilding
+    FCharmImportManifest Manifest;
+    Manifest.Load();
+    const FString DevMapSignature = GetDevMapSignature();
+    const bool bIncremental = CVarCharmIncrementalImport.GetValueOnGameThread();
+    if (bIncremental && FCharmEditorLibrary::DoesAssetExist(DevMapName) && Manifest.IsUpToDate(DevMapName, DevMapSignature))
+    {
+        // The map already holds its placements, adding them again would stack a copy into whatever level is open
+        LOG("Dev map is up to date, importing changed assets only");
+        ImportDevMapAssets(false);
+        return FReply::Handled();
+    }
+
     if (FCharmEditorLibrary::DoesAssetExist(DevMapName))
     {
         LOG("Dev map already exists, deleting and reloading");
@@ -124,11 +140,24 @@ FReply SCharmTunnelWindowPrimaryWidget::OnLoadDevMapFullyClicked()
             LOG_ERROR("Failed to delete dev map");
         }
     }
+    if (!bIncremental)
+    {
+        // A full rebuild starts from nothing, purging is much cheaper than the import overwriting every asset
+        FCharmEditorLibrary::DeleteDirectory("/CharmTunnel/Dev/Data");
+        FCharmEditorLibrary::DeleteDirectory("/CharmTunnel/Dev/SM");
+    }
     ULevel* DevLevel;
     if (FCharmEditorLibrary::CreateLevel(DevMapName, DevLevel))
     {
         LOG("Dev map created");
         PopulateDevMap(DevLevel);
+        if (bIncremental)
+        {
+            // Reload, the import has recorded its assets in the meantime
+            Manifest.Load();
+            Manifest.Record(DevMapName, DevMapSignature);
+            Manifest.Save();
+        }
     }
     else
     {
@@ -149,59 +178,88 @@ FReply SCharmTunnelWindowPrimaryWidget::OnLoadDevMapMaterialsClicked()
 
 FReply SCharmTunnelWindowPrimaryWidget::OnLoadDevMapUsfsClicked()
 {
+    const FCharmImportReport::FImport ImportReport;
     FString DebugStaticSourcePath = "C:/T/export/devmap/";
     FString DebugStaticDestPath = "/CharmTunnel/Dev/";
 
-    // Find the config file and recreate usfs from hlsl
-    TArray<FString> Files = FCharmEditorLibrary::GetFilesInDirectory(DebugStaticSourcePath, "*_info.cfg");
-    TMap<FString, TSharedPtr<FJsonObject>> MaterialInfos;
-    TMap<FString, FString> ConfigPaths;
-    for (auto& File : Files)
-    {
-        TSharedPtr<FJsonObject> JsonObject;
-        if (!FCharmEditorLibrary::LoadConfigFile(File, JsonObject))
-        {
-            continue;
-        }
+    // Find the config files and recreate usfs from hlsl
+    const FCharmExport Export =
+        FCharmExport::Merge(FCharmExport::LoadConfigs(FCharmEditorLibrary::GetFilesInDirectory(DebugStaticSourcePath, "*_info.cfg")));
 
-        const TSharedPtr<FJsonObject> Materials = JsonObject->GetObjectField("Materials");
-        bool btest = 0;
-        for (auto& Pair : Materials->Values)
-        {
-            if (ConfigPaths.Contains(Pair.Key))
-            {
-                continue;
-            }
-            MaterialInfos.Add(Pair.Key, Pair.Value->AsObject());
-            ConfigPaths.Add(Pair.Key, File);
-        }
+    // Convert everything on worker threads, then come back to update any materials that already exist
+    TArray<UsfConversionRequest> Requests;
+    for (const auto& Pair : Export.Materials)
+    {
+        Requests.Add({Pair.Key, Pair.Value.Material, Pair.Value.SourceDirectory / "Shaders" / "PS_" + Pair.Key + ".hlsl", PixelShader,
+            CVarCharmShareParentMaterials.GetValueOnGameThread()});
     }
+    CT_UsfCache::ResetStats();
+    const TArray<UsfConversionResult> Results = CT_UsfConverter::ConvertBatch(Requests);
+    const UsfCacheStats CacheStats = CT_UsfCache::GetStats();
+    LOG("Converted %d usfs, cache hits %d, misses %d, written %d", Results.Num(), CacheStats.Hits, CacheStats.Misses,
+        CacheStats.Writes);
 
-    for (auto& MaterialInfo : MaterialInfos)
+    // Each instance moves to the parent of its new shader, the shared parents themselves are left alone
+    const FCharmAssetIndex AssetIndex({DebugStaticDestPath});
+    TArray<FString> MaterialPaths;
+    for (const UsfConversionResult& Result : Results)
     {
-        const FString ParentDirectory = FPaths::GetPath(ConfigPaths[MaterialInfo.Key]);
-        bool bOutSuccess;
-        TSharedRef<UsfShader> Shader = CT_UsfConverter::ConvertFromHlsl(MaterialInfo.Value->GetObjectField("PS"),
-            ParentDirectory / "Shaders" / "PS_" + MaterialInfo.Key + ".hlsl", PixelShader, bOutSuccess);
-
-        bool bTest = false;
+        MaterialPaths.Add(DebugStaticDestPath / "Data/Materials" / Result.Name);
+    }
+    FCharmEditorLibrary::PreloadAssets(MaterialPaths);
+    int32 NumUpdated = 0;
+    TArray<UMaterial*> MaterialsToCompile;
+    for (const UsfConversionResult& Result : Results)
+    {
+        if (Result.bSuccess && FCharmEditorLibrary::ReloadMaterialUsf(Result.Name, Export.Materials[Result.Name],
+                                   DebugStaticDestPath / "Data", Result.Shader.ToSharedRef(), MaterialsToCompile))
+        {
+            NumUpdated++;
+        }
     }
+    FCharmEditorLibrary::CompileMaterials(MaterialsToCompile);
+    FCharmEditorLibrary::DeleteUnusedParentMaterials(DebugStaticDestPath / "Data");
+    LOG("Updated %d existing materials", NumUpdated);
 
     return FReply::Handled();
 }
 
-void SCharmTunnelWindowPrimaryWidget::PopulateDevMap(ULevel* DevLevel)
+void SCharmTunnelWindowPrimaryWidget::ImportDevMapAssets(bool bPlaceMaps)
 {
-    // Load all assets in dev map directory and add to level
+    const FCharmImportReport::FImport ImportReport;
     FString DebugStaticSourcePath = "C:/T/export/devmap/";
     FString DebugStaticDestPath = "/CharmTunnel/Dev/";
 
+    FCharmEditorLibrary::ImportExportFromDirectory(
+        DebugStaticSourcePath, DebugStaticDestPath / "Data/", DebugStaticDestPath / "SM", bPlaceMaps);
+}
+
+FString SCharmTunnelWindowPrimaryWidget::GetDevMapSignature()
+{
+    // What PopulateDevMap places is fixed, so the map only goes stale when the set of exported assets changes
+    constexpr int32 DevMapVersion = 1;
+    FString DebugStaticSourcePath = "C:/T/export/devmap/";
     TArray<FString> Files = FCharmEditorLibrary::GetFilesInDirectory(DebugStaticSourcePath, "*_info.cfg");
-    for (auto& File : Files)
+    Files.Sort();
+
+    FCharmImportManifest Manifest;
+    FCharmInputSignature Signature = Manifest.MakeSignature();
+    Signature.AddInt(DevMapVersion);
+    for (const FString& File : Files)
     {
-        FCharmEditorLibrary::ImportAssetFromConfigFile(File, DebugStaticDestPath / "Data/");
+        Signature.AddString(FPaths::GetCleanFilename(File));
     }
+    return Signature.Finish();
+}
+
+void SCharmTunnelWindowPrimaryWidget::PopulateDevMap(ULevel* DevLevel)
+{
+    // Load all assets in dev map directory and add to level
+    FString DebugStaticDestPath = "/CharmTunnel/Dev/";
+
+    ImportDevMapAssets(true);
 
+    CHARM_IMPORT_STAGE(ActorSpawning);
     if (UEditorActorSubsystem* EditorActorSubsystem = GEditor->GetEditorSubsystem<UEditorActorSubsystem>())
     {
         EditorActorSubsystem->SpawnActorFromObject(ASkyLight::StaticClass(), FVector::Zero());
@@ -3,6 +3,7 @@
 #include "CharmSceneViewExtension.h"
 
 #include "Async/ParallelFor.h"
+#include "CT_Stats.h"
 #include "Components/PrimitiveComponent.h"
 #include "Engine/EngineTypes.h"
 #include "Engine/Texture2DArray.h"
@@ -147,6 +148,7 @@ FCharmSceneViewExtension::FCharmSceneViewExtension(const FAutoRegister& AutoRegi
 
 void FCharmSceneViewExtension::PreRenderView_RenderThread(FRDGBuilder& GraphBuilder, FSceneView& InView)
 {
+    CHARM_SCOPE(STAT_CharmRenderExtension, "PreRenderView");
     SCOPED_DRAW_EVENTF(GraphBuilder.RHICmdList, RenderStaticMesh, TEXT("CT SM PRE RENDER VIEW"));
     FLevelEditorViewportClient* ViewportClient = static_cast<FLevelEditorViewportClient*>(InView.Drawer);
     auto ViewRect = InView.UnconstrainedViewRect;
@@ -159,6 +161,7 @@ void FCharmSceneViewExtension::PreRenderView_RenderThread(FRDGBuilder& GraphBuil
 
 void FCharmSceneViewExtension::PostRenderBasePass_RenderThread(FRHICommandListImmediate& RHICmdList, FSceneView& InView)
 {
+    CHARM_SCOPE(STAT_CharmRenderExtension, "PostRenderBasePass");
     FSceneView* View = &InView;
     FScene* Scene = View->Family->Scene->GetRenderScene();
     auto x = Scene->Primitives;
@@ -254,6 +257,7 @@ void FCharmSceneViewExtension::DoWorkLambda(FScene* Scene, FCachedPassMeshDrawLi
 void FCharmSceneViewExtension::RenderStaticMesh(
     FRHICommandListImmediate& RHICmdList, FSceneView& InView, FStaticMeshSceneProxy* StaticMeshSceneProxy, uint32 PrimitiveId)
 {
+    CHARM_SCOPE(STAT_CharmRenderExtension, "RenderStaticMesh");
     FSceneView* View = &InView;
     // BuildMeshDrawCommands -> DrawListContext->AddCommand + DrawListContext->FinalizeCommand
     // FMeshDrawCommand::SubmitDraw seems to be the key here
@@ -2,6 +2,7 @@
 
 #include "CharmTunnel.h"
 
+#include "CT_Stats.h"
 #include "CT_WindowPrimaryWidget.h"
 #include "CharmTunnelCommands.h"
 #include "CharmTunnelStyle.h"
@@ -11,6 +12,9 @@
 
 static const FName CharmTunnelTabName("CharmTunnel");
 
+UE_TRACE_CHANNEL_DEFINE(CharmTunnelChannel);
+LLM_DEFINE_TAG(CharmTunnel);
+
 #define LOCTEXT_NAMESPACE "FCharmTunnelModule"
 
 void FCharmTunnelModule::StartupModule()
@@ -0,0 +1,123 @@
+﻿#pragma once
+
+#include "AssetRegistry/AssetRegistryModule.h"
+#include "CoreMinimal.h"
+#include "Misc/PackageName.h"
+
+/**
+ * Asset data of every package under the directories an import writes to.
+ *
+ * The asset registry is queried once when the index is created and the index follows the registry's added, updated,
+ * removed and renamed events after that, so assets the import creates, reimports or deletes are seen straight away. While
+ * an index is alive FCharmEditorLibrary::DoesAssetExist and IsImportUpToDate answer from it for paths under its roots.
+ * Indexes nest, the innermost covering a path is used.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTAssetIndex, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTAssetIndex);
+
+class FCharmAssetIndex
+{
+public:
+    explicit FCharmAssetIndex(const TArray<FString>& Directories)
+    {
+        FARFilter Filter;
+        Filter.bRecursivePaths = true;
+        for (FString Directory : Directories)
+        {
+            Directory.RemoveFromEnd(TEXT("/"));
+            Filter.PackagePaths.Add(FName(Directory));
+            Roots.Add(Directory + TEXT("/"));
+        }
+        IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+        TArray<FAssetData> Assets;
+        AssetRegistry.GetAssets(Filter, Assets);
+        Packages.Reserve(Assets.Num());
+        for (FAssetData& Asset : Assets)
+        {
+            Packages.Add(Asset.PackageName, MoveTemp(Asset));
+        }
+        AddedHandle = AssetRegistry.OnAssetAdded().AddRaw(this, &FCharmAssetIndex::OnAssetAdded);
+        UpdatedHandle = AssetRegistry.OnAssetUpdated().AddRaw(this, &FCharmAssetIndex::OnAssetAdded);
+        RemovedHandle = AssetRegistry.OnAssetRemoved().AddRaw(this, &FCharmAssetIndex::OnAssetRemoved);
+        RenamedHandle = AssetRegistry.OnAssetRenamed().AddRaw(this, &FCharmAssetIndex::OnAssetRenamed);
+
+        Outer = Innermost;
+        Innermost = this;
+        UE_LOG(LogCTAssetIndex, Verbose, TEXT("Indexed %d assets under %s."), Packages.Num(), *FString::Join(Directories, TEXT(", ")));
+    }
+
+    ~FCharmAssetIndex()
+    {
+        check(Innermost == this);
+        Innermost = Outer;
+        if (FAssetRegistryModule* AssetRegistryModule = FModuleManager::GetModulePtr<FAssetRegistryModule>("AssetRegistry"))
+        {
+            IAssetRegistry& AssetRegistry = AssetRegistryModule->Get();
+            AssetRegistry.OnAssetAdded().Remove(AddedHandle);
+            AssetRegistry.OnAssetUpdated().Remove(UpdatedHandle);
+            AssetRegistry.OnAssetRemoved().Remove(RemovedHandle);
+            AssetRegistry.OnAssetRenamed().Remove(RenamedHandle);
+        }
+    }
+
+    FCharmAssetIndex(const FCharmAssetIndex&) = delete;
+    FCharmAssetIndex& operator=(const FCharmAssetIndex&) = delete;
+
+    /** The innermost live index covering the package, null if the asset registry has to be asked. */
+    static const FCharmAssetIndex* Find(const FString& PackageName)
+    {
+        for (const FCharmAssetIndex* Index = Innermost; Index; Index = Index->Outer)
+        {
+            if (Index->Covers(PackageName))
+            {
+                return Index;
+            }
+        }
+        return nullptr;
+    }
+
+    bool Covers(const FString& PackageName) const
+    {
+        for (const FString& Root : Roots)
+        {
+            if (PackageName.StartsWith(Root))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool Contains(const FString& PackageName) const { return Packages.Contains(FName(*PackageName)); }
+
+    /** Registry data of the package's asset, null if it does not exist. */
+    const FAssetData* FindAsset(const FString& PackageName) const { return Packages.Find(FName(*PackageName)); }
+
+private:
+    void OnAssetAdded(const FAssetData& Asset)
+    {
+        if (Covers(Asset.PackageName.ToString()))
+        {
+            Packages.Add(Asset.PackageName, Asset);
+        }
+    }
+
+    void OnAssetRemoved(const FAssetData& Asset) { Packages.Remove(Asset.PackageName); }
+
+    void OnAssetRenamed(const FAssetData& Asset, const FString& OldObjectPath)
+    {
+        Packages.Remove(FName(FPackageName::ObjectPathToPackageName(OldObjectPath)));
+        OnAssetAdded(Asset);
+    }
+
+    inline static FCharmAssetIndex* Innermost = nullptr;
+
+    FCharmAssetIndex* Outer = nullptr;
+    TArray<FString> Roots;
+    TMap<FName, FAssetData> Packages;
+    FDelegateHandle AddedHandle;
+    FDelegateHandle UpdatedHandle;
+    FDelegateHandle RemovedHandle;
+    FDelegateHandle RenamedHandle;
+};
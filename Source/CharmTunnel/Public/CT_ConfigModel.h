@@ -0,0 +1,527 @@
+﻿#pragma once
+
+#include "Async/MappedFileHandle.h"
+#include "Async/ParallelFor.h"
+#include "CT_Stats.h"
+#include "CoreMinimal.h"
+#include "Dom/JsonObject.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/MemoryReader.h"
+
+/**
+ * Typed model of a Charm *_info.cfg file.
+ *
+ * The json is decoded once by FCharmConfig::Load and everything after that (importer, usf converter, widget) reads plain
+ * structs. Constant buffer values of a shader stage live in one contiguous float4 array, each buffer is a range of it.
+ *
+ * Map configs hold hundreds of thousands of placements, so Load maps the file and reads it token by token. Instances goes
+ * straight into the placement arrays, only the other sections are built into a json tree.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTConfig, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTConfig);
+
+struct FCharmTextureBinding
+{
+    // Register slot as written in the config, the custom node input is "t" + Slot
+    FString Slot;
+    FString Hash;
+    bool bSrgb = false;
+};
+
+struct FCharmConstantBufferRange
+{
+    // Element count of the buffer as declared in the shader, which is also how the config names it
+    int32 Count = 0;
+    int32 Offset = 0;
+    int32 Num = 0;
+};
+
+struct FCharmShaderStage
+{
+    TArray<FCharmTextureBinding> Textures;
+    TArray<FCharmConstantBufferRange> ConstantBuffers;
+    TArray<FVector4f> ConstantBufferValues;
+
+    /** Values of the buffer declared with Count elements. Returns false if the config has no values for it. */
+    bool FindConstantBuffer(int32 Count, TArrayView<const FVector4f>& OutValues) const
+    {
+        for (const FCharmConstantBufferRange& Range : ConstantBuffers)
+        {
+            if (Range.Count == Count)
+            {
+                OutValues = MakeArrayView(ConstantBufferValues.GetData() + Range.Offset, Range.Num);
+                return true;
+            }
+        }
+        OutValues = TArrayView<const FVector4f>();
+        return false;
+    }
+};
+
+struct FCharmMaterial
+{
+    FString Hash;
+    FCharmShaderStage VS;
+    FCharmShaderStage PS;
+};
+
+struct FCharmInstance
+{
+    FVector3f Translation = FVector3f::ZeroVector;
+    FQuat4f Rotation = FQuat4f::Identity;
+    FVector3f Scale = FVector3f::OneVector;
+};
+
+struct FCharmConfig
+{
+    // Path of the *_info.cfg file, its directory holds the exported Textures and Shaders
+    FString FilePath;
+    FString MeshName;
+    TMap<FString, TSharedPtr<const FCharmMaterial>> Materials;
+    // Part name to material hash
+    TMap<FString, FString> Parts;
+    // Static mesh hash to the placements of that mesh, empty for a single static
+    TMap<FString, TArray<FCharmInstance>> Instances;
+
+    FString GetSourceDirectory() const { return FPaths::GetPath(FilePath); }
+
+    /**
+     * Read and decode a Charm config file.
+     *
+     * @param ConfigFilePath The path of the *_info.cfg file.
+     * @param OutConfig The decoded config.
+     * @return true if the file was read and is valid json.
+     */
+    static bool Load(const FString& ConfigFilePath, FCharmConfig& OutConfig)
+    {
+        CHARM_SCOPE(STAT_CharmConfig, "ConfigFile");
+        // Fall back to reading the file if the platform cannot map it
+        IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+        const TUniquePtr<IMappedFileHandle> MappedFile(PlatformFile.OpenMapped(*ConfigFilePath));
+        const TUniquePtr<IMappedFileRegion> MappedRegion(MappedFile ? MappedFile->MapRegion() : nullptr);
+        TArray64<uint8> FileContents;
+        FMemoryView FileView;
+        if (MappedRegion)
+        {
+            FileView = FMemoryView(MappedRegion->GetMappedPtr(), MappedRegion->GetMappedSize());
+        }
+        else if (FFileHelper::LoadFileToArray(FileContents, *ConfigFilePath))
+        {
+            FileView = MakeMemoryView(FileContents);
+        }
+        else
+        {
+            UE_LOG(LogCTConfig, Error, TEXT("Failed to load config file %s."), *ConfigFilePath);
+            return false;
+        }
+
+        FMemoryReaderView Archive(FileView);
+        const uint8* Bytes = static_cast<const uint8*>(FileView.GetData());
+        if (FileView.GetSize() >= 3 && Bytes[0] == 0xEF && Bytes[1] == 0xBB && Bytes[2] == 0xBF)
+        {
+            Archive.Seek(3);
+        }
+        const TSharedRef<FJsonStreamReader> JsonReader = TJsonReaderFactory<UTF8CHAR>::Create(&Archive);
+        if (!ReadConfig(*JsonReader, OutConfig))
+        {
+            UE_LOG(LogCTConfig, Error, TEXT("Unable to parse config %s: %s"), *ConfigFilePath, *JsonReader->GetErrorMessage());
+            return false;
+        }
+        OutConfig.FilePath = ConfigFilePath;
+        return true;
+    }
+
+    /** Decode the sections Load keeps as a json tree. Instances is only read by Load, straight from the file. */
+    static FCharmConfig FromJson(const FJsonObject& JsonObject)
+    {
+        FCharmConfig Config;
+        JsonObject.TryGetStringField(TEXT("MeshName"), Config.MeshName);
+
+        const TSharedPtr<FJsonObject>* Materials;
+        if (JsonObject.TryGetObjectField(TEXT("Materials"), Materials))
+        {
+            Config.Materials.Reserve((*Materials)->Values.Num());
+            for (const auto& Pair : (*Materials)->Values)
+            {
+                const TSharedPtr<FJsonObject>* MaterialObject;
+                if (!Pair.Value->TryGetObject(MaterialObject))
+                {
+                    continue;
+                }
+                TSharedPtr<FCharmMaterial> Material = MakeShared<FCharmMaterial>();
+                Material->Hash = Pair.Key;
+                const TSharedPtr<FJsonObject>* StageObject;
+                if ((*MaterialObject)->TryGetObjectField(TEXT("VS"), StageObject))
+                {
+                    ReadShaderStage(**StageObject, Material->VS);
+                }
+                if ((*MaterialObject)->TryGetObjectField(TEXT("PS"), StageObject))
+                {
+                    ReadShaderStage(**StageObject, Material->PS);
+                }
+                Config.Materials.Add(Pair.Key, Material);
+            }
+        }
+
+        const TSharedPtr<FJsonObject>* Parts;
+        if (JsonObject.TryGetObjectField(TEXT("Parts"), Parts))
+        {
+            for (const auto& Pair : (*Parts)->Values)
+            {
+                FString MaterialHash;
+                if (Pair.Value->TryGetString(MaterialHash))
+                {
+                    Config.Parts.Add(Pair.Key, MaterialHash);
+                }
+            }
+        }
+
+        return Config;
+    }
+
+private:
+    using FJsonStreamReader = TJsonReader<UTF8CHAR>;
+
+    static bool ReadConfig(FJsonStreamReader& Reader, FCharmConfig& OutConfig)
+    {
+        EJsonNotation Notation;
+        if (!Reader.ReadNext(Notation) || Notation != EJsonNotation::ObjectStart)
+        {
+            return false;
+        }
+        TMap<FString, TArray<FCharmInstance>> Instances;
+        const TSharedRef<FJsonObject> JsonObject = MakeShared<FJsonObject>();
+        while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ObjectEnd)
+        {
+            const FString Field = Reader.GetIdentifier();
+            if (Field == TEXT("Instances") && Notation == EJsonNotation::ObjectStart)
+            {
+                if (!ReadInstances(Reader, Instances))
+                {
+                    return false;
+                }
+                continue;
+            }
+            const TSharedPtr<FJsonValue> Value = ReadValue(Reader, Notation);
+            if (!Value.IsValid())
+            {
+                return false;
+            }
+            JsonObject->SetField(Field, Value);
+        }
+        if (Notation != EJsonNotation::ObjectEnd)
+        {
+            return false;
+        }
+        OutConfig = FromJson(*JsonObject);
+        OutConfig.Instances = MoveTemp(Instances);
+        return true;
+    }
+
+    /** Build the json value starting at the current token, for the sections small enough to keep as a tree. */
+    static TSharedPtr<FJsonValue> ReadValue(FJsonStreamReader& Reader, EJsonNotation Notation)
+    {
+        switch (Notation)
+        {
+            case EJsonNotation::ObjectStart:
+            {
+                const TSharedRef<FJsonObject> Object = MakeShared<FJsonObject>();
+                while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ObjectEnd)
+                {
+                    const FString Field = Reader.GetIdentifier();
+                    const TSharedPtr<FJsonValue> Value = ReadValue(Reader, Notation);
+                    if (!Value.IsValid())
+                    {
+                        return nullptr;
+                    }
+                    Object->SetField(Field, Value);
+                }
+                return Notation == EJsonNotation::ObjectEnd ? MakeShared<FJsonValueObject>(Object) : nullptr;
+            }
+            case EJsonNotation::ArrayStart:
+            {
+                TArray<TSharedPtr<FJsonValue>> Array;
+                while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ArrayEnd)
+                {
+                    const TSharedPtr<FJsonValue> Value = ReadValue(Reader, Notation);
+                    if (!Value.IsValid())
+                    {
+                        return nullptr;
+                    }
+                    Array.Add(Value);
+                }
+                return Notation == EJsonNotation::ArrayEnd ? MakeShared<FJsonValueArray>(Array) : nullptr;
+            }
+            case EJsonNotation::String:
+                return MakeShared<FJsonValueString>(Reader.GetValueAsString());
+            case EJsonNotation::Number:
+                return MakeShared<FJsonValueNumber>(Reader.GetValueAsNumber());
+            case EJsonNotation::Boolean:
+                return MakeShared<FJsonValueBoolean>(Reader.GetValueAsBoolean());
+            case EJsonNotation::Null:
+                return MakeShared<FJsonValueNull>();
+            default:
+                return nullptr;
+        }
+    }
+
+    static bool SkipValue(FJsonStreamReader& Reader, EJsonNotation Notation)
+    {
+        switch (Notation)
+        {
+            case EJsonNotation::ObjectStart:
+                return Reader.SkipObject();
+            case EJsonNotation::ArrayStart:
+                return Reader.SkipArray();
+            case EJsonNotation::Error:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    static bool ReadInstances(FJsonStreamReader& Reader, TMap<FString, TArray<FCharmInstance>>& OutInstances)
+    {
+        EJsonNotation Notation;
+        while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ObjectEnd)
+        {
+            if (Notation != EJsonNotation::ArrayStart)
+            {
+                if (!SkipValue(Reader, Notation))
+                {
+                    return false;
+                }
+                continue;
+            }
+            TArray<FCharmInstance>& MeshInstances = OutInstances.FindOrAdd(Reader.GetIdentifier());
+            while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ArrayEnd)
+            {
+                if (Notation == EJsonNotation::ObjectStart)
+                {
+                    if (!ReadInstance(Reader, MeshInstances.AddDefaulted_GetRef()))
+                    {
+                        return false;
+                    }
+                }
+                else if (!SkipValue(Reader, Notation))
+                {
+                    return false;
+                }
+            }
+            if (Notation != EJsonNotation::ArrayEnd)
+            {
+                return false;
+            }
+            MeshInstances.Shrink();
+        }
+        return Notation == EJsonNotation::ObjectEnd;
+    }
+
+    static bool ReadInstance(FJsonStreamReader& Reader, FCharmInstance& OutInstance)
+    {
+        EJsonNotation Notation;
+        while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ObjectEnd)
+        {
+            // Compared before reading the value, which replaces the identifier
+            const FString& Field = Reader.GetIdentifier();
+            const bool bTranslation = Field == TEXT("Translation");
+            const bool bRotation = Field == TEXT("Rotation");
+            const bool bScale = Field == TEXT("Scale");
+            if (bScale && Notation == EJsonNotation::Number)
+            {
+                // Charm writes a uniform scale as a single number
+                OutInstance.Scale = FVector3f((float) Reader.GetValueAsNumber());
+                continue;
+            }
+            if (Notation != EJsonNotation::ArrayStart || !(bTranslation || bRotation || bScale))
+            {
+                if (!SkipValue(Reader, Notation))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            float Components[4] = {};
+            int32 NumComponents = 0;
+            while (Reader.ReadNext(Notation) && Notation != EJsonNotation::ArrayEnd)
+            {
+                if (Notation == EJsonNotation::Number && NumComponents < 4)
+                {
+                    Components[NumComponents++] = (float) Reader.GetValueAsNumber();
+                }
+                else if (!SkipValue(Reader, Notation))
+                {
+                    return false;
+                }
+            }
+            if (Notation != EJsonNotation::ArrayEnd)
+            {
+                return false;
+            }
+            if (bTranslation && NumComponents >= 3)
+            {
+                OutInstance.Translation = FVector3f(Components[0], Components[1], Components[2]);
+            }
+            else if (bRotation && NumComponents >= 4)
+            {
+                OutInstance.Rotation = FQuat4f(Components[0], Components[1], Components[2], Components[3]);
+            }
+            else if (bScale && NumComponents >= 3)
+            {
+                OutInstance.Scale = FVector3f(Components[0], Components[1], Components[2]);
+            }
+        }
+        return Notation == EJsonNotation::ObjectEnd;
+    }
+
+    static void ReadShaderStage(const FJsonObject& StageObject, FCharmShaderStage& OutStage)
+    {
+        const TSharedPtr<FJsonObject>* Textures;
+        if (StageObject.TryGetObjectField(TEXT("Textures"), Textures))
+        {
+            OutStage.Textures.Reserve((*Textures)->Values.Num());
+            for (const auto& Pair : (*Textures)->Values)
+            {
+                const TSharedPtr<FJsonObject>* TextureObject;
+                if (!Pair.Value->TryGetObject(TextureObject))
+                {
+                    continue;
+                }
+                FCharmTextureBinding& Binding = OutStage.Textures.AddDefaulted_GetRef();
+                Binding.Slot = Pair.Key;
+                (*TextureObject)->TryGetStringField(TEXT("Hash"), Binding.Hash);
+                (*TextureObject)->TryGetBoolField(TEXT("SRGB"), Binding.bSrgb);
+            }
+        }
+
+        const TSharedPtr<FJsonObject>* ConstantBuffers;
+        if (StageObject.TryGetObjectField(TEXT("ConstantBuffers"), ConstantBuffers))
+        {
+            for (const auto& Pair : (*ConstantBuffers)->Values)
+            {
+                const TArray<TSharedPtr<FJsonValue>>* Data;
+                if (!Pair.Value->TryGetArray(Data))
+                {
+                    continue;
+                }
+                FCharmConstantBufferRange& Range = OutStage.ConstantBuffers.AddDefaulted_GetRef();
+                Range.Count = FCString::Atoi(*Pair.Key);
+                Range.Offset = OutStage.ConstantBufferValues.Num();
+                Range.Num = Data->Num();
+                OutStage.ConstantBufferValues.Reserve(Range.Offset + Range.Num);
+                for (const TSharedPtr<FJsonValue>& JsonValue : *Data)
+                {
+                    FVector4f& Value = OutStage.ConstantBufferValues.AddZeroed_GetRef();
+                    const TSharedPtr<FJsonObject>* ValueObject;
+                    if (JsonValue->TryGetObject(ValueObject))
+                    {
+                        const FJsonObject& Components = **ValueObject;
+                        Value = FVector4f((float) Components.GetNumberField(TEXT("X")), (float) Components.GetNumberField(TEXT("Y")),
+                            (float) Components.GetNumberField(TEXT("Z")), (float) Components.GetNumberField(TEXT("W")));
+                    }
+                }
+            }
+        }
+    }
+};
+
+/** A material from a config, together with the export directory its shaders and textures are in. */
+struct FCharmMaterialSource
+{
+    TSharedPtr<const FCharmMaterial> Material;
+    FString SourceDirectory;
+};
+
+/** The configs of an export, with the meshes and materials they reference merged. */
+struct FCharmExport
+{
+    // In file path order, so everything merged from them comes out the same on every run
+    TArray<FCharmConfig> Configs;
+    // FBX of every distinct mesh, statics' own and the ones maps place, in the order of the first config that uses it
+    TArray<FString> MeshPaths;
+    // Config file of each FBX that has one of its own, part of the mesh's signature
+    TMap<FString, FString> MeshConfigPaths;
+    // The first config mentioning a material decides where its shaders and textures are
+    TMap<FString, FCharmMaterialSource> Materials;
+
+    /**
+     * Read and decode config files on the thread pool.
+     *
+     * @param ConfigFilePaths The *_info.cfg files.
+     * @return the configs that loaded, sorted by file path.
+     */
+    static TArray<FCharmConfig> LoadConfigs(TArray<FString> ConfigFilePaths)
+    {
+        CHARM_IMPORT_STAGE(Config);
+        ConfigFilePaths.Sort();
+        TArray<FCharmConfig> Configs;
+        Configs.SetNum(ConfigFilePaths.Num());
+        TArray<bool> Loaded;
+        Loaded.SetNumZeroed(ConfigFilePaths.Num());
+        ParallelFor(ConfigFilePaths.Num(),
+            [&ConfigFilePaths, &Configs, &Loaded](int32 Index)
+            { Loaded[Index] = FCharmConfig::Load(ConfigFilePaths[Index], Configs[Index]); });
+
+        int32 NumLoaded = 0;
+        for (int32 Index = 0; Index < Configs.Num(); Index++)
+        {
+            if (Loaded[Index])
+            {
+                if (NumLoaded != Index)
+                {
+                    Configs[NumLoaded] = MoveTemp(Configs[Index]);
+                }
+                NumLoaded++;
+            }
+        }
+        Configs.SetNum(NumLoaded);
+        return Configs;
+    }
+
+    /**
+     * Merge the meshes and materials of configs, which should be in a stable order such as the one LoadConfigs returns. A map
+     * config adds the statics it places, so they are imported in the same batch as the statics exported on their own.
+     */
+    static FCharmExport Merge(TArray<FCharmConfig>&& Configs)
+    {
+        FCharmExport Export;
+        Export.Configs = MoveTemp(Configs);
+        TMap<FString, FString> MeshPathsByName;
+        auto AddMesh = [&Export, &MeshPathsByName](const FString& MeshName, const FString& SourceDirectory)
+        {
+            if (const FString* MeshPath = MeshPathsByName.Find(MeshName))
+            {
+                return *MeshPath;
+            }
+            const FString MeshPath = SourceDirectory / MeshName + ".fbx";
+            MeshPathsByName.Add(MeshName, MeshPath);
+            Export.MeshPaths.Add(MeshPath);
+            return MeshPath;
+        };
+        for (const FCharmConfig& Config : Export.Configs)
+        {
+            if (Config.Instances.Num() == 0)
+            {
+                // A map may have placed the static before its own config came up
+                Export.MeshConfigPaths.FindOrAdd(AddMesh(Config.MeshName, Config.GetSourceDirectory()), Config.FilePath);
+            }
+            for (const auto& Pair : Config.Instances)
+            {
+                AddMesh(Pair.Key, Config.GetSourceDirectory());
+            }
+            for (const auto& Pair : Config.Materials)
+            {
+                if (!Export.Materials.Contains(Pair.Key))
+                {
+                    Export.Materials.Add(Pair.Key, {Pair.Value, Config.GetSourceDirectory()});
+                }
+            }
+        }
+        return Export;
+    }
+};
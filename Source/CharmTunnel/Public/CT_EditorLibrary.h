@@ -2,23 +2,41 @@
 
 #include "AssetRegistry/AssetRegistryModule.h"
 #include "AssetToolsModule.h"
+#include "CT_AssetIndex.h"
+#include "CT_ConfigModel.h"
+#include "CT_ImportBudget.h"
+#include "CT_ImportManifest.h"
+#include "CT_MeshBuildProfile.h"
+#include "CT_Stats.h"
 #include "CT_UsfConverter.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
 #include "CoreMinimal.h"
 #include "EditorAssetLibrary.h"
+#include "EditorFramework/AssetImportData.h"
 #include "Factories/FbxFactory.h"
 #include "Factories/FbxImportUI.h"
 #include "Factories/FbxStaticMeshImportData.h"
 #include "Factories/MaterialFactoryNew.h"
+#include "Factories/MaterialInstanceConstantFactoryNew.h"
 #include "Factories/TextureFactory.h"
 #include "LevelEditorSubsystem.h"
 #include "MaterialEditingLibrary.h"
+#include "MaterialShared.h"
 #include "Materials/MaterialExpressionBreakMaterialAttributes.h"
 #include "Materials/MaterialExpressionCustom.h"
 #include "Materials/MaterialExpressionTextureCoordinate.h"
+#include "Materials/MaterialExpressionTextureSampleParameter2D.h"
+#include "Materials/MaterialExpressionVectorParameter.h"
+#include "Materials/MaterialInstanceConstant.h"
 #include "Misc/FileHelper.h"
+#include "Misc/PackageName.h"
+#include "Misc/ScopedSlowTask.h"
+#include "Misc/SecureHash.h"
 #include "ObjectTools.h"
-#include "Serialization/JsonReader.h"
-#include "Serialization/JsonSerializer.h"
+#include "PackageTools.h"
+#include "ShaderCompiler.h"
+#include "Subsystems/EditorActorSubsystem.h"
+#include "UObject/UObjectIterator.h"
 
 #include "CT_EditorLibrary.generated.h"
 
@@ -30,6 +48,12 @@ inline DEFINE_LOG_CATEGORY(LogCharmTunnel);
 #define LOG_WARNING(x, ...) UE_LOG(LogCharmTunnel, Warning, TEXT(x), __VA_ARGS__)
 #define LOG_ERROR(x, ...) UE_LOG(LogCharmTunnel, Error, TEXT(x), __VA_ARGS__)
 
+inline TAutoConsoleVariable<bool> CVarCharmShareParentMaterials(TEXT("CharmTunnel.ShareParentMaterials"), true,
+    TEXT("Create one parent material per distinct pixel shader body and import each material as an instance of it."));
+
+inline TAutoConsoleVariable<bool> CVarCharmIncrementalImport(TEXT("CharmTunnel.IncrementalImport"), true,
+    TEXT("Rebuild only the imported assets whose sources changed since the last import, tracked in Saved/CharmTunnel."));
+
 /*
 
 Todo:
@@ -43,6 +67,10 @@ struct CHARMTUNNEL_API FCharmEditorLibrary
 {
     GENERATED_BODY()
 public:
+    /** Bump when a change to how meshes or materials are built should rebuild them on the next incremental import. */
+    static constexpr int32 MeshBuildVersion = 1;
+    static constexpr int32 MaterialBuildVersion = 1;
+
     /**
      * Creates a level.
      *
@@ -69,6 +97,10 @@ public:
      */
     static bool DoesAssetExist(const FString AssetPath)
     {
+        if (const FCharmAssetIndex* AssetIndex = FCharmAssetIndex::Find(AssetPath))
+        {
+            return AssetIndex->Contains(AssetPath);
+        }
         FAssetRegistryModule& AssetRegistryModule = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry");
         TArray<FAssetData> AssetDataList;
         AssetRegistryModule.Get().GetAssetsByPackageName(*AssetPath, AssetDataList);
@@ -102,24 +134,87 @@ public:
     }
 
     /**
-     * Deletes the given directory.
+     * Deletes every asset under the given content directory, meant for generated output.
+     *
+     * Nothing is loaded: packages already in memory are unloaded, then the package files are deleted and the asset registry is
+     * told they are gone. References between the deleted assets are expected, only assets outside the directory are checked
+     * for references, and anything they still reference is kept.
      *
-     * @param DirectoryPath The directory to delete.
-     * @return true if the directory is deleted.
+     * @param DirectoryPath The content directory to delete, e.g. /CharmTunnel/Dev/Data.
+     * @return true if every asset in the directory is deleted.
      */
     static bool DeleteDirectory(const FString DirectoryPath)
     {
-        TArray<FString> FilesToDelete = GetFilesInDirectory(DirectoryPath);
-        if (FilesToDelete.Num() > 0)
+        IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+        FString Directory = DirectoryPath;
+        Directory.RemoveFromEnd(TEXT("/"));
+        TArray<FAssetData> Assets;
+        AssetRegistry.GetAssetsByPath(FName(Directory), Assets, true);
+        if (Assets.Num() == 0)
         {
-            TArray<UObject*> AssetsToDelete;
-            for (const auto& FileToDelete : FilesToDelete)
+            return false;
+        }
+
+        TSet<FName> Generated;
+        for (const FAssetData& Asset : Assets)
+        {
+            Generated.Add(Asset.PackageName);
+        }
+        TArray<FName> PackagesToDelete;
+        TArray<FName> Referencers;
+        for (const FName& PackageName : Generated)
+        {
+            Referencers.Reset();
+            AssetRegistry.GetReferencers(PackageName, Referencers);
+            const FName* ExternalReferencer =
+                Referencers.FindByPredicate([&Generated](FName Referencer) { return !Generated.Contains(Referencer); });
+            if (ExternalReferencer)
             {
-                AssetsToDelete.Add(LoadAsset<UObject>(FileToDelete));
+                LOG_WARNING("Keeping %s, it is referenced by %s.", *PackageName.ToString(), *ExternalReferencer->ToString());
+                continue;
             }
-            return ObjectTools::ForceDeleteObjects(AssetsToDelete, false) == AssetsToDelete.Num();
+            PackagesToDelete.Add(PackageName);
         }
-        return false;
+
+        TArray<UPackage*> LoadedPackages;
+        for (const FName& PackageName : PackagesToDelete)
+        {
+            if (UPackage* Package = FindPackage(nullptr, *PackageName.ToString()))
+            {
+                LoadedPackages.Add(Package);
+            }
+        }
+        FText UnloadError;
+        if (LoadedPackages.Num() > 0 && !UPackageTools::UnloadPackages(LoadedPackages, UnloadError))
+        {
+            LOG_ERROR("Failed to unload the packages in %s: %s", *Directory, *UnloadError.ToString());
+            return false;
+        }
+
+        TArray<FString> DeletedFiles;
+        int32 NumUnsaved = 0;
+        for (const FName& PackageName : PackagesToDelete)
+        {
+            // Never saved, unloading it above was all there was to delete
+            FString Filename;
+            if (!FPackageName::DoesPackageExist(PackageName.ToString(), &Filename))
+            {
+                NumUnsaved++;
+            }
+            else if (IFileManager::Get().Delete(*Filename, false, true))
+            {
+                DeletedFiles.Add(Filename);
+            }
+            else
+            {
+                LOG_ERROR("Failed to delete package file of %s.", *PackageName.ToString());
+            }
+        }
+        // Rescanning files that no longer exist drops their assets from the registry
+        AssetRegistry.ScanModifiedAssetFiles(DeletedFiles);
+
+        LOG("Deleted %d of %d assets in %s.", DeletedFiles.Num() + NumUnsaved, Generated.Num(), *Directory);
+        return DeletedFiles.Num() + NumUnsaved == Generated.Num();
     }
 
     /**
@@ -157,6 +252,30 @@ public:
         return Cast<T>(LoadObject<T>(nullptr, *AssetPath));
     }
 
+    /**
+     * Load assets as one batch of async package requests and wait for them together, so the LoadAsset calls that follow find
+     * them in memory instead of each blocking on its own load. Assets that do not exist or are already loaded are skipped.
+     *
+     * @param AssetPaths The assets about to be loaded.
+     */
+    static void PreloadAssets(const TArray<FString>& AssetPaths)
+    {
+        int32 NumRequests = 0;
+        for (const FString& AssetPath : AssetPaths)
+        {
+            if (!FindPackage(nullptr, *AssetPath) && DoesAssetExist(AssetPath))
+            {
+                LoadPackageAsync(AssetPath);
+                NumRequests++;
+            }
+        }
+        if (NumRequests > 0)
+        {
+            FlushAsyncLoading();
+            LOG_VERBOSE("Preloaded %d assets.", NumRequests);
+        }
+    }
+
     /**
      * Get a list of all files in a given folder, recursive.
      *
@@ -170,133 +289,997 @@ public:
         return Files;
     }
 
-    static bool LoadConfigFile(const FString& ConfigFilePath, OUT TSharedPtr<FJsonObject>& JsonObject)
+    static bool LoadConfigFile(const FString& ConfigFilePath, OUT FCharmConfig& Config)
     {
-        FString FileContents;
-        if (!FFileHelper::LoadFileToString(FileContents, *ConfigFilePath))
+        CHARM_IMPORT_STAGE(Config);
+        return FCharmConfig::Load(ConfigFilePath, Config);
+    }
+
+    /**
+     * Import an asset using a Charm config file.
+     *
+     * @param ConfigFilePath The path of the *_info.cfg file.
+     * @param TargetDirectory The directory to import the asset into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @return true if the asset is imported.
+     */
+    static bool ImportAssetFromConfigFile(const FString& ConfigFilePath, const FString& TargetDirectory, const FString& MeshDirectory)
+    {
+        const FCharmImportReport::FImport ImportReport;
+        // Read the config file to determine how to load the file.
+        FCharmConfig Config;
+        if (!LoadConfigFile(ConfigFilePath, Config))
         {
-            LOG_ERROR("Failed to load config file %s.", *ConfigFilePath);
             return false;
         }
 
-        const TSharedRef<TJsonReader<>> JsonReader = TJsonReaderFactory<>::Create(FileContents);
+        // Identify how to import this asset fully depending on the type.
+        // TODO account for entities
+        const FCharmMeshBuildProfile Profile = FCharmMeshBuildProfile::Load(Config.GetSourceDirectory());
+        if (Config.Instances.Num() == 0)
+        {
+            return ImportStaticFromConfigFile(Config, Config.GetSourceDirectory(), TargetDirectory, MeshDirectory, Profile);
+        }
+        else
+        {
+            // todo maybe rename info.cfg to metadata
+            return ImportMapFromConfigFile(Config, TargetDirectory, MeshDirectory, Profile);
+        }
+    }
 
-        if (!FJsonSerializer::Deserialize(JsonReader, JsonObject) || !JsonObject.IsValid())
+    /**
+     * Import every static in a Charm export at once.
+     *
+     * All configs are read first, in parallel, then each asset type goes through a single batched import: one FBX import for the
+     * union of meshes, one texture import for the union of textures, one parallel shader conversion for the union of new
+     * materials. Materials are created once each and then assigned to every mesh that uses them. The statics that maps place
+     * are part of the batch, the placements of each map are added to the current level once it is done.
+     *
+     * @param ExportDirectory The directory searched recursively for *_info.cfg files, and the one with the mesh build profile.
+     * @param TargetDirectory The directory to import the assets into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @param bPlaceMaps Whether to add the map placements to the current level, or only bring the assets up to date.
+     * @return true if any asset was imported.
+     */
+    static bool ImportExportFromDirectory(
+        const FString& ExportDirectory, const FString& TargetDirectory, const FString& MeshDirectory, bool bPlaceMaps = true)
+    {
+        const FCharmImportReport::FImport ImportReport;
+        const FCharmExport Export = FCharmExport::Merge(FCharmExport::LoadConfigs(GetFilesInDirectory(ExportDirectory, "*_info.cfg")));
+        if (Export.Configs.Num() == 0)
         {
-            LOG_ERROR("Unable to parse config json=[%s]", *FileContents);
+            LOG_WARNING("No configs found in %s.", *ExportDirectory);
             return false;
         }
 
-        return true;
+        const FCharmMeshBuildProfile Profile = FCharmMeshBuildProfile::Load(ExportDirectory);
+        const TArray<UStaticMesh*> Meshes = ImportStatics(Export, TargetDirectory, MeshDirectory, Profile);
+        bool bImportedAny = Meshes.Num() > 0;
+        for (const FCharmConfig& Config : Export.Configs)
+        {
+            if (bPlaceMaps && Config.Instances.Num() > 0)
+            {
+                bImportedAny |= PlaceMapInstances(Config, Meshes);
+            }
+        }
+        return bImportedAny;
     }
 
     /**
-     * Import an asset using a Charm config file.
+     * Import static meshes and the materials they use in one batch, skipping anything unchanged since the last import.
+     * Parent materials no material uses anymore are deleted afterwards.
      *
-     * @param ConfigFilePath The path of the *_info.cfg file.
-     * @param TargetDirectory The directory to import the asset into.
-     * @return true if the asset is imported.
+     * @param Export The FBX files to import, one static mesh each, and the materials they can use.
+     * @param TargetDirectory The directory to import the materials and textures into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @param Profile How the meshes are built, applied to every mesh imported or given new materials.
+     * @return the imported and up to date meshes.
      */
-    static bool ImportAssetFromConfigFile(const FString& ConfigFilePath, const FString& TargetDirectory)
+    static TArray<UStaticMesh*> ImportStatics(const FCharmExport& Export, const FString& TargetDirectory, const FString& MeshDirectory,
+        const FCharmMeshBuildProfile& Profile)
     {
-        // Read the config file to determine how to load the file.
-        TSharedPtr<FJsonObject> JsonObject;
-        if (!LoadConfigFile(ConfigFilePath, JsonObject))
+        const FCharmImportReport::FImport ImportReport;
+        const FCharmAssetIndex AssetIndex({TargetDirectory, MeshDirectory});
+
+        // Incremental imports skip meshes and materials whose sources did not change since they were last built
+        const bool bIncremental = CVarCharmIncrementalImport.GetValueOnGameThread();
+        FCharmImportManifest Manifest;
+        if (bIncremental)
         {
-            return false;
+            Manifest.Load();
         }
 
-        const FString ParentDirectory = FPaths::GetPath(ConfigFilePath);
+        TSet<UStaticMesh*> MeshesToAssign;
+        const TArray<UStaticMesh*> Meshes =
+            ImportMeshes(Export.MeshPaths, Export.MeshConfigPaths, MeshDirectory, Profile, bIncremental, Manifest, MeshesToAssign);
+        const int32 NumUpToDateMeshes = Meshes.Num() - MeshesToAssign.Num();
 
-        // Identify how to import this asset fully depending on the type.
-        // TODO account for entities
-        if (JsonObject->GetObjectField("Instances")->Values.Num() == 0)
+        // Only materials some mesh actually uses
+        TMap<FString, FCharmMaterialSource> UsedMaterials;
+        for (UStaticMesh* Mesh : Meshes)
         {
-            return ImportStaticFromConfigFile(JsonObject, ParentDirectory, TargetDirectory);
+            for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+            {
+                const FString MaterialHash = StaticMaterial.MaterialSlotName.ToString();
+                if (const FCharmMaterialSource* Source = Export.Materials.Find(MaterialHash))
+                {
+                    UsedMaterials.Add(MaterialHash, *Source);
+                }
+            }
         }
-        else
+
+        // Changed materials are deleted and built again below, the meshes using them get the new asset assigned
+        TMap<FString, FString> MaterialSignatures;
+        TSet<FString> DirtyMaterials;
+        for (const auto& Pair : UsedMaterials)
         {
-            // todo implement + maybe rename info.cfg to metadata
-            // ImportMapFromConfigFile(JsonObject, TargetDirectory);
+            const FString MaterialPath = TargetDirectory / "Materials" / Pair.Key;
+            const FString Signature = GetMaterialSignature(Manifest, Pair.Key, Pair.Value);
+            MaterialSignatures.Add(MaterialPath, Signature);
+            const bool bExists = DoesAssetExist(MaterialPath);
+            if (bExists && (!bIncremental || Manifest.IsUpToDate(MaterialPath, Signature)))
+            {
+                continue;
+            }
+            if (bExists && !DeleteAsset(MaterialPath))
+            {
+                LOG_ERROR("Failed to delete changed material %s, keeping the old one.", *MaterialPath);
+                continue;
+            }
+            DirtyMaterials.Add(Pair.Key);
         }
-        return true;
+        for (UStaticMesh* Mesh : Meshes)
+        {
+            for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+            {
+                if (DirtyMaterials.Contains(StaticMaterial.MaterialSlotName.ToString()))
+                {
+                    MeshesToAssign.Add(Mesh);
+                }
+            }
+        }
+
+        ImportMaterialTextures(UsedMaterials, TargetDirectory);
+        const TMap<FString, UMaterialInterface*> Materials = CreateMaterials(UsedMaterials, TargetDirectory);
+        for (UStaticMesh* Mesh : MeshesToAssign)
+        {
+            AssignMaterials(Mesh, Materials);
+        }
+        // Needs the materials, their blend modes decide which meshes can be Nanite
+        Profile.Apply(MeshesToAssign.Array());
+        // A material whose shader failed to convert was not built, so it must stay out of date until its conversion succeeds
+        int32 NumFailedMaterials = 0;
+        for (const FString& MaterialHash : DirtyMaterials)
+        {
+            const FString MaterialPath = TargetDirectory / "Materials" / MaterialHash;
+            if (Materials.Contains(MaterialHash))
+            {
+                Manifest.Record(MaterialPath, MaterialSignatures[MaterialPath]);
+            }
+            else
+            {
+                Manifest.Forget(MaterialPath);
+                NumFailedMaterials++;
+            }
+        }
+        if (bIncremental)
+        {
+            Manifest.Save();
+        }
+        if (DirtyMaterials.Num() > 0)
+        {
+            DeleteUnusedParentMaterials(TargetDirectory);
+        }
+
+        LOG("Imported %d meshes (%d unchanged) and built %d materials (%d unchanged, %d failed).", Meshes.Num() - NumUpToDateMeshes,
+            NumUpToDateMeshes, DirtyMaterials.Num() - NumFailedMaterials, UsedMaterials.Num() - DirtyMaterials.Num(),
+            NumFailedMaterials);
+        return Meshes;
+    }
+
+    /**
+     * Import the meshes whose FBX, config or build profile changed since they were last imported and load the others.
+     *
+     * @param MeshPaths The FBX files to import, one static mesh each.
+     * @param MeshConfigPaths The config file of each FBX that has one, part of the mesh's signature.
+     * @param MeshDirectory The directory to import the static meshes into, each named after its FBX file.
+     * @param Profile How the meshes are built, part of their signature.
+     * @param bIncremental False to import every mesh.
+     * @param Manifest Where the signatures of the imported meshes are recorded.
+     * @param OutImported The meshes that were imported and still need their materials.
+     * @return the imported and up to date meshes.
+     */
+    static TArray<UStaticMesh*> ImportMeshes(const TArray<FString>& MeshPaths, const TMap<FString, FString>& MeshConfigPaths,
+        const FString& MeshDirectory, const FCharmMeshBuildProfile& Profile, bool bIncremental, FCharmImportManifest& Manifest,
+        TSet<UStaticMesh*>& OutImported)
+    {
+        TArray<UStaticMesh*> Meshes;
+        TArray<FString> DirtyMeshPaths;
+        TMap<FString, FString> MeshSignatures;
+        for (const FString& MeshPath : MeshPaths)
+        {
+            const FString MeshAssetPath = MeshDirectory / FPaths::GetBaseFilename(MeshPath);
+            // Statics placed by a map have no config of their own
+            const FString* ConfigPath = MeshConfigPaths.Find(MeshPath);
+            FCharmInputSignature MeshSignature = Manifest.MakeSignature();
+            MeshSignature.AddInt(MeshBuildVersion).AddString(Profile.ToString()).AddFile(MeshPath);
+            if (ConfigPath)
+            {
+                MeshSignature.AddFile(*ConfigPath);
+            }
+            else
+            {
+                MeshSignature.AddString(FString());
+            }
+            const FString Signature = MeshSignature.Finish();
+            if (bIncremental && Manifest.IsUpToDate(MeshAssetPath, Signature) && DoesAssetExist(MeshAssetPath))
+            {
+                if (UStaticMesh* Mesh = LoadAsset<UStaticMesh>(MeshAssetPath))
+                {
+                    Meshes.Add(Mesh);
+                    continue;
+                }
+            }
+            DirtyMeshPaths.Add(MeshPath);
+            MeshSignatures.Add(MeshAssetPath, Signature);
+        }
+
+        // A single batch unless there is a memory budget, batches it unloads are loaded again once all are imported
+        TArray<FString> UnloadedMeshPaths;
+        const int32 BatchSize = FCharmImportMemoryBudget::GetBatchSize(DirtyMeshPaths.Num());
+        for (int32 First = 0; First < DirtyMeshPaths.Num(); First += BatchSize)
+        {
+            const TArray<FString> BatchPaths(DirtyMeshPaths.GetData() + First, FMath::Min(BatchSize, DirtyMeshPaths.Num() - First));
+            TArray<UObject*> BatchMeshes;
+            TArray<FString> BatchMeshPaths;
+            for (UObject* ImportedObject : ImportFbxAsStaticMeshes(BatchPaths, MeshDirectory))
+            {
+                if (UStaticMesh* ImportedMesh = Cast<UStaticMesh>(ImportedObject))
+                {
+                    BatchMeshes.Add(ImportedMesh);
+                    const FString MeshAssetPath = ImportedMesh->GetPackage()->GetName();
+                    BatchMeshPaths.Add(MeshAssetPath);
+                    if (const FString* Signature = MeshSignatures.Find(MeshAssetPath))
+                    {
+                        Manifest.Record(MeshAssetPath, *Signature);
+                    }
+                }
+            }
+            if (FCharmImportMemoryBudget::Flush(BatchMeshes))
+            {
+                UnloadedMeshPaths.Append(BatchMeshPaths);
+                continue;
+            }
+            for (UObject* ImportedMesh : BatchMeshes)
+            {
+                Meshes.Add(CastChecked<UStaticMesh>(ImportedMesh));
+                OutImported.Add(CastChecked<UStaticMesh>(ImportedMesh));
+            }
+        }
+
+        PreloadAssets(UnloadedMeshPaths);
+        for (const FString& MeshAssetPath : UnloadedMeshPaths)
+        {
+            if (UStaticMesh* Mesh = LoadAsset<UStaticMesh>(MeshAssetPath))
+            {
+                Meshes.Add(Mesh);
+                OutImported.Add(Mesh);
+            }
+        }
+        return Meshes;
+    }
+
+    /**
+     * One import worker's part of ImportStatics. The meshes and textures are split between NumShards workers so that each
+     * asset has exactly one owner: mesh i goes to worker i % NumShards, a texture to the worker its hash maps to. Materials
+     * are shared between meshes of different workers, so a worker only assigns those that already exist and leaves building
+     * the rest to the coordinator, which runs ImportStatics over the whole export once the workers are done. The worker's
+     * manifest (see -CharmImportManifest) is always saved, that is how the coordinator knows the meshes are up to date.
+     *
+     * @param Export Every FBX of the export, in the same order for all workers, and every material.
+     * @param TargetDirectory The directory to import the textures into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @param Profile How the meshes are built.
+     * @param Shard This worker's index.
+     * @param NumShards The number of workers.
+     * @return the meshes this worker owns.
+     */
+    static TArray<UStaticMesh*> ImportStaticsShard(const FCharmExport& Export, const FString& TargetDirectory,
+        const FString& MeshDirectory, const FCharmMeshBuildProfile& Profile, int32 Shard, int32 NumShards)
+    {
+        const FCharmImportReport::FImport ImportReport;
+        const FCharmAssetIndex AssetIndex({TargetDirectory, MeshDirectory});
+        const bool bIncremental = CVarCharmIncrementalImport.GetValueOnGameThread();
+        FCharmImportManifest Manifest;
+        Manifest.Load();
+
+        TArray<FString> ShardMeshPaths;
+        for (int32 Index = Shard; Index < Export.MeshPaths.Num(); Index += NumShards)
+        {
+            ShardMeshPaths.Add(Export.MeshPaths[Index]);
+        }
+        TSet<UStaticMesh*> ImportedMeshes;
+        const TArray<UStaticMesh*> Meshes =
+            ImportMeshes(ShardMeshPaths, Export.MeshConfigPaths, MeshDirectory, Profile, bIncremental, Manifest, ImportedMeshes);
+
+        TMap<FString, UMaterialInterface*> ExistingMaterials;
+        for (UStaticMesh* Mesh : ImportedMeshes)
+        {
+            for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+            {
+                const FString MaterialHash = StaticMaterial.MaterialSlotName.ToString();
+                const FString MaterialPath = TargetDirectory / "Materials" / MaterialHash;
+                if (!ExistingMaterials.Contains(MaterialHash) && DoesAssetExist(MaterialPath))
+                {
+                    if (UMaterialInterface* Material = LoadAsset<UMaterialInterface>(MaterialPath))
+                    {
+                        ExistingMaterials.Add(MaterialHash, Material);
+                    }
+                }
+            }
+        }
+        // Meshes still missing a material are built by the coordinator once it has created them
+        TArray<UStaticMesh*> MeshesToBuild;
+        for (UStaticMesh* Mesh : ImportedMeshes)
+        {
+            AssignMaterials(Mesh, ExistingMaterials);
+            bool bHasAllMaterials = true;
+            for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+            {
+                bHasAllMaterials &= ExistingMaterials.Contains(StaticMaterial.MaterialSlotName.ToString());
+            }
+            if (bHasAllMaterials)
+            {
+                MeshesToBuild.Add(Mesh);
+            }
+        }
+        Profile.Apply(MeshesToBuild);
+
+        ImportMaterialTextures(Export.Materials, TargetDirectory, Shard, NumShards);
+        Manifest.Save();
+
+        LOG("Worker %d of %d imported %d meshes (%d unchanged).", Shard + 1, NumShards, ImportedMeshes.Num(),
+            Meshes.Num() - ImportedMeshes.Num());
+        return Meshes;
+    }
+
+    /**
+     * Signature of everything a material is built from: its pixel shader source, config entry and the DDS files of the
+     * textures it binds, and the converter and material builder settings that change the result.
+     */
+    static FString GetMaterialSignature(FCharmImportManifest& Manifest, const FString& MaterialHash, const FCharmMaterialSource& Source)
+    {
+        const bool bParametric = CVarCharmShareParentMaterials.GetValueOnGameThread();
+        FCharmInputSignature Signature = Manifest.MakeSignature();
+        Signature.AddInt(MaterialBuildVersion)
+            .AddInt(CT_UsfConverter::Version)
+            .AddInt((int32) CT_UsfConverter::GetOptions(bParametric))
+            .AddFile(Source.SourceDirectory / "Shaders" / "PS_" + MaterialHash + ".hlsl")
+            .AddShaderStage(Source.Material->PS);
+        for (const FCharmTextureBinding& Texture : Source.Material->PS.Textures)
+        {
+            Signature.AddFile(Source.SourceDirectory / "Textures" / Texture.Hash + ".dds");
+        }
+        return Signature.Finish();
     }
 
     /**
      * Import an static mesh asset using a Charm config file.
      *
-     * @param JsonObject Json object of the info config file.
+     * @param Config The decoded info config file.
      * @param SourceDirectory The directory to import the asset from.
      * @param TargetDirectory The directory to import the asset into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @param Profile How the mesh is built.
      * @return true if the asset is imported.
      */
-    static bool ImportStaticFromConfigFile(
-        const TSharedPtr<FJsonObject> JsonObject, const FString& SourceDirectory, const FString& TargetDirectory)
+    static bool ImportStaticFromConfigFile(const FCharmConfig& Config, const FString& SourceDirectory, const FString& TargetDirectory,
+        const FString& MeshDirectory, const FCharmMeshBuildProfile& Profile)
     {
+        const FCharmImportReport::FImport ImportReport;
+        const FCharmAssetIndex AssetIndex({TargetDirectory, MeshDirectory});
+
         // Import mesh using FBX factory
-        const FString MeshName = JsonObject->GetStringField("MeshName");
-        const FString MeshPath = SourceDirectory / MeshName + ".fbx";
-        const TArray<UObject*> ImportedObjects = ImportFbxAsStaticMesh(MeshPath, TargetDirectory);
-        UStaticMesh* ImportedMesh = Cast<UStaticMesh>(ImportedObjects[0]);
+        const FString MeshPath = SourceDirectory / Config.MeshName + ".fbx";
+        const TArray<UObject*> ImportedObjects = ImportFbxAsStaticMesh(MeshPath, MeshDirectory);
+        UStaticMesh* ImportedMesh = ImportedObjects.Num() > 0 ? Cast<UStaticMesh>(ImportedObjects[0]) : nullptr;
+        if (!ImportedMesh)
+        {
+            LOG_ERROR("Failed to import mesh %s.", *MeshPath);
+            return false;
+        }
 
         // Make materials
-        const TSharedPtr<FJsonObject> Materials = JsonObject->GetObjectField("Materials");
-        const TSharedPtr<FJsonObject> Parts = JsonObject->GetObjectField("Parts");
-        TSet<FString> TextureHashesToImport;
+        TMap<FString, FCharmMaterialSource> UsedMaterials;
         for (auto& StaticMaterial : ImportedMesh->GetStaticMaterials())
         {
             FString MaterialHash = StaticMaterial.MaterialSlotName.ToString();
-            if (MaterialHash == "2029BE80")
+            if (const TSharedPtr<const FCharmMaterial>* MaterialInfo = Config.Materials.Find(MaterialHash))
             {
-                auto a = 0;
+                UsedMaterials.Add(MaterialHash, {*MaterialInfo, SourceDirectory});
             }
-            const TSharedPtr<FJsonObject> MaterialInfo = Materials->GetObjectField(MaterialHash);
-            const TSharedPtr<FJsonObject> PSTexturesInfo = MaterialInfo->GetObjectField("PS")->GetObjectField("Textures");
-            for (auto& Value : PSTexturesInfo->Values)
+            else if (!DoesAssetExist(TargetDirectory / "Materials" / MaterialHash))
             {
-                const TSharedPtr<FJsonObject>* TextureMap;
-                Value.Value->TryGetObject(TextureMap);
-                const FString TextureHash = (*TextureMap)->GetStringField("Hash");
-                TextureHashesToImport.Add(TextureHash);
+                LOG_ERROR("Material %s is not in the config of %s.", *MaterialHash, *Config.MeshName);
             }
         }
 
-        // Make materials - first import every texture (faster to do all in one go than stop-start)
-        ImportTextures(TextureHashesToImport.Array(), SourceDirectory / "Textures", TargetDirectory);
+        ImportMaterialTextures(UsedMaterials, TargetDirectory);
+        AssignMaterials(ImportedMesh, CreateMaterials(UsedMaterials, TargetDirectory));
+        Profile.Apply({ImportedMesh});
+        return true;
+    }
 
-        // Make materials - then create the materials one by one, but only if the material does not already exist
-        for (auto& StaticMaterial : ImportedMesh->GetStaticMaterials())
+    /**
+     * Import a map using a Charm config file.
+     *
+     * Every static the map places is imported once, then the placements are added to the current level by PlaceMapInstances.
+     *
+     * @param Config The decoded info config file, with Instances.
+     * @param TargetDirectory The directory to import the statics' materials and textures into.
+     * @param MeshDirectory The directory to import the static meshes into.
+     * @param Profile How the statics are built.
+     * @return true if the map actor was created.
+     */
+    static bool ImportMapFromConfigFile(
+        const FCharmConfig& Config, const FString& TargetDirectory, const FString& MeshDirectory, const FCharmMeshBuildProfile& Profile)
+    {
+        const FCharmImportReport::FImport ImportReport;
+        // Not FCharmExport::Merge, which would copy every placement of the map
+        const FString SourceDirectory = Config.GetSourceDirectory();
+        FCharmExport Export;
+        for (const auto& Pair : Config.Instances)
         {
-            FString MaterialHash = StaticMaterial.MaterialSlotName.ToString();
-            const TSharedPtr<FJsonObject> MaterialInfo = Materials->GetObjectField(MaterialHash);
-            // const TSharedPtr<FJsonObject> PSTexturesInfo = MaterialInfo->GetObjectField("PS");
-            UMaterial* Material;
-            if (!DoesAssetExist(TargetDirectory / "Materials" / MaterialHash))
+            Export.MeshPaths.Add(SourceDirectory / Pair.Key + ".fbx");
+        }
+        for (const auto& Pair : Config.Materials)
+        {
+            Export.Materials.Add(Pair.Key, {Pair.Value, SourceDirectory});
+        }
+        return PlaceMapInstances(Config, ImportStatics(Export, TargetDirectory, MeshDirectory, Profile));
+    }
+
+    /**
+     * Add the placements of a map to the current level, as one actor holding a hierarchical instanced static mesh component
+     * per static. Materials live on the mesh assets, so grouping by mesh also groups by material.
+     *
+     * @param Config The decoded info config file, with Instances.
+     * @param ImportedMeshes The imported statics, found by name.
+     * @return true if the map actor was created.
+     */
+    static bool PlaceMapInstances(const FCharmConfig& Config, const TArray<UStaticMesh*>& ImportedMeshes)
+    {
+        TMap<FString, UStaticMesh*> Meshes;
+        for (UStaticMesh* Mesh : ImportedMeshes)
+        {
+            Meshes.Add(Mesh->GetName(), Mesh);
+        }
+
+        CHARM_IMPORT_STAGE(ActorSpawning);
+        UEditorActorSubsystem* EditorActorSubsystem = GEditor->GetEditorSubsystem<UEditorActorSubsystem>();
+        AActor* MapActor =
+            EditorActorSubsystem ? EditorActorSubsystem->SpawnActorFromClass(AActor::StaticClass(), FVector::Zero()) : nullptr;
+        if (!MapActor)
+        {
+            LOG_ERROR("Failed to spawn the actor for map %s.", *Config.MeshName);
+            return false;
+        }
+        MapActor->SetActorLabel(Config.MeshName.IsEmpty() ? FPaths::GetBaseFilename(Config.FilePath) : Config.MeshName);
+        USceneComponent* Root = NewObject<USceneComponent>(MapActor, TEXT("Root"));
+        Root->SetMobility(EComponentMobility::Static);
+        MapActor->SetRootComponent(Root);
+        MapActor->AddInstanceComponent(Root);
+        Root->RegisterComponent();
+
+        int32 NumInstances = 0;
+        TArray<FTransform> Transforms;
+        for (const auto& Pair : Config.Instances)
+        {
+            UStaticMesh* const* Mesh = Meshes.Find(Pair.Key);
+            if (!Mesh)
             {
-                Material = CreateMaterialFromConfigFile(MaterialHash, MaterialInfo, SourceDirectory, TargetDirectory);
+                LOG_ERROR("Static %s of map %s was not imported, skipping %d instances.", *Pair.Key, *Config.MeshName, Pair.Value.Num());
+                continue;
             }
-            else
+            Transforms.Reset(Pair.Value.Num());
+            for (const FCharmInstance& Instance : Pair.Value)
             {
-                Material = LoadAsset<UMaterial>(TargetDirectory / "Materials" / MaterialHash);
+                Transforms.Add(GetInstanceTransform(Instance));
             }
 
-            // Assign material to mesh
-            ImportedMesh->SetMaterial(ImportedMesh->GetMaterialIndex(StaticMaterial.MaterialSlotName), Material);
+            UHierarchicalInstancedStaticMeshComponent* Component =
+                NewObject<UHierarchicalInstancedStaticMeshComponent>(MapActor, FName(Pair.Key));
+            Component->SetMobility(EComponentMobility::Static);
+            Component->SetStaticMesh(*Mesh);
+            Component->SetupAttachment(Root);
+            // All at once so the cluster tree is built a single time
+            Component->AddInstances(Transforms, false);
+            MapActor->AddInstanceComponent(Component);
+            Component->RegisterComponent();
+            NumInstances += Transforms.Num();
         }
 
+        LOG("Placed %d instances of %d statics for map %s.", NumInstances, Config.Instances.Num(), *Config.MeshName);
         return true;
     }
 
-    static UMaterial* CreateMaterialFromConfigFile(
-        const FString& MaterialName, TSharedPtr<FJsonObject> MaterialInfo, const FString& SourceDirectory, const FString& TargetDirectory)
+    /**
+     * Transform of a map placement in unreal space. Charm writes right handed meters, the FBX importer mirrors Y and converts
+     * to centimeters for the meshes, so placements get the same treatment.
+     */
+    static FTransform GetInstanceTransform(const FCharmInstance& Instance)
+    {
+        constexpr float MetersToCentimeters = 100.0f;
+        const FVector3f Translation = Instance.Translation * MetersToCentimeters;
+        const FQuat4f Rotation(-Instance.Rotation.X, Instance.Rotation.Y, -Instance.Rotation.Z, Instance.Rotation.W);
+        return FTransform(FQuat(Rotation), FVector(Translation.X, -Translation.Y, Translation.Z), FVector(Instance.Scale));
+    }
+
+    /**
+     * Import the pixel shader textures of the given materials (faster to do all in one go than stop-start).
+     * Textures are grouped by export directory, which is a single import for a single export. Import workers pass their
+     * Shard and NumShards to import only the textures they own.
+     */
+    static void ImportMaterialTextures(
+        const TMap<FString, FCharmMaterialSource>& Materials, const FString& TargetDirectory, int32 Shard = 0, int32 NumShards = 1)
+    {
+        // Each texture's color space comes from the materials binding it, the first binding wins if they disagree
+        TMap<FString, TMap<FString, bool>> TexturesBySource;
+        TMap<FString, bool> TextureSrgb;
+        for (const auto& Pair : Materials)
+        {
+            TMap<FString, bool>& Textures = TexturesBySource.FindOrAdd(Pair.Value.SourceDirectory);
+            for (const FCharmTextureBinding& Texture : Pair.Value.Material->PS.Textures)
+            {
+                if (const bool* bSrgb = TextureSrgb.Find(Texture.Hash))
+                {
+                    if (*bSrgb != Texture.bSrgb)
+                    {
+                        LOG_WARNING("Texture %s is bound as both sRGB and linear, material %s gets it as %s.", *Texture.Hash,
+                            *Pair.Key, *bSrgb ? TEXT("sRGB") : TEXT("linear"));
+                    }
+                    continue;
+                }
+                TextureSrgb.Add(Texture.Hash, Texture.bSrgb);
+                // Import workers each take the textures whose hash falls in their shard
+                if (GetTypeHash(Texture.Hash) % (uint32) NumShards == (uint32) Shard)
+                {
+                    Textures.Add(Texture.Hash, Texture.bSrgb);
+                }
+            }
+        }
+        for (const auto& Pair : TexturesBySource)
+        {
+            if (Pair.Value.Num() > 0)
+            {
+                ImportTextures(Pair.Value, Pair.Key / "Textures", TargetDirectory);
+            }
+        }
+    }
+
+    /**
+     * Create every material that does not exist yet, converting all of their shaders in parallel up front, and load the rest.
+     *
+     * @param Materials Materials by hash.
+     * @param TargetDirectory The directory the Materials folder is in.
+     * @return Every material that was created or loaded, by hash; new materials whose shader failed to convert are left out.
+     */
+    static TMap<FString, UMaterialInterface*> CreateMaterials(
+        const TMap<FString, FCharmMaterialSource>& Materials, const FString& TargetDirectory)
+    {
+        CHARM_IMPORT_STAGE(MaterialCreation);
+        TArray<UsfConversionRequest> Requests;
+        for (const auto& Pair : Materials)
+        {
+            if (!DoesAssetExist(TargetDirectory / "Materials" / Pair.Key))
+            {
+                Requests.Add({Pair.Key, Pair.Value.Material, Pair.Value.SourceDirectory / "Shaders" / "PS_" + Pair.Key + ".hlsl",
+                    EShaderType::PixelShader, CVarCharmShareParentMaterials.GetValueOnGameThread()});
+            }
+        }
+        // ConvertBatch logs why each failed shader failed; those materials are neither created nor returned
+        TMap<FString, TSharedPtr<UsfShader>> ConvertedShaders;
+        TSet<FString> FailedMaterials;
+        for (UsfConversionResult& Result : CT_UsfConverter::ConvertBatch(Requests))
+        {
+            if (Result.bSuccess)
+            {
+                ConvertedShaders.Add(Result.Name, Result.Shader);
+            }
+        }
+        for (const UsfConversionRequest& Request : Requests)
+        {
+            if (!ConvertedShaders.Contains(Request.Name))
+            {
+                FailedMaterials.Add(Request.Name);
+            }
+        }
+        if (FailedMaterials.Num() > 0)
+        {
+            LOG_ERROR("Skipping %d of %d new materials whose shaders failed to convert", FailedMaterials.Num(), Requests.Num());
+        }
+
+        // Everything the loop below loads: existing materials, and the textures and shared parents of the new ones
+        TArray<FString> AssetsToLoad;
+        for (const auto& Pair : Materials)
+        {
+            if (FailedMaterials.Contains(Pair.Key))
+            {
+                continue;
+            }
+            const TSharedPtr<UsfShader>* Shader = ConvertedShaders.Find(Pair.Key);
+            if (!Shader)
+            {
+                AssetsToLoad.Add(TargetDirectory / "Materials" / Pair.Key);
+                continue;
+            }
+            for (const FCharmTextureBinding& Texture : Pair.Value.Material->PS.Textures)
+            {
+                AssetsToLoad.Add(TargetDirectory / "Textures" / Texture.Hash);
+            }
+            if ((*Shader)->bParametric)
+            {
+                AssetsToLoad.Add(TargetDirectory / "Materials" / "Parents" / GetParentMaterialName(**Shader, Pair.Value.Material->PS));
+            }
+        }
+        PreloadAssets(AssetsToLoad);
+
+        // Then build the graphs one by one, but only if the material does not already exist, and compile them all together
+        TMap<FString, UMaterialInterface*> Created;
+        TArray<UMaterial*> MaterialsToCompile;
+        for (const auto& Pair : Materials)
+        {
+            if (FailedMaterials.Contains(Pair.Key))
+            {
+                continue;
+            }
+            UMaterialInterface* Material;
+            if (const TSharedPtr<UsfShader>* Shader = ConvertedShaders.Find(Pair.Key))
+            {
+                Material = CreateMaterialFromConfigFile(
+                    Pair.Key, *Pair.Value.Material, Pair.Value.SourceDirectory, TargetDirectory, *Shader, &MaterialsToCompile);
+            }
+            else
+            {
+                Material = LoadAsset<UMaterialInterface>(TargetDirectory / "Materials" / Pair.Key);
+            }
+            if (Material)
+            {
+                Created.Add(Pair.Key, Material);
+            }
+        }
+        CompileMaterials(MaterialsToCompile);
+        return Created;
+    }
+
+    /**
+     * Compile many materials at once. Every material is queued inside a single update context, so the render thread is synced
+     * once and the shader compiling manager gets all the jobs together to spread over its workers; then wait for them once.
+     *
+     * @param Materials The materials whose graphs were built or changed without being compiled.
+     */
+    static void CompileMaterials(const TArray<UMaterial*>& Materials)
+    {
+        CHARM_IMPORT_STAGE(MaterialCompilation);
+        if (Materials.Num() == 0)
+        {
+            return;
+        }
+        FScopedSlowTask SlowTask(2, FText::Format(NSLOCTEXT("CharmTunnel", "CompilingMaterials", "Compiling {0} materials"),
+                                        FText::AsNumber(Materials.Num())));
+        SlowTask.MakeDialog();
+
+        SlowTask.EnterProgressFrame(1);
+        {
+            FMaterialUpdateContext UpdateContext;
+            for (UMaterial* Material : Materials)
+            {
+                UpdateContext.AddMaterial(Material);
+                Material->PreEditChange(nullptr);
+                Material->PostEditChange();
+                Material->MarkPackageDirty();
+            }
+        }
+
+        SlowTask.EnterProgressFrame(1);
+        if (GShaderCompilingManager)
+        {
+            const int32 TotalJobs = GShaderCompilingManager->GetNumRemainingJobs();
+            FScopedSlowTask WaitTask(TotalJobs, NSLOCTEXT("CharmTunnel", "WaitingForShaders", "Waiting for shader compilation"));
+            int32 NumReported = 0;
+            while (GShaderCompilingManager->GetNumRemainingJobs() > 0)
+            {
+                GShaderCompilingManager->ProcessAsyncResults(true, false);
+                const int32 RemainingJobs = GShaderCompilingManager->GetNumRemainingJobs();
+                const int32 NumDone = FMath::Clamp(TotalJobs - RemainingJobs, NumReported, TotalJobs);
+                WaitTask.EnterProgressFrame(NumDone - NumReported,
+                    FText::Format(NSLOCTEXT("CharmTunnel", "ShaderJobsLeft", "{0} shader jobs left"), FText::AsNumber(RemainingJobs)));
+                NumReported = NumDone;
+                FPlatformProcess::Sleep(0.1f);
+            }
+            GShaderCompilingManager->FinishAllCompilation();
+        }
+        LOG("Compiled %d materials.", Materials.Num());
+    }
+
+    /** Assign materials to the mesh slots named after them. Slots without a material are left alone. */
+    static void AssignMaterials(UStaticMesh* Mesh, const TMap<FString, UMaterialInterface*>& Materials)
+    {
+        for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+        {
+            if (UMaterialInterface* const* Material = Materials.Find(StaticMaterial.MaterialSlotName.ToString()))
+            {
+                Mesh->SetMaterial(Mesh->GetMaterialIndex(StaticMaterial.MaterialSlotName), *Material);
+            }
+        }
+    }
+
+    /**
+     * Create a material from its entry in a Charm config file.
+     *
+     * When the shader was converted as parametric, the material becomes an instance of a parent material shared by every
+     * material with the same shader body, texture color spaces and blend mode; the parent is created on first use.
+     *
+     * @param MaterialName The material hash, used as the asset name.
+     * @param MaterialInfo The material decoded from the config file.
+     * @param SourceDirectory The export directory containing the Shaders folder.
+     * @param TargetDirectory The directory to create the material in.
+     * @param ConvertedShader Pixel shader already converted by CT_UsfConverter::ConvertBatch, converted here if null.
+     * @param OutMaterialsToCompile If set, the new material is added here for CompileMaterials instead of compiled right away.
+     * @return the created material or material instance.
+     */
+    static UMaterialInterface* CreateMaterialFromConfigFile(const FString& MaterialName, const FCharmMaterial& MaterialInfo,
+        const FString& SourceDirectory, const FString& TargetDirectory, TSharedPtr<UsfShader> ConvertedShader = nullptr,
+        TArray<UMaterial*>* OutMaterialsToCompile = nullptr)
+    {
+        const FCharmShaderStage& PSInfo = MaterialInfo.PS;
+        if (!ConvertedShader.IsValid())
+        {
+            bool bOutSuccess;
+            ConvertedShader = CT_UsfConverter::ConvertFromHlsl(PSInfo, SourceDirectory / "Shaders" / "PS_" + MaterialName + ".hlsl",
+                EShaderType::PixelShader, bOutSuccess, CVarCharmShareParentMaterials.GetValueOnGameThread());
+        }
+        const TSharedRef<UsfShader> Shader = ConvertedShader.ToSharedRef();
+        if (!Shader->bParametric)
+        {
+            return CreateMaterial(MaterialName, TargetDirectory / "Materials", Shader, PSInfo, TargetDirectory, OutMaterialsToCompile);
+        }
+
+        UMaterial* Parent = FindOrCreateParentMaterial(Shader, PSInfo, TargetDirectory, OutMaterialsToCompile);
+        if (!Parent)
+        {
+            LOG_ERROR("Failed to create parent material for %s.", *MaterialName);
+            return nullptr;
+        }
+        return CreateMaterialInstance(MaterialName, TargetDirectory / "Materials", Parent, Shader, PSInfo, TargetDirectory);
+    }
+
+    /** The shared parent of a parametric shader, created on first use. */
+    static UMaterial* FindOrCreateParentMaterial(const TSharedRef<UsfShader>& Shader, const FCharmShaderStage& PSInfo,
+        const FString& TargetDirectory, TArray<UMaterial*>* OutMaterialsToCompile = nullptr)
+    {
+        const FString ParentName = GetParentMaterialName(*Shader, PSInfo);
+        const FString ParentDirectory = TargetDirectory / "Materials" / "Parents";
+        if (DoesAssetExist(ParentDirectory / ParentName))
+        {
+            return LoadAsset<UMaterial>(ParentDirectory / ParentName);
+        }
+        return CreateMaterial(ParentName, ParentDirectory, Shader, PSInfo, TargetDirectory, OutMaterialsToCompile);
+    }
+
+    /**
+     * Bring an existing material in line with a freshly converted pixel shader.
+     *
+     * Parents are shared and named after what they compile to, so they are never edited: an instance is moved to the parent
+     * of the new shader, created if no material uses it yet, and its parameters are set again from the config. A material
+     * of its own has its graph rebuilt in place, including the texture and constant buffer inputs. When the conversion mode
+     * changed since the material was created (an instance for a non-parametric shader or the other way around) it is
+     * recreated, and the meshes using it get the new asset.
+     *
+     * @param MaterialName The material hash, the asset name under TargetDirectory/Materials.
+     * @param Source The material's config entry and export directory.
+     * @param TargetDirectory The directory the Materials folder is in.
+     * @param Shader The converted pixel shader.
+     * @param OutMaterialsToCompile Materials whose graph changed, for CompileMaterials.
+     * @return the updated material, null if it does not exist or could not be updated.
+     */
+    static UMaterialInterface* ReloadMaterialUsf(const FString& MaterialName, const FCharmMaterialSource& Source,
+        const FString& TargetDirectory, const TSharedRef<UsfShader>& Shader, TArray<UMaterial*>& OutMaterialsToCompile)
+    {
+        CHARM_IMPORT_STAGE(MaterialCreation);
+        const FString MaterialPath = TargetDirectory / "Materials" / MaterialName;
+        UMaterialInterface* Existing = DoesAssetExist(MaterialPath) ? LoadAsset<UMaterialInterface>(MaterialPath) : nullptr;
+        if (!Existing)
+        {
+            return nullptr;
+        }
+        const FCharmShaderStage& PSInfo = Source.Material->PS;
+
+        UMaterialInstanceConstant* Instance = Cast<UMaterialInstanceConstant>(Existing);
+        if (Instance && Shader->bParametric)
+        {
+            UMaterial* Parent = FindOrCreateParentMaterial(Shader, PSInfo, TargetDirectory, &OutMaterialsToCompile);
+            if (!Parent)
+            {
+                LOG_ERROR("Failed to create parent material for %s.", *MaterialName);
+                return nullptr;
+            }
+            Instance->Modify();
+            Instance->SetParentEditorOnly(Parent);
+            Instance->ClearParameterValuesEditorOnly();
+            SetInstanceParameters(Instance, Shader, PSInfo, TargetDirectory);
+            UMaterialEditingLibrary::UpdateMaterialInstance(Instance);
+            Instance->MarkPackageDirty();
+            return Instance;
+        }
+
+        UMaterial* Material = Cast<UMaterial>(Existing);
+        if (Material && !Shader->bParametric)
+        {
+            Material->Modify();
+            UMaterialEditingLibrary::DeleteAllMaterialExpressions(Material);
+            BuildMaterialGraph(Material, MaterialName, Shader, PSInfo, TargetDirectory);
+            Material->MarkPackageDirty();
+            OutMaterialsToCompile.Add(Material);
+            return Material;
+        }
+
+        // Deleting clears the slots of the meshes using the material, they are filled again with the new one below
+        TArray<UStaticMesh*> Meshes;
+        IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+        TArray<FName> Referencers;
+        AssetRegistry.GetReferencers(FName(*MaterialPath), Referencers);
+        for (const FName& Referencer : Referencers)
+        {
+            TArray<FAssetData> Assets;
+            AssetRegistry.GetAssetsByPackageName(Referencer, Assets);
+            for (const FAssetData& Asset : Assets)
+            {
+                if (UStaticMesh* Mesh = Asset.IsInstanceOf(UStaticMesh::StaticClass()) ? Cast<UStaticMesh>(Asset.GetAsset()) : nullptr)
+                {
+                    Meshes.Add(Mesh);
+                }
+            }
+        }
+        if (!DeleteAsset(MaterialPath))
+        {
+            LOG_ERROR("Failed to delete material %s to recreate it.", *MaterialPath);
+            return nullptr;
+        }
+        UMaterialInterface* Created = CreateMaterialFromConfigFile(
+            MaterialName, *Source.Material, Source.SourceDirectory, TargetDirectory, Shader, &OutMaterialsToCompile);
+        if (Created)
+        {
+            for (UStaticMesh* Mesh : Meshes)
+            {
+                Mesh->Modify();
+                AssignMaterials(Mesh, {{MaterialName, Created}});
+                Mesh->MarkPackageDirty();
+            }
+        }
+        return Created;
+    }
+
+    /**
+     * Delete the parent materials under TargetDirectory that no material instance uses anymore, left behind when the
+     * instances using them were rebuilt or moved to another parent. Loaded instances may not be saved yet, so they are
+     * checked in memory and the asset registry is only trusted for packages that are not loaded.
+     *
+     * @param TargetDirectory The directory the Materials folder is in.
+     * @return the number of parents deleted.
+     */
+    static int32 DeleteUnusedParentMaterials(const FString& TargetDirectory)
+    {
+        IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+        TArray<FAssetData> Parents;
+        AssetRegistry.GetAssetsByPath(FName(TargetDirectory / "Materials" / "Parents"), Parents);
+        if (Parents.Num() == 0)
+        {
+            return 0;
+        }
+
+        TSet<FName> UsedParents;
+        for (TObjectIterator<UMaterialInstance> It; It; ++It)
+        {
+            if (IsValid(*It) && It->Parent)
+            {
+                UsedParents.Add(It->Parent->GetPackage()->GetFName());
+            }
+        }
+        int32 NumDeleted = 0;
+        TArray<FName> Referencers;
+        for (const FAssetData& Parent : Parents)
+        {
+            if (UsedParents.Contains(Parent.PackageName))
+            {
+                continue;
+            }
+            Referencers.Reset();
+            AssetRegistry.GetReferencers(Parent.PackageName, Referencers);
+            const bool bReferenced = Referencers.ContainsByPredicate(
+                [](FName Referencer)
+                {
+                    // A loaded instance that is not in UsedParents has moved to another parent since it was saved
+                    const UPackage* Package = FindPackage(nullptr, *Referencer.ToString());
+                    return !Package || !FindObject<UMaterialInstance>(Package, *FPackageName::GetShortName(Referencer));
+                });
+            if (!bReferenced && DeleteAsset(Parent.PackageName.ToString()))
+            {
+                NumDeleted++;
+            }
+        }
+        if (NumDeleted > 0)
+        {
+            LOG_VERBOSE("Deleted %d parent materials no material uses.", NumDeleted);
+        }
+        return NumDeleted;
+    }
+
+    /**
+     * Name of the parent material shared by every material whose parametric shader has the same code, texture slots and
+     * texture color spaces. Only these decide what the parent compiles to, constant buffer values and texture assets are
+     * instance parameters.
+     *
+     * @param Shader Parametric pixel shader.
+     * @param PSInfo The material's pixel shader stage.
+     * @return the asset name, M_ followed by a hash.
+     */
+    static FString GetParentMaterialName(const UsfShader& Shader, const FCharmShaderStage& PSInfo)
+    {
+        TArray<FString> Slots;
+        for (const FCharmTextureBinding& Texture : PSInfo.Textures)
+        {
+            Slots.Add(Texture.Slot + (Texture.bSrgb ? TEXT(":srgb") : TEXT(":linear")));
+        }
+        Slots.Sort();
+
+        FSHA1 Sha;
+        Sha.UpdateWithString(*Shader.UsfContents, Shader.UsfContents.Len());
+        for (const FString& Slot : Slots)
+        {
+            Sha.UpdateWithString(*Slot, Slot.Len());
+        }
+        Sha.Final();
+        FSHAHash Hash;
+        Sha.GetHash(Hash.Hash);
+        return TEXT("M_") + Hash.ToString().Left(16);
+    }
+
+    /**
+     * Build a material with a custom node running the converted pixel shader. A parametric shader gets texture and vector
+     * parameters so instances can override them, their defaults are the values of the material being imported.
+     * The material is compiled right away unless OutMaterialsToCompile is set, then it is added there instead.
+     */
+    static UMaterial* CreateMaterial(const FString& MaterialName, const FString& PackagePath, const TSharedRef<UsfShader>& Shader,
+        const FCharmShaderStage& PSInfo, const FString& TargetDirectory, TArray<UMaterial*>* OutMaterialsToCompile = nullptr)
     {
         // Make material object
         const FAssetToolsModule& AssetToolsModule = FModuleManager::LoadModuleChecked<FAssetToolsModule>("AssetTools");
         UMaterialFactoryNew* MaterialFactory = UMaterialFactoryNew::StaticClass()->GetDefaultObject<UMaterialFactoryNew>();
-        UObject* MaterialObject =
-            AssetToolsModule.Get().CreateAsset(MaterialName, TargetDirectory / "Materials", UMaterial::StaticClass(), MaterialFactory);
+        UObject* MaterialObject = AssetToolsModule.Get().CreateAsset(MaterialName, PackagePath, UMaterial::StaticClass(), MaterialFactory);
         UMaterial* Material = Cast<UMaterial>(MaterialObject);
+        if (!Material)
+        {
+            return nullptr;
+        }
 
+        BuildMaterialGraph(Material, MaterialName, Shader, PSInfo, TargetDirectory);
+        if (OutMaterialsToCompile)
+        {
+            OutMaterialsToCompile->Add(Material);
+        }
+        else
+        {
+            UMaterialEditingLibrary::RecompileMaterial(Material);
+        }
+
+        return Material;
+    }
+
+    /** Fill an empty material with the custom node running the shader, its inputs and the output connections. */
+    static void BuildMaterialGraph(UMaterial* Material, const FString& MaterialName, const TSharedRef<UsfShader>& Shader,
+        const FCharmShaderStage& PSInfo, const FString& TargetDirectory)
+    {
         // Configure material
 
         // Add custom nodes
@@ -306,10 +1289,6 @@ public:
         // CustomVSNode->OutputType = ECustomMaterialOutputType::CMOT_MaterialAttributes;
         UMaterialExpressionCustom* CustomPSNode = Cast<UMaterialExpressionCustom>(
             UMaterialEditingLibrary::CreateMaterialExpression(Material, UMaterialExpressionCustom::StaticClass(), -500, 0));
-        // FString UsfContents;
-        bool bOutSuccess;
-        TSharedRef<UsfShader> Shader = CT_UsfConverter::ConvertFromHlsl(MaterialInfo->GetObjectField("PS"),
-            SourceDirectory / "Shaders" / "PS_" + MaterialName + ".hlsl", EShaderType::PixelShader, bOutSuccess);
 
         // FString PsUsfFilePath = SourceDirectory / "Shaders" / "PS_" + MaterialName + ".usf";
         // if (!FFileHelper::LoadFileToString(UsfContents, *PsUsfFilePath))
@@ -317,26 +1296,22 @@ public:
         // LOG_ERROR("Failed to load usf file %s.", *PsUsfFilePath);
         // }
         CustomPSNode->Code = Shader->UsfContents;
-        if (Shader->UsfContents.Contains("// masked"))
-        {
-            Material->BlendMode = BLEND_Masked;
-            Material->TwoSided = true;
-        }
+        // Set either way, the graph may be rebuilt for a shader that stopped being masked
+        const bool bMasked = Shader->UsfContents.Contains("// masked");
+        Material->BlendMode = bMasked ? BLEND_Masked : BLEND_Opaque;
+        Material->TwoSided = bMasked;
         CustomPSNode->OutputType = CMOT_MaterialAttributes;
         CustomPSNode->Inputs.Empty();
-        const TSharedPtr<FJsonObject> PSTexturesInfo = MaterialInfo->GetObjectField("PS")->GetObjectField("Textures");
         int i = 0;
-        for (auto& TextureInfo : PSTexturesInfo->Values)
+        for (const FCharmTextureBinding& TextureInfo : PSInfo.Textures)
         {
             // In here also add texture samples and connect to custom nodes
-            UMaterialExpressionTextureSample* TextureNode =
-                Cast<UMaterialExpressionTextureSample>(UMaterialEditingLibrary::CreateMaterialExpression(
-                    Material, UMaterialExpressionTextureSample::StaticClass(), -1000, -500 + 250 * i++));
-            const TSharedPtr<FJsonObject>* TextureMap;
-            // todo we really should pull all this out into separate classes, DestinyMaterial etc
-            TextureInfo.Value->TryGetObject(TextureMap);
-            const FString TextureHash = (*TextureMap)->GetStringField("Hash");
-            const bool bTextureIsSrgb = (*TextureMap)->GetBoolField("SRGB");
+            UClass* TextureNodeClass = Shader->bParametric ? UMaterialExpressionTextureSampleParameter2D::StaticClass()
+                                                           : UMaterialExpressionTextureSample::StaticClass();
+            UMaterialExpressionTextureSample* TextureNode = Cast<UMaterialExpressionTextureSample>(
+                UMaterialEditingLibrary::CreateMaterialExpression(Material, TextureNodeClass, -1000, -500 + 250 * i++));
+            const FString& TextureHash = TextureInfo.Hash;
+            const bool bTextureIsSrgb = TextureInfo.bSrgb;
             UTexture* Texture = LoadAsset<UTexture>(TargetDirectory / "Textures" / TextureHash);
             if (!Texture)
             {
@@ -344,22 +1319,50 @@ public:
                 continue;
             }
             TextureNode->Texture = Texture;
-            Texture->PreEditChange(nullptr);
-            Texture->SRGB = bTextureIsSrgb;
-            // Texture->CompressionNone = true;
-            Texture->CompressionSettings = bTextureIsSrgb ? TC_Default : TC_VectorDisplacementmap;
-            TextureNode->SamplerType = bTextureIsSrgb ? SAMPLERTYPE_Color : SAMPLERTYPE_LinearColor;
-            // Texture->MipGenSettings = TMGS_NoMipmaps;
-            // Texture->Filter = TF_Nearest;
-            // Texture->AssetImportData->Update(TargetTextureName.ToString());
-            Texture->PostEditChange();
+            if (Shader->bParametric)
+            {
+                CastChecked<UMaterialExpressionTextureSampleParameter2D>(TextureNode)->ParameterName = FName("t" + TextureInfo.Slot);
+            }
+            // Color space and compression were set when the texture was imported, changing them here would recompress it
+            if (Texture->SRGB != bTextureIsSrgb)
+            {
+                LOG_WARNING("Material %s samples texture %s as %s but it was imported as %s.", *MaterialName, *TextureHash,
+                    bTextureIsSrgb ? TEXT("sRGB") : TEXT("linear"), Texture->SRGB ? TEXT("sRGB") : TEXT("linear"));
+            }
+            TextureNode->SamplerType = Texture->SRGB ? SAMPLERTYPE_Color : SAMPLERTYPE_LinearColor;
             FCustomInput Input;
-            Input.InputName = FName("t" + TextureInfo.Key);
+            Input.InputName = FName("t" + TextureInfo.Slot);
             FExpressionInput ExpressionInput;
             ExpressionInput.Expression = TextureNode;
             Input.Input = ExpressionInput;
             CustomPSNode->Inputs.Add(Input);
         }
+
+        if (Shader->bParametric)
+        {
+            // One vector parameter per constant buffer element the shader reads
+            int j = 0;
+            for (const UsfConstantBuffer& ConstantBuffer : Shader->ConstantBuffers)
+            {
+                for (const int32 Element : ConstantBuffer.GetEmittedElements())
+                {
+                    UMaterialExpressionVectorParameter* VectorNode =
+                        Cast<UMaterialExpressionVectorParameter>(UMaterialEditingLibrary::CreateMaterialExpression(
+                            Material, UMaterialExpressionVectorParameter::StaticClass(), -1300, -500 + 150 * j++));
+                    const FString ParameterName = ConstantBuffer.GetParameterName(Element);
+                    VectorNode->ParameterName = FName(ParameterName);
+                    GetConstantBufferValue(PSInfo, ConstantBuffer.Count, Element, VectorNode->DefaultValue);
+                    FCustomInput Input;
+                    Input.InputName = FName(ParameterName);
+                    FExpressionInput ExpressionInput;
+                    ExpressionInput.Expression = VectorNode;
+                    ExpressionInput.OutputIndex = GetRGBAOutputIndex(VectorNode);
+                    Input.Input = ExpressionInput;
+                    CustomPSNode->Inputs.Add(Input);
+                }
+            }
+        }
+
         UMaterialExpressionTextureCoordinate* TextureCoordinateNode = Cast<UMaterialExpressionTextureCoordinate>(
             UMaterialEditingLibrary::CreateMaterialExpression(Material, UMaterialExpressionTextureCoordinate::StaticClass(), -500, 300));
 
@@ -382,63 +1385,258 @@ public:
         UMaterialEditingLibrary::ConnectMaterialProperty(MatAttrNode, "OpacityMask", MP_OpacityMask);
         UMaterialEditingLibrary::ConnectMaterialProperty(MatAttrNode, "Normal", MP_Normal);
         UMaterialEditingLibrary::ConnectMaterialProperty(MatAttrNode, "AmbientOcclusion", MP_AmbientOcclusion);
+    }
 
-        UMaterialEditingLibrary::RecompileMaterial(Material);
+    /**
+     * Create a material instance of a shared parent, overriding the textures and constant buffer values of the material.
+     * Instances without static switches reuse the parent's shader map, so nothing is compiled here.
+     */
+    static UMaterialInstanceConstant* CreateMaterialInstance(const FString& MaterialName, const FString& PackagePath, UMaterial* Parent,
+        const TSharedRef<UsfShader>& Shader, const FCharmShaderStage& PSInfo, const FString& TargetDirectory)
+    {
+        const FAssetToolsModule& AssetToolsModule = FModuleManager::LoadModuleChecked<FAssetToolsModule>("AssetTools");
+        UMaterialInstanceConstantFactoryNew* InstanceFactory = NewObject<UMaterialInstanceConstantFactoryNew>();
+        InstanceFactory->InitialParent = Parent;
+        UMaterialInstanceConstant* Instance = Cast<UMaterialInstanceConstant>(
+            AssetToolsModule.Get().CreateAsset(MaterialName, PackagePath, UMaterialInstanceConstant::StaticClass(), InstanceFactory));
+        if (!Instance)
+        {
+            return nullptr;
+        }
 
-        return Material;
+        SetInstanceParameters(Instance, Shader, PSInfo, TargetDirectory);
+        UMaterialEditingLibrary::UpdateMaterialInstance(Instance);
+        return Instance;
     }
 
-    static TArray<UTexture*> ImportTextures(
-        const TArray<FString>& TexturePaths, const FString& SourceDirectory, const FString& TargetDirectory)
+    /** Override the parent's texture and constant buffer parameters with the material's own values. */
+    static void SetInstanceParameters(UMaterialInstanceConstant* Instance, const TSharedRef<UsfShader>& Shader,
+        const FCharmShaderStage& PSInfo, const FString& TargetDirectory)
     {
-        UTextureFactory* TextureFactory = UTextureFactory::StaticClass()->GetDefaultObject<UTextureFactory>();
-        TextureFactory->SuppressImportOverwriteDialog();
+        for (const FCharmTextureBinding& TextureInfo : PSInfo.Textures)
+        {
+            UTexture* Texture = LoadAsset<UTexture>(TargetDirectory / "Textures" / TextureInfo.Hash);
+            if (!Texture)
+            {
+                LOG_ERROR("Failed to load texture %s.", *TextureInfo.Hash);
+                continue;
+            }
+            UMaterialEditingLibrary::SetMaterialInstanceTextureParameterValue(Instance, FName("t" + TextureInfo.Slot), Texture);
+        }
 
-        UAutomatedAssetImportData* ImportData =
-            NewObject<UAutomatedAssetImportData>(TextureFactory, UAutomatedAssetImportData::StaticClass());
-        ImportData->Factory = TextureFactory;
-        ImportData->bReplaceExisting =
-            true;    // required when using batch import, if one exists it stops the entire import for some reason
-        ImportData->DestinationPath = TargetDirectory / "Textures";
-        for (auto& TexturePath : TexturePaths)
+        for (const UsfConstantBuffer& ConstantBuffer : Shader->ConstantBuffers)
         {
-            ImportData->Filenames.Add(SourceDirectory / TexturePath + ".dds");
+            for (const int32 Element : ConstantBuffer.GetEmittedElements())
+            {
+                FLinearColor Value;
+                GetConstantBufferValue(PSInfo, ConstantBuffer.Count, Element, Value);
+                UMaterialEditingLibrary::SetMaterialInstanceVectorParameterValue(
+                    Instance, FName(ConstantBuffer.GetParameterName(Element)), Value);
+            }
         }
-        TextureFactory->SetAutomatedAssetImportData(ImportData);
-        const FAssetToolsModule& AssetToolsModule = FModuleManager::LoadModuleChecked<FAssetToolsModule>("AssetTools");
-        TArray<UObject*> ImportedObjects = AssetToolsModule.Get().ImportAssetsAutomated(ImportData);
+    }
+
+    /** Value of a constant buffer element from the material info, the same filler as the converter when it is missing. */
+    static bool GetConstantBufferValue(const FCharmShaderStage& PSInfo, int32 Count, int32 Element, FLinearColor& OutValue)
+    {
+        OutValue = FLinearColor(1, 1, 1, 1);
+        TArrayView<const FVector4f> Data;
+        if (!PSInfo.FindConstantBuffer(Count, Data) || !Data.IsValidIndex(Element))
+        {
+            return false;
+        }
+        OutValue = FLinearColor(Data[Element].X, Data[Element].Y, Data[Element].Z, Data[Element].W);
+        return true;
+    }
 
-        TArray<UTexture*> ImportedTextures;
-        // todo dont correct textures here, correct them in the material code
-        for (const auto& ImportedObject : ImportedObjects)
+    /** The output of a vector parameter that carries all four channels, custom node inputs otherwise get RGB only. */
+    static int32 GetRGBAOutputIndex(UMaterialExpression* Expression)
+    {
+        const TArray<FExpressionOutput>& Outputs = Expression->GetOutputs();
+        for (int32 i = 0; i < Outputs.Num(); i++)
         {
-            if (UTexture* Texture = Cast<UTexture>(ImportedObject))
+            if (Outputs[i].MaskR && Outputs[i].MaskG && Outputs[i].MaskB && Outputs[i].MaskA)
             {
-                // todo correct these settings
-                ImportedTextures.Add(Texture);
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Import DDS textures with their final color space and compression, skipping any whose asset was already imported from an
+     * identical file. sRGB and linear textures are imported as two batches with compression deferred, the settings are applied
+     * on the new textures and the save compresses each of them once. Under an import memory budget the batches are split into
+     * smaller ones that are saved, and possibly unloaded, one at a time.
+     *
+     * @param Textures Texture hashes, the file names without extension, and whether each one is sRGB.
+     * @param SourceDirectory The directory containing the DDS files.
+     * @param TargetDirectory The directory the Textures folder is in.
+     * @return the number of textures that were (re)imported.
+     */
+    static int32 ImportTextures(
+        const TMap<FString, bool>& Textures, const FString& SourceDirectory, const FString& TargetDirectory)
+    {
+        CHARM_IMPORT_STAGE(TextureImport);
+        TArray<FString> Filenames[2];
+        int32 NumUpToDate = 0;
+        for (const auto& Pair : Textures)
+        {
+            const FString Filename = SourceDirectory / Pair.Key + ".dds";
+            if (IsImportUpToDate(TargetDirectory / "Textures" / Pair.Key, Filename))
+            {
+                NumUpToDate++;
+                continue;
+            }
+            Filenames[Pair.Value ? 1 : 0].Add(Filename);
+        }
+        if (NumUpToDate > 0)
+        {
+            LOG_VERBOSE("Skipped %d textures that are already imported and unchanged.", NumUpToDate);
+        }
+
+        TArray<UObject*> ImportedObjects;
+        int32 NumImported = 0;
+        for (int32 Batch = 0; Batch < 2; Batch++)
+        {
+            const bool bSrgb = Batch == 1;
+            const TextureCompressionSettings Compression = bSrgb ? TC_Default : TC_VectorDisplacementmap;
+            const int32 BatchSize = FCharmImportMemoryBudget::GetBatchSize(Filenames[Batch].Num());
+            for (int32 First = 0; First < Filenames[Batch].Num(); First += BatchSize)
+            {
+                // A factory of our own, the settings below must not leak into the editor's default texture factory
+                UTextureFactory* TextureFactory = NewObject<UTextureFactory>();
+                TextureFactory->SuppressImportOverwriteDialog();
+                TextureFactory->CompressionSettings = Compression;
+                TextureFactory->bDeferCompression = true;
+
+                UAutomatedAssetImportData* ImportData =
+                    NewObject<UAutomatedAssetImportData>(TextureFactory, UAutomatedAssetImportData::StaticClass());
+                ImportData->Factory = TextureFactory;
+                ImportData->bReplaceExisting =
+                    true;    // required when using batch import, if one exists it stops the entire import for some reason
+                ImportData->DestinationPath = TargetDirectory / "Textures";
+                ImportData->Filenames.Append(Filenames[Batch].GetData() + First, FMath::Min(BatchSize, Filenames[Batch].Num() - First));
+                TextureFactory->SetAutomatedAssetImportData(ImportData);
+                const FAssetToolsModule& AssetToolsModule = FModuleManager::LoadModuleChecked<FAssetToolsModule>("AssetTools");
+                TArray<UObject*> BatchObjects = AssetToolsModule.Get().ImportAssetsAutomated(ImportData);
+                for (UObject* ImportedObject : BatchObjects)
+                {
+                    if (UTexture* Texture = Cast<UTexture>(ImportedObject))
+                    {
+                        // Still uncompressed, the save below builds the platform data with these settings
+                        Texture->SRGB = bSrgb;
+                        Texture->CompressionSettings = Compression;
+                        NumImported++;
+                    }
+                }
+                if (!FCharmImportMemoryBudget::Flush(BatchObjects))
+                {
+                    ImportedObjects.Append(BatchObjects);
+                }
             }
         }
 
         UEditorAssetLibrary::SaveLoadedAssets(ImportedObjects, true);
 
-        return ImportedTextures;
+        return NumImported;
     }
 
-    static TArray<UObject*> ImportFbxAsStaticMesh(const FString& FbxPath, const FString& TargetDirectory)
+    /**
+     * Check whether an asset was imported from this exact source file, using the import data the asset registry keeps so
+     * the asset is not loaded. The recorded file has to be SourceFile; then a matching timestamp is enough, otherwise the
+     * file's MD5 has to match the recorded one.
+     *
+     * @param AssetPath The asset path of the imported asset.
+     * @param SourceFile The file that would be imported.
+     * @return true if importing the file again would produce the same asset.
+     */
+    static bool IsImportUpToDate(const FString& AssetPath, const FString& SourceFile)
     {
+        FAssetData AssetData;
+        if (const FCharmAssetIndex* AssetIndex = FCharmAssetIndex::Find(AssetPath))
+        {
+            const FAssetData* IndexedAssetData = AssetIndex->FindAsset(AssetPath);
+            if (!IndexedAssetData)
+            {
+                return false;
+            }
+            AssetData = *IndexedAssetData;
+        }
+        else
+        {
+            FAssetRegistryModule& AssetRegistryModule = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry");
+            TArray<FAssetData> AssetDataList;
+            AssetRegistryModule.Get().GetAssetsByPackageName(*AssetPath, AssetDataList);
+            if (AssetDataList.Num() != 1)
+            {
+                return false;
+            }
+            AssetData = AssetDataList[0];
+        }
+        FString ImportDataJson;
+        if (!AssetData.GetTagValue(UObject::SourceFileTagName(), ImportDataJson))
+        {
+            return false;
+        }
+        const TOptional<FAssetImportInfo> ImportInfo = FAssetImportInfo::FromJson(ImportDataJson);
+        if (!ImportInfo.IsSet() || ImportInfo->SourceFiles.Num() == 0)
+        {
+            return false;
+        }
+
+        // Recorded relative to the package file when it is close enough, absolute otherwise
+        const FAssetImportInfo::FSourceFile& Source = ImportInfo->SourceFiles[0];
+        const FString PackageDirectory = FPaths::GetPath(FPackageName::LongPackageNameToFilename(AssetPath));
+        if (!FPaths::IsSamePath(Source.RelativeFilename, SourceFile) &&
+            !(FPaths::IsRelative(Source.RelativeFilename) && FPaths::IsSamePath(PackageDirectory / Source.RelativeFilename, SourceFile)))
+        {
+            return false;
+        }
+        const FDateTime Timestamp = IFileManager::Get().GetTimeStamp(*SourceFile);
+        if (Timestamp == FDateTime::MinValue())
+        {
+            return false;
+        }
+        if (Timestamp == Source.Timestamp)
+        {
+            return true;
+        }
+        // Rewritten by another export, but possibly with the same contents
+        return Source.FileHash.IsValid() && FMD5Hash::HashFile(*SourceFile) == Source.FileHash;
+    }
+
+    /** The mesh directory of an import into TargetDirectory, for callers that do not keep meshes elsewhere. */
+    static FString GetStaticMeshDirectory(const FString& TargetDirectory) { return TargetDirectory / TEXT("SM"); }
+
+    static TArray<UObject*> ImportFbxAsStaticMesh(const FString& FbxPath, const FString& MeshDirectory)
+    {
+        return ImportFbxAsStaticMeshes({FbxPath}, MeshDirectory);
+    }
+
+    /** Import many FBX files with one factory and one automated import, each into a static mesh in MeshDirectory named after it. */
+    static TArray<UObject*> ImportFbxAsStaticMeshes(const TArray<FString>& FbxPaths, const FString& MeshDirectory)
+    {
+        CHARM_IMPORT_STAGE(MeshImport);
+        if (FbxPaths.Num() == 0)
+        {
+            return {};
+        }
+        // Rooted for this import only, so the factory and its import data are collected afterwards
         UFbxFactory* FbxFactory = NewObject<UFbxFactory>(UFbxFactory::StaticClass());
         FbxFactory->AddToRoot();
 
         UAutomatedAssetImportData* ImportData = NewObject<UAutomatedAssetImportData>(FbxFactory, UAutomatedAssetImportData::StaticClass());
         ImportData->Factory = FbxFactory;
         ImportData->bReplaceExisting = true;
-        ImportData->DestinationPath = "/CharmTunnel/Dev/SM";
-        ImportData->Filenames.Add(FbxPath);
+        ImportData->DestinationPath = MeshDirectory;
+        ImportData->Filenames.Append(FbxPaths);
 
         FbxFactory->SetAutomatedAssetImportData(ImportData);
         UFbxImportUI* ImportUI = NewObject<UFbxImportUI>(UFbxImportUI::StaticClass());
         FbxFactory->ImportUI = ImportUI;
         ImportUI->StaticMeshImportData->bCombineMeshes = true;
+        // Nanite and LODs are set up per mesh by FCharmMeshBuildProfile once the materials are known
         ImportUI->StaticMeshImportData->bBuildNanite = false;
         ImportUI->StaticMeshImportData->bGenerateLightmapUVs = false;
         ImportUI->StaticMeshImportData->bAutoGenerateCollision = false;
@@ -455,6 +1653,7 @@ public:
         ImportUI->bImportMesh = true;
         const FAssetToolsModule& AssetToolsModule = FModuleManager::LoadModuleChecked<FAssetToolsModule>("AssetTools");
         TArray<UObject*> ImportedObjects = AssetToolsModule.Get().ImportAssetsAutomated(ImportData);
+        FbxFactory->RemoveFromRoot();
 
         return ImportedObjects;
     }
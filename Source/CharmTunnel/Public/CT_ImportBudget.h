@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include "CoreMinimal.h"
+#include "EditorAssetLibrary.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMemory.h"
+#include "PackageTools.h"
+#include "UObject/Package.h"
+#include "UObject/UObjectGlobals.h"
+
+/**
+ * Memory budget of an import, set with CharmTunnel.ImportMemoryBudgetMB.
+ *
+ * Without a budget an import keeps everything it creates loaded until it ends. With one, meshes and textures are imported
+ * in batches of CharmTunnel.ImportBatchSize. Each batch is saved when it is done, and garbage is collected before the next
+ * one. While the process uses more physical memory than the budget, the batch's packages are unloaded as well. Steps that
+ * need those assets later load them again by path, which takes far less memory than the import did.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTImportBudget, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTImportBudget);
+
+inline TAutoConsoleVariable<int32> CVarCharmImportMemoryBudget(TEXT("CharmTunnel.ImportMemoryBudgetMB"), 0,
+    TEXT("Physical memory in MiB an import may use before it unloads the assets it saved. 0 keeps every imported asset loaded."));
+
+inline TAutoConsoleVariable<int32> CVarCharmImportBatchSize(TEXT("CharmTunnel.ImportBatchSize"), 200,
+    TEXT("Meshes or textures imported between saves when an import memory budget is set."));
+
+struct FCharmImportMemoryBudget
+{
+    static bool IsEnabled() { return CVarCharmImportMemoryBudget.GetValueOnGameThread() > 0; }
+
+    /** True while the process uses more physical memory than the budget. */
+    static bool IsExceeded()
+    {
+        const int64 Budget = (int64) CVarCharmImportMemoryBudget.GetValueOnGameThread() * 1024 * 1024;
+        return Budget > 0 && (int64) FPlatformMemory::GetStats().UsedPhysical > Budget;
+    }
+
+    /** How many of NumAssets to import in one go, all of them without a budget. */
+    static int32 GetBatchSize(int32 NumAssets)
+    {
+        return FMath::Max(IsEnabled() ? CVarCharmImportBatchSize.GetValueOnGameThread() : NumAssets, 1);
+    }
+
+    /**
+     * End of an import batch. Without a budget this does nothing, the caller saves as before. Otherwise the assets are saved,
+     * then unloaded if the import is over budget, and garbage is collected.
+     *
+     * @param Assets The assets the batch imported.
+     * @return true if the assets were unloaded, they have to be loaded again by path to be used.
+     */
+    static bool Flush(const TArray<UObject*>& Assets)
+    {
+        if (!IsEnabled() || Assets.Num() == 0)
+        {
+            return false;
+        }
+        UEditorAssetLibrary::SaveLoadedAssets(Assets, true);
+        if (!IsExceeded())
+        {
+            CollectGarbage(GARBAGE_COLLECTION_KEEPFLAGS);
+            return false;
+        }
+
+        TArray<UPackage*> Packages;
+        for (const UObject* Asset : Assets)
+        {
+            Packages.AddUnique(Asset->GetPackage());
+        }
+        // Collects garbage itself, so whatever the batch left behind goes too
+        FText ErrorMessage;
+        if (!UPackageTools::UnloadPackages(Packages, ErrorMessage))
+        {
+            UE_LOG(LogCTImportBudget, Warning, TEXT("Failed to unload some imported packages: %s"), *ErrorMessage.ToString());
+        }
+        UE_LOG(LogCTImportBudget, Log, TEXT("Unloaded %d packages, %.0f MiB in use of the %d MiB budget."), Packages.Num(),
+            FPlatformMemory::GetStats().UsedPhysical / (1024.0 * 1024.0), CVarCharmImportMemoryBudget.GetValueOnGameThread());
+        return true;
+    }
+};
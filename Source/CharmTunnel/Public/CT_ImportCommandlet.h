@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include "Commandlets/Commandlet.h"
+#include "CoreMinimal.h"
+
+#include "CT_ImportCommandlet.generated.h"
+
+/**
+ * Headless import of a whole Charm export.
+ *
+ * UnrealEditor-Cmd <Project> -run=CharmTunnelImport -Export=<ExportDirectory> -Target=<ContentPath> [-Full]
+ *     [-Workers=<Count>] [-MemoryBudget=<MiB>] [-Summary=<File>] -nullrhi -unattended
+ *
+ * Loads every config, imports the statics (meshes into <Target>/SM, textures, materials) as one batch, the ones maps place
+ * included, then creates a level under <Target>/Maps for each map config with its placements and saves everything. -Full
+ * rebuilds assets the import manifest says are up to date. A json summary with counts and timings is written to -Summary,
+ * Saved/CharmTunnel/ImportSummary.json by default, and the time and memory of each import stage to
+ * Saved/CharmTunnel/ImportReport.csv (see FCharmImportReport).
+ * Returns non-zero if an import step fails or any error is logged.
+ *
+ * -MemoryBudget sets CharmTunnel.ImportMemoryBudgetMB (see FCharmImportMemoryBudget) for this process and each worker.
+ *
+ * -Workers splits the meshes and textures between that many worker processes of this commandlet (started with -Shard and
+ * -ShardCount, see FCharmEditorLibrary::ImportStaticsShard) which import them side by side, each into its own packages.
+ * Once they are done this process builds the shared materials and the levels. The workers' logs, summaries and reports are
+ * in Saved/CharmTunnel/Workers.
+ */
+UCLASS()
+class CHARMTUNNEL_API UCharmTunnelImportCommandlet : public UCommandlet
+{
+    GENERATED_BODY()
+public:
+    UCharmTunnelImportCommandlet()
+    {
+        IsClient = false;
+        IsEditor = true;
+        IsServer = false;
+        LogToConsole = true;
+    }
+
+    virtual int32 Main(const FString& Params) override;
+};
@@ -0,0 +1,234 @@
+﻿#pragma once
+
+#include "CT_ConfigModel.h"
+#include "CoreMinimal.h"
+#include "Dom/JsonObject.h"
+#include "HAL/FileManager.h"
+#include "Misc/CommandLine.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
+#include "Misc/SecureHash.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+/**
+ * Persistent record of what every generated asset was built from.
+ *
+ * Each asset path maps to a signature, a SHA1 over the hashes of its source files (FBX, DDS, HLSL), the parts of the config it
+ * reads and the converter version and options. An import recomputes the signatures and rebuilds only the assets whose
+ * signature changed. Source file MD5s are cached by timestamp so unchanged files are not read again.
+ *
+ * Stored as json in Saved/CharmTunnel/ImportManifest.json.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTImportManifest, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTImportManifest);
+
+class FCharmImportManifest;
+
+/** Builds the signature of one asset from its inputs. */
+class FCharmInputSignature
+{
+public:
+    explicit FCharmInputSignature(FCharmImportManifest& InManifest) : Manifest(InManifest) {}
+
+    FCharmInputSignature& AddString(const FString& Value)
+    {
+        AddInt(Value.Len());
+        Sha.UpdateWithString(*Value, Value.Len());
+        return *this;
+    }
+
+    FCharmInputSignature& AddInt(int32 Value)
+    {
+        Sha.Update(reinterpret_cast<const uint8*>(&Value), sizeof(Value));
+        return *this;
+    }
+
+    /** Contents of a file, a missing file hashes differently from every existing one. */
+    inline FCharmInputSignature& AddFile(const FString& Path);
+
+    /** Everything the material builders read from a shader stage of the config. */
+    FCharmInputSignature& AddShaderStage(const FCharmShaderStage& Stage)
+    {
+        AddInt(Stage.Textures.Num());
+        for (const FCharmTextureBinding& Texture : Stage.Textures)
+        {
+            AddString(Texture.Slot).AddString(Texture.Hash).AddInt(Texture.bSrgb ? 1 : 0);
+        }
+        AddInt(Stage.ConstantBuffers.Num());
+        Sha.Update(reinterpret_cast<const uint8*>(Stage.ConstantBuffers.GetData()),
+            Stage.ConstantBuffers.Num() * sizeof(FCharmConstantBufferRange));
+        AddInt(Stage.ConstantBufferValues.Num());
+        Sha.Update(reinterpret_cast<const uint8*>(Stage.ConstantBufferValues.GetData()),
+            Stage.ConstantBufferValues.Num() * sizeof(FVector4f));
+        return *this;
+    }
+
+    FString Finish()
+    {
+        Sha.Final();
+        FSHAHash Hash;
+        Sha.GetHash(Hash.Hash);
+        return Hash.ToString();
+    }
+
+private:
+    FCharmImportManifest& Manifest;
+    FSHA1 Sha;
+};
+
+class FCharmImportManifest
+{
+public:
+    /** Saved/CharmTunnel/ImportManifest.json, or the -CharmImportManifest= file an import worker was started with. */
+    static FString GetDefaultPath()
+    {
+        FString CommandLinePath;
+        if (FParse::Value(FCommandLine::Get(), TEXT("CharmImportManifest="), CommandLinePath))
+        {
+            return CommandLinePath;
+        }
+        return FPaths::ProjectSavedDir() / TEXT("CharmTunnel/ImportManifest.json");
+    }
+
+    /** Read the manifest. A missing or unreadable manifest is empty, which makes every asset dirty. */
+    bool Load(const FString& InPath = GetDefaultPath())
+    {
+        Path = InPath;
+        Assets.Reset();
+        Files.Reset();
+
+        FString FileContents;
+        if (!FFileHelper::LoadFileToString(FileContents, *Path))
+        {
+            return false;
+        }
+        TSharedPtr<FJsonObject> JsonObject;
+        const TSharedRef<TJsonReader<>> JsonReader = TJsonReaderFactory<>::Create(FileContents);
+        int32 Version = 0;
+        if (!FJsonSerializer::Deserialize(JsonReader, JsonObject) || !JsonObject.IsValid() ||
+            !JsonObject->TryGetNumberField(TEXT("Version"), Version) || Version != FormatVersion)
+        {
+            UE_LOG(LogCTImportManifest, Warning, TEXT("Ignoring unreadable import manifest %s."), *Path);
+            return false;
+        }
+
+        const TSharedPtr<FJsonObject>* AssetsObject;
+        if (JsonObject->TryGetObjectField(TEXT("Assets"), AssetsObject))
+        {
+            for (const auto& Pair : (*AssetsObject)->Values)
+            {
+                Assets.Add(Pair.Key, Pair.Value->AsString());
+            }
+        }
+        const TSharedPtr<FJsonObject>* FilesObject;
+        if (JsonObject->TryGetObjectField(TEXT("Files"), FilesObject))
+        {
+            for (const auto& Pair : (*FilesObject)->Values)
+            {
+                const TSharedPtr<FJsonObject>* FileObject;
+                FString Timestamp;
+                FString Hash;
+                FileRecord Record;
+                if (Pair.Value->TryGetObject(FileObject) && (*FileObject)->TryGetStringField(TEXT("Timestamp"), Timestamp) &&
+                    (*FileObject)->TryGetStringField(TEXT("MD5"), Hash) && FDateTime::ParseIso8601(*Timestamp, Record.Timestamp))
+                {
+                    Record.Hash = Hash;
+                    Files.Add(Pair.Key, Record);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool Save() const
+    {
+        const TSharedRef<FJsonObject> JsonObject = MakeShared<FJsonObject>();
+        JsonObject->SetNumberField(TEXT("Version"), FormatVersion);
+        const TSharedRef<FJsonObject> AssetsObject = MakeShared<FJsonObject>();
+        for (const auto& Pair : Assets)
+        {
+            AssetsObject->SetStringField(Pair.Key, Pair.Value);
+        }
+        JsonObject->SetObjectField(TEXT("Assets"), AssetsObject);
+        const TSharedRef<FJsonObject> FilesObject = MakeShared<FJsonObject>();
+        for (const auto& Pair : Files)
+        {
+            const TSharedRef<FJsonObject> FileObject = MakeShared<FJsonObject>();
+            FileObject->SetStringField(TEXT("Timestamp"), Pair.Value.Timestamp.ToIso8601());
+            FileObject->SetStringField(TEXT("MD5"), Pair.Value.Hash);
+            FilesObject->SetObjectField(Pair.Key, FileObject);
+        }
+        JsonObject->SetObjectField(TEXT("Files"), FilesObject);
+
+        FString FileContents;
+        const TSharedRef<TJsonWriter<>> JsonWriter = TJsonWriterFactory<>::Create(&FileContents);
+        if (!FJsonSerializer::Serialize(JsonObject, JsonWriter) || !FFileHelper::SaveStringToFile(FileContents, *Path))
+        {
+            UE_LOG(LogCTImportManifest, Error, TEXT("Failed to save import manifest %s."), *Path);
+            return false;
+        }
+        return true;
+    }
+
+    FCharmInputSignature MakeSignature() { return FCharmInputSignature(*this); }
+
+    /** True if the asset was last built from inputs with this signature. Whether the asset still exists is up to the caller. */
+    bool IsUpToDate(const FString& AssetPath, const FString& Signature) const
+    {
+        const FString* Recorded = Assets.Find(AssetPath);
+        return Recorded && *Recorded == Signature;
+    }
+
+    void Record(const FString& AssetPath, const FString& Signature) { Assets.Add(AssetPath, Signature); }
+
+    void Forget(const FString& AssetPath) { Assets.Remove(AssetPath); }
+
+    /** Take over the signatures and file hashes of another manifest, its entries win where both have one. */
+    void Merge(const FCharmImportManifest& Other)
+    {
+        Assets.Append(Other.Assets);
+        Files.Append(Other.Files);
+    }
+
+    /** MD5 of a file, reusing the recorded hash while the timestamp is unchanged. Empty if the file does not exist. */
+    FString HashFile(const FString& FilePath)
+    {
+        const FDateTime Timestamp = IFileManager::Get().GetTimeStamp(*FilePath);
+        if (Timestamp == FDateTime::MinValue())
+        {
+            return FString();
+        }
+        const FString Key = FPaths::ConvertRelativePathToFull(FilePath);
+        if (const FileRecord* Record = Files.Find(Key); Record && Record->Timestamp == Timestamp)
+        {
+            return Record->Hash;
+        }
+        const FMD5Hash Hash = FMD5Hash::HashFile(*FilePath);
+        FileRecord& Record = Files.Add(Key);
+        Record.Timestamp = Timestamp;
+        Record.Hash = Hash.IsValid() ? LexToString(Hash) : FString();
+        return Record.Hash;
+    }
+
+private:
+    static constexpr int32 FormatVersion = 1;
+
+    struct FileRecord
+    {
+        FDateTime Timestamp;
+        FString Hash;
+    };
+
+    FString Path = GetDefaultPath();
+    TMap<FString, FString> Assets;
+    TMap<FString, FileRecord> Files;
+};
+
+inline FCharmInputSignature& FCharmInputSignature::AddFile(const FString& Path)
+{
+    return AddString(Manifest.HashFile(Path));
+}
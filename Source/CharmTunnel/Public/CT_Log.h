@@ -3,6 +3,7 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
 #include "Widgets/Input/SMultiLineEditableTextBox.h"
 
 /**
@@ -31,6 +32,25 @@ protected:
         if (!(Category.ToString().Contains("LogCharmTunnel") || Category.ToString().Contains("LogCT")))
             return;
 
+        // Converters log from worker threads, queue those lines until the next game thread message
+        if (!IsInGameThread())
+        {
+            FScopeLock Lock(&PendingLock);
+            PendingText += TEXT("\n") + FormatLine(Message, Verbosity);
+            return;
+        }
+        {
+            FScopeLock Lock(&PendingLock);
+            LogText += PendingText;
+            PendingText.Reset();
+        }
+        LogText += TEXT("\n") + FormatLine(Message, Verbosity);
+        SetText(FText::FromString(LogText));
+    }
+
+private:
+    static FString FormatLine(const TCHAR* Message, ELogVerbosity::Type Verbosity)
+    {
         FString VerbosityString;
         switch (Verbosity)
         {
@@ -43,10 +63,10 @@ protected:
             default:
                 break;
         }
-        LogText += TEXT("\n") + VerbosityString + Message;
-        SetText(FText::FromString(LogText));
+        return VerbosityString + Message;
     }
 
-private:
     FString LogText;
+    FString PendingText;
+    FCriticalSection PendingLock;
 };
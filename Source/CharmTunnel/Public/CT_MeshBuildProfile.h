@@ -0,0 +1,190 @@
+﻿#pragma once
+
+#include "CT_ImportBudget.h"
+#include "CT_Stats.h"
+#include "CoreMinimal.h"
+#include "Dom/JsonObject.h"
+#include "Engine/StaticMesh.h"
+#include "Materials/MaterialInterface.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "StaticMeshResources.h"
+
+/**
+ * How imported static meshes are built, chosen per mesh from its triangle count, bounds and material blend modes.
+ *
+ * Dense opaque meshes are built as Nanite. The rest get reduced LODs with fixed screen sizes, unless they are too small or
+ * too light for LODs to matter. An export can override the defaults with a MeshBuildProfile.json next to its configs, with
+ * any of the fields below:
+ *
+ *   { "Nanite": true, "NaniteMinTriangles": 2000, "Lods": 4, "LodTrianglePercent": 0.5, "LodScreenSizes": [1, 0.4, 0.2, 0.1],
+ *     "LodMinTriangles": 500, "LodMinRadius": 50 }
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTMeshBuild, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTMeshBuild);
+
+struct FCharmMeshBuildProfile
+{
+    bool bNanite = true;
+    // Opaque meshes with at least this many triangles in LOD0 are built as Nanite
+    int32 NaniteMinTriangles = 2000;
+    // LOD count for meshes that are not Nanite, including LOD0
+    int32 NumLods = 4;
+    // Fraction of the previous LOD's triangles each LOD keeps
+    float LodTrianglePercent = 0.5f;
+    // Screen size of each LOD, halving from 1 when the profile does not list them
+    TArray<float> LodScreenSizes;
+    // Meshes below either of these keep a single LOD
+    int32 LodMinTriangles = 500;
+    float LodMinRadius = 50.0f;
+
+    static FString GetFileName() { return TEXT("MeshBuildProfile.json"); }
+
+    /**
+     * Read the profile of an export.
+     *
+     * @param ExportDirectory The directory that may contain a MeshBuildProfile.json.
+     * @return the profile, the defaults if the export has none.
+     */
+    static FCharmMeshBuildProfile Load(const FString& ExportDirectory)
+    {
+        FCharmMeshBuildProfile Profile;
+        const FString ProfilePath = ExportDirectory / GetFileName();
+        FString FileContents;
+        if (!FPaths::FileExists(ProfilePath) || !FFileHelper::LoadFileToString(FileContents, *ProfilePath))
+        {
+            return Profile;
+        }
+        TSharedPtr<FJsonObject> JsonObject;
+        const TSharedRef<TJsonReader<>> JsonReader = TJsonReaderFactory<>::Create(FileContents);
+        if (!FJsonSerializer::Deserialize(JsonReader, JsonObject) || !JsonObject.IsValid())
+        {
+            UE_LOG(LogCTMeshBuild, Error, TEXT("Unable to parse mesh build profile %s, using the defaults."), *ProfilePath);
+            return Profile;
+        }
+
+        JsonObject->TryGetBoolField(TEXT("Nanite"), Profile.bNanite);
+        JsonObject->TryGetNumberField(TEXT("NaniteMinTriangles"), Profile.NaniteMinTriangles);
+        JsonObject->TryGetNumberField(TEXT("Lods"), Profile.NumLods);
+        JsonObject->TryGetNumberField(TEXT("LodMinTriangles"), Profile.LodMinTriangles);
+        double Number;
+        if (JsonObject->TryGetNumberField(TEXT("LodTrianglePercent"), Number))
+        {
+            Profile.LodTrianglePercent = (float) Number;
+        }
+        if (JsonObject->TryGetNumberField(TEXT("LodMinRadius"), Number))
+        {
+            Profile.LodMinRadius = (float) Number;
+        }
+        const TArray<TSharedPtr<FJsonValue>>* ScreenSizes;
+        if (JsonObject->TryGetArrayField(TEXT("LodScreenSizes"), ScreenSizes))
+        {
+            for (const TSharedPtr<FJsonValue>& ScreenSize : *ScreenSizes)
+            {
+                Profile.LodScreenSizes.Add((float) ScreenSize->AsNumber());
+            }
+        }
+        Profile.NumLods = FMath::Clamp(Profile.NumLods, 1, (int32) MAX_STATIC_MESH_LODS);
+        Profile.LodTrianglePercent = FMath::Clamp(Profile.LodTrianglePercent, 0.01f, 1.0f);
+        UE_LOG(LogCTMeshBuild, Log, TEXT("Using mesh build profile %s."), *ProfilePath);
+        return Profile;
+    }
+
+    /** Everything that changes the built meshes, for the import manifest signature. */
+    FString ToString() const
+    {
+        TArray<FString> ScreenSizes;
+        for (int32 Lod = 0; Lod < NumLods; Lod++)
+        {
+            ScreenSizes.Add(FString::SanitizeFloat(GetScreenSize(Lod)));
+        }
+        return FString::Printf(TEXT("%d %d %d %f %d %f [%s]"), bNanite, NaniteMinTriangles, NumLods, LodTrianglePercent, LodMinTriangles,
+            LodMinRadius, *FString::Join(ScreenSizes, TEXT(",")));
+    }
+
+    float GetScreenSize(int32 Lod) const
+    {
+        return LodScreenSizes.IsValidIndex(Lod) ? LodScreenSizes[Lod] : FMath::Pow(0.5f, (float) Lod);
+    }
+
+    /**
+     * Set up Nanite or LODs on meshes whose materials are assigned, then rebuild them together.
+     *
+     * @param Meshes The meshes to set up.
+     */
+    void Apply(const TArray<UStaticMesh*>& Meshes) const
+    {
+        CHARM_IMPORT_STAGE(MeshImport);
+        TArray<UStaticMesh*> MeshesToBuild;
+        int32 NumNanite = 0;
+        int32 NumWithLods = 0;
+        for (UStaticMesh* Mesh : Meshes)
+        {
+            const int32 NumTriangles = Mesh->GetNumTriangles(0);
+            const bool bUseNanite = bNanite && NumTriangles >= NaniteMinTriangles && IsOpaque(Mesh);
+            const bool bUseLods = !bUseNanite && NumLods > 1 && NumTriangles >= LodMinTriangles &&
+                                  Mesh->GetBounds().SphereRadius >= LodMinRadius;
+            const int32 NumSourceModels = bUseLods ? NumLods : 1;
+            if (!bUseLods && Mesh->NaniteSettings.bEnabled == bUseNanite && Mesh->GetNumSourceModels() == 1)
+            {
+                continue;
+            }
+
+            Mesh->Modify();
+            Mesh->NaniteSettings.bEnabled = bUseNanite;
+            Mesh->SetNumSourceModels(NumSourceModels);
+            if (bUseLods)
+            {
+                Mesh->bAutoComputeLODScreenSize = false;
+                const FMeshBuildSettings BuildSettings = Mesh->GetSourceModel(0).BuildSettings;
+                for (int32 Lod = 0; Lod < NumSourceModels; Lod++)
+                {
+                    FStaticMeshSourceModel& SourceModel = Mesh->GetSourceModel(Lod);
+                    SourceModel.ScreenSize.Default = GetScreenSize(Lod);
+                    if (Lod > 0)
+                    {
+                        SourceModel.BuildSettings = BuildSettings;
+                        SourceModel.ReductionSettings.PercentTriangles = FMath::Pow(LodTrianglePercent, (float) Lod);
+                    }
+                }
+                NumWithLods++;
+            }
+            NumNanite += bUseNanite ? 1 : 0;
+            MeshesToBuild.Add(Mesh);
+        }
+        if (MeshesToBuild.Num() == 0)
+        {
+            return;
+        }
+
+        // Builds in parallel, instead of one PostEditChange each. Every build in flight holds its mesh descriptions, so under an
+        // import memory budget only a batch of them runs at a time
+        const int32 BatchSize = FCharmImportMemoryBudget::GetBatchSize(MeshesToBuild.Num());
+        for (int32 First = 0; First < MeshesToBuild.Num(); First += BatchSize)
+        {
+            UStaticMesh::BatchBuild(
+                TArray<UStaticMesh*>(MeshesToBuild.GetData() + First, FMath::Min(BatchSize, MeshesToBuild.Num() - First)));
+        }
+        for (UStaticMesh* Mesh : MeshesToBuild)
+        {
+            Mesh->MarkPackageDirty();
+        }
+        UE_LOG(LogCTMeshBuild, Log, TEXT("Built %d meshes, %d as Nanite and %d with %d LODs."), MeshesToBuild.Num(), NumNanite, NumWithLods,
+            NumLods);
+    }
+
+private:
+    static bool IsOpaque(const UStaticMesh* Mesh)
+    {
+        for (const FStaticMaterial& StaticMaterial : Mesh->GetStaticMaterials())
+        {
+            if (!StaticMaterial.MaterialInterface || StaticMaterial.MaterialInterface->GetBlendMode() != BLEND_Opaque)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
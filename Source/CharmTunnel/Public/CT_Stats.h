@@ -0,0 +1,238 @@
+﻿#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/LowLevelMemTracker.h"
+#include "HAL/PlatformMemory.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/CommandLine.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "Stats/Stats.h"
+#include "Trace/Trace.h"
+
+/**
+ * Instrumentation of the import pipeline and the render extension.
+ *
+ * Each instrumented scope is a cycle stat in STATGROUP_CharmTunnel ("stat CharmTunnel"), an event on the CharmTunnel trace
+ * channel (-trace=cpu,CharmTunnel for Unreal Insights) and allocates under the CharmTunnel LLM tag. Import stages are also
+ * timed by FCharmImportReport, which logs a table of them and writes it as CSV when an import ends.
+ */
+
+DECLARE_LOG_CATEGORY_EXTERN(LogCTStats, Log, All);
+inline DEFINE_LOG_CATEGORY(LogCTStats);
+
+DECLARE_STATS_GROUP(TEXT("CharmTunnel"), STATGROUP_CharmTunnel, STATCAT_Advanced);
+DECLARE_CYCLE_STAT(TEXT("Config parsing"), STAT_CharmConfig, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("USF conversion"), STAT_CharmUsfConversion, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Texture import"), STAT_CharmTextureImport, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Material creation"), STAT_CharmMaterialCreation, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Material compilation"), STAT_CharmMaterialCompilation, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Mesh import"), STAT_CharmMeshImport, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Actor spawning"), STAT_CharmActorSpawning, STATGROUP_CharmTunnel);
+DECLARE_CYCLE_STAT(TEXT("Render extension"), STAT_CharmRenderExtension, STATGROUP_CharmTunnel);
+
+// Defined in CharmTunnel.cpp
+UE_TRACE_CHANNEL_EXTERN(CharmTunnelChannel, CHARMTUNNEL_API);
+LLM_DECLARE_TAG_API(CharmTunnel, CHARMTUNNEL_API);
+
+/** Cycle stat, trace event and LLM tag for a scope, on any thread. Name is a string literal. */
+#define CHARM_SCOPE(Stat, Name)                                                            \
+    SCOPE_CYCLE_COUNTER(Stat);                                                             \
+    TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL_STR("CharmTunnel " Name, CharmTunnelChannel); \
+    LLM_SCOPE_BYTAG(CharmTunnel)
+
+/** CHARM_SCOPE for a whole import stage, which also books the scope's time and memory to the import report. */
+#define CHARM_IMPORT_STAGE(Stage)                                                          \
+    CHARM_SCOPE(STAT_Charm##Stage, #Stage);                                                \
+    const FCharmImportReport::FStageScope CharmImportStage_##Stage(ECharmImportStage::Stage)
+
+enum class ECharmImportStage : uint8
+{
+    Config,
+    UsfConversion,
+    TextureImport,
+    MaterialCreation,
+    MaterialCompilation,
+    MeshImport,
+    ActorSpawning,
+    Num,
+};
+
+/**
+ * Time, call count and memory growth of each import stage over one import.
+ *
+ * Stages are exclusive: a stage nested in another (the USF conversion inside material creation) is booked to itself only.
+ * Imports nest as well, the report covers the outermost FImport and is written when it ends: a table in the log, and a CSV
+ * at Saved/CharmTunnel/ImportReport.csv or the -CharmImportReport= file. Memory is the change in the process' used physical
+ * memory, so allocations freed within a stage do not show.
+ */
+class FCharmImportReport
+{
+public:
+    /** One import. Game thread only. */
+    class FImport
+    {
+    public:
+        FImport() { Get().BeginImport(); }
+        ~FImport() { Get().EndImport(); }
+
+        FImport(const FImport&) = delete;
+        FImport& operator=(const FImport&) = delete;
+    };
+
+    /** Books the time inside it to a stage. Only counts on the game thread, where the import stages run. */
+    class FStageScope
+    {
+    public:
+        explicit FStageScope(ECharmImportStage InStage) : Stage(InStage), bActive(IsInGameThread())
+        {
+            if (!bActive)
+            {
+                return;
+            }
+            Parent = Current;
+            if (Parent)
+            {
+                Parent->Book();
+            }
+            Current = this;
+            Get().Stages[(int32) Stage].Calls++;
+            Restart();
+        }
+
+        ~FStageScope()
+        {
+            if (!bActive)
+            {
+                return;
+            }
+            Book();
+            Current = Parent;
+            if (Parent)
+            {
+                Parent->Restart();
+            }
+        }
+
+        FStageScope(const FStageScope&) = delete;
+        FStageScope& operator=(const FStageScope&) = delete;
+
+    private:
+        void Restart()
+        {
+            StartSeconds = FPlatformTime::Seconds();
+            StartMemory = GetUsedMemory();
+        }
+
+        void Book() const
+        {
+            FStage& Booked = Get().Stages[(int32) Stage];
+            Booked.Seconds += FPlatformTime::Seconds() - StartSeconds;
+            Booked.MemoryDelta += GetUsedMemory() - StartMemory;
+        }
+
+        inline static FStageScope* Current = nullptr;
+
+        ECharmImportStage Stage;
+        bool bActive;
+        FStageScope* Parent = nullptr;
+        double StartSeconds = 0;
+        int64 StartMemory = 0;
+    };
+
+    static FCharmImportReport& Get()
+    {
+        static FCharmImportReport Report;
+        return Report;
+    }
+
+    static const TCHAR* GetStageName(ECharmImportStage Stage)
+    {
+        static const TCHAR* Names[] = {TEXT("Config parsing"), TEXT("USF conversion"), TEXT("Texture import"), TEXT("Material creation"),
+            TEXT("Material compilation"), TEXT("Mesh import"), TEXT("Actor spawning")};
+        static_assert(UE_ARRAY_COUNT(Names) == (int32) ECharmImportStage::Num);
+        return Names[(int32) Stage];
+    }
+
+    static FString GetDefaultPath()
+    {
+        FString CommandLinePath;
+        if (FParse::Value(FCommandLine::Get(), TEXT("CharmImportReport="), CommandLinePath))
+        {
+            return CommandLinePath;
+        }
+        return FPaths::ProjectSavedDir() / TEXT("CharmTunnel/ImportReport.csv");
+    }
+
+private:
+    struct FStage
+    {
+        int32 Calls = 0;
+        double Seconds = 0;
+        int64 MemoryDelta = 0;
+    };
+
+    static int64 GetUsedMemory() { return (int64) FPlatformMemory::GetStats().UsedPhysical; }
+
+    void BeginImport()
+    {
+        if (Depth++ > 0)
+        {
+            return;
+        }
+        for (FStage& Stage : Stages)
+        {
+            Stage = FStage();
+        }
+        StartSeconds = FPlatformTime::Seconds();
+        StartMemory = GetUsedMemory();
+    }
+
+    void EndImport()
+    {
+        if (--Depth > 0)
+        {
+            return;
+        }
+        const double TotalSeconds = FPlatformTime::Seconds() - StartSeconds;
+        const FPlatformMemoryStats MemoryStats = FPlatformMemory::GetStats();
+        constexpr double MiB = 1024.0 * 1024.0;
+
+        TStringBuilder<2048> Table;
+        TStringBuilder<1024> Csv;
+        Table.Appendf(TEXT("%-22s %7s %10s %6s %12s\n"), TEXT("Stage"), TEXT("Calls"), TEXT("Seconds"), TEXT("%"), TEXT("Memory MiB"));
+        Csv.Append(TEXT("Stage,Calls,Seconds,Percent,MemoryMiB\n"));
+        double StageSeconds = 0;
+        for (int32 Index = 0; Index < (int32) ECharmImportStage::Num; Index++)
+        {
+            const FStage& Stage = Stages[Index];
+            const TCHAR* Name = GetStageName((ECharmImportStage) Index);
+            const double Percent = TotalSeconds > 0 ? 100.0 * Stage.Seconds / TotalSeconds : 0;
+            Table.Appendf(TEXT("%-22s %7d %10.2f %6.1f %+12.1f\n"), Name, Stage.Calls, Stage.Seconds, Percent, Stage.MemoryDelta / MiB);
+            Csv.Appendf(TEXT("%s,%d,%.3f,%.1f,%.1f\n"), Name, Stage.Calls, Stage.Seconds, Percent, Stage.MemoryDelta / MiB);
+            StageSeconds += Stage.Seconds;
+        }
+        const double OtherSeconds = FMath::Max(TotalSeconds - StageSeconds, 0.0);
+        const double OtherPercent = TotalSeconds > 0 ? 100.0 * OtherSeconds / TotalSeconds : 0;
+        const double TotalMemory = (GetUsedMemory() - StartMemory) / MiB;
+        Table.Appendf(TEXT("%-22s %7s %10.2f %6.1f\n"), TEXT("Other"), TEXT(""), OtherSeconds, OtherPercent);
+        Table.Appendf(TEXT("%-22s %7s %10.2f %6.1f %+12.1f, peak %.1f MiB"), TEXT("Total"), TEXT(""), TotalSeconds, 100.0, TotalMemory,
+            MemoryStats.PeakUsedPhysical / MiB);
+        Csv.Appendf(TEXT("Other,,%.3f,%.1f,\n"), OtherSeconds, OtherPercent);
+        Csv.Appendf(TEXT("Total,,%.3f,100.0,%.1f\n"), TotalSeconds, TotalMemory);
+
+        const FString ReportPath = GetDefaultPath();
+        UE_LOG(LogCTStats, Log, TEXT("Import stages:\n%s"), *Table);
+        if (!FFileHelper::SaveStringToFile(Csv.ToView(), *ReportPath))
+        {
+            UE_LOG(LogCTStats, Warning, TEXT("Failed to write import report %s."), *ReportPath);
+        }
+    }
+
+    FStage Stages[(int32) ECharmImportStage::Num];
+    int32 Depth = 0;
+    double StartSeconds = 0;
+    int64 StartMemory = 0;
+};
@@ -0,0 +1,34 @@
+﻿#pragma once
+
+#include "Commandlets/Commandlet.h"
+#include "CoreMinimal.h"
+
+#include "CT_UsfBenchmarkCommandlet.generated.h"
+
+/**
+ * Headless benchmark and regression check for the USF converter.
+ *
+ * UnrealEditor-Cmd <Project> -run=CharmUsfBenchmark -Export=<ExportDirectory> [-Golden=<Directory>] [-WriteGolden]
+ *     [-CheckCache] [-Iterations=N] -nullrhi -unattended
+ *
+ * Converts the pixel shader of every material in the export with the USF cache off and reports throughput, time per
+ * converter stage, writer allocations and memory. With -Golden the output of the first iteration is compared against
+ * <Golden>/PS_<hash>.usf, -WriteGolden writes those files instead. -CheckCache stores each converted shader in the USF cache
+ * and loads it back, also with its last constant buffer's element list empty, and compares the declarations. Returns
+ * non-zero if a shader fails or differs.
+ */
+UCLASS()
+class CHARMTUNNEL_API UCharmUsfBenchmarkCommandlet : public UCommandlet
+{
+    GENERATED_BODY()
+public:
+    UCharmUsfBenchmarkCommandlet()
+    {
+        IsClient = false;
+        IsEditor = true;
+        IsServer = false;
+        LogToConsole = true;
+    }
+
+    virtual int32 Main(const FString& Params) override;
+};
@@ -24,6 +24,8 @@ public:
 
     FReply OnSelectInfoConfigPathClicked();
     void PopulateDevMap(ULevel* DevLevel);
+    void ImportDevMapAssets(bool bPlaceMaps);
+    FString GetDevMapSignature();
     FReply OnLoadDevMapFullyClicked();
     FReply OnSelectOutputDirectoryClicked();
     FReply OnLoadDevMapAssetsClicked();